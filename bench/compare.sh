@@ -0,0 +1,20 @@
+#!/bin/sh
+# Builds the bot with stock lua and with LuaJIT and runs pluginbench with both
+# on the plugins in the current directory.
+# Usage: bench/compare.sh [iterations] [messages file]
+set -e
+
+src=$(cd "$(dirname "$0")/.." && pwd)
+build=${BUILD_DIR:-/tmp/pb-bench}
+
+for backend in lua luajit; do
+    if [ $backend = luajit ]; then jit=ON; else jit=OFF; fi
+    cmake -S "$src" -B "$build/$backend" -DCMAKE_BUILD_TYPE=Release \
+          -DUSE_LUAJIT=$jit -DBUILD_BENCHMARKS=ON > /dev/null
+    cmake --build "$build/$backend" --target pluginbench > /dev/null
+done
+
+for backend in lua luajit; do
+    "$build/$backend/pluginbench" "$@"
+    echo
+done
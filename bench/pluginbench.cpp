@@ -0,0 +1,148 @@
+/**
+ *  Copyright (C) 2015  Andrew Kallmeyer <fsmv@sapium.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the Lesser GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  Lesser GNU General Public License for more details.
+ *
+ *  You should have received a copy of the Lesser GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Runs the configured plugins against a fixed set of messages and reports
+ * how long each plugin spends per update, so the lua and LuaJIT builds can be
+ * compared on the same plugin set. Telegram calls are not made. The garbage
+ * collection scheduler runs between rounds like it does under steady traffic.
+ *
+ * Usage: pluginbench [iterations] [messages file]
+ * The messages file has one message text per line, run it from the directory
+ * with config.json and plugins/ like the bot.
+ */
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <thread>
+#include <cstdlib>
+
+#include "config.h"
+#include "plugin.h"
+#include "telegram.h"
+#include "asyncio.h"
+#include "gcscheduler.h"
+#include "luacompat.h"
+
+static const char *defaultMessages[] = {
+    "/roll 4d6+2",
+    "/roll 100d20",
+    "/help",
+    "hello there, how is everyone doing today?",
+    "the quick brown fox jumps over the lazy dog",
+    "s/fox/cat/",
+    "/markov",
+};
+
+static json makeUpdate(int id, const std::string &text) {
+    json update;
+    update["update_id"] = id;
+    update["message"]["message_id"] = id;
+    update["message"]["date"] = 0;
+    update["message"]["text"] = text;
+    update["message"]["chat"]["id"] = 1;
+    update["message"]["chat"]["type"] = "private";
+    update["message"]["from"]["id"] = 1;
+    update["message"]["from"]["first_name"] = "bench";
+    return update;
+}
+
+// async runs finish through the io completions, wait for all of them, then
+// give the collector its turn like the dispatcher does after a round
+static void drain(Plugin &plugin, GCScheduler &gc, const PluginSet &set,
+                  size_t handled) {
+    LaneScheduler lanes;
+    plugin.flushBatch(lanes, true);
+    while (lanes.runNext() != LANE_COUNT) {
+    }
+    while (plugin.runsInFlight() != 0) {
+        if (runIOCompletions() == 0) {
+            std::this_thread::yield();
+        }
+    }
+    gc.updatesHandled(handled);
+    gc.busy(set);
+}
+
+int main(int argc, char *argv[]) {
+    int iterations = argc > 1 ? std::atoi(argv[1]) : 1000;
+
+    std::vector<std::string> messages;
+    if (argc > 2) {
+        std::ifstream file(argv[2]);
+        std::string line;
+        while (std::getline(file, line)) {
+            if (!line.empty()) {
+                messages.push_back(line);
+            }
+        }
+    } else {
+        messages.assign(std::begin(defaultMessages), std::end(defaultMessages));
+    }
+
+    Config::loadGlobalConfig();
+    tg_setDryRun(true);
+    startIOWorkers(1);
+
+    auto plugins = loadPlugins();
+
+    std::vector<json> updates;
+    for (size_t i = 0; i < messages.size(); ++i) {
+        updates.push_back(makeUpdate(i + 1, messages[i]));
+    }
+
+    std::cout << PB_LUA_RELEASE << ", " << iterations << " iterations of "
+              << updates.size() << " messages" << std::endl;
+
+    double total = 0;
+    for (auto &plugin : *plugins) {
+        PluginSet set(1, plugin);
+        GCScheduler gc;
+        // warm up so the jit has compiled the hot paths
+        for (auto &update : updates) {
+            plugin->run(update);
+        }
+        drain(*plugin, gc, set, updates.size());
+
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; ++i) {
+            for (auto &update : updates) {
+                plugin->run(update);
+            }
+            drain(*plugin, gc, set, updates.size());
+        }
+        double seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+        total += seconds;
+
+        double perUpdate = seconds / (iterations * updates.size()) * 1e6;
+        std::cout << std::left << std::setw(20) << plugin->getName()
+                  << std::right << std::fixed << std::setprecision(2)
+                  << std::setw(12) << perUpdate << " us/update"
+                  << std::setw(10) << plugin->getAllocator().getPeak() / 1024
+                  << " KiB peak" << std::endl;
+    }
+    std::cout << "total " << std::fixed << std::setprecision(3) << total
+              << " s" << std::endl;
+
+    stopIOWorkers();
+    return 0;
+}
@@ -0,0 +1,57 @@
+/**
+ *  Copyright (C) 2015  Andrew Kallmeyer <fsmv@sapium.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the Lesser GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  Lesser GNU General Public License for more details.
+ *
+ *  You should have received a copy of the Lesser GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ASYNCIO_H_
+#define _ASYNCIO_H_
+
+#include <cstddef>
+#include <functional>
+
+/**
+ * Starts the worker threads that run blocking io for plugins
+ *
+ * @param count the number of threads, at least one is started
+ */
+void startIOWorkers(unsigned int count);
+
+/**
+ * Stops the io workers after their current jobs finish
+ *
+ * Jobs that haven't started and completions that haven't been run are dropped.
+ */
+void stopIOWorkers();
+
+/**
+ * Runs a blocking job on an io worker and then its completion on the
+ * dispatcher thread
+ *
+ * The completion must be what touches lua, the job runs on another thread.
+ *
+ * @param work the blocking part of the job
+ * @param done called from runIOCompletions() after work returns
+ */
+void submitIO(std::function<void()> work, std::function<void()> done);
+
+/**
+ * Runs the completions of all of the finished io jobs
+ *
+ * Only call this from the dispatcher thread.
+ * @return the number of completions run
+ */
+size_t runIOCompletions();
+
+#endif
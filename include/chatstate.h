@@ -0,0 +1,107 @@
+/**
+ *  Copyright (C) 2015  Andrew Kallmeyer <fsmv@sapium.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the Lesser GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  Lesser GNU General Public License for more details.
+ *
+ *  You should have received a copy of the Lesser GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CHATSTATE_H_
+#define _CHATSTATE_H_
+
+#include <string>
+#include <list>
+#include <unordered_map>
+#include <mutex>
+#include <cstdint>
+#include <cstddef>
+#include "json.hpp"
+using json = nlohmann::json;
+
+/**
+ * State a plugin keeps per chat, like karma or settings
+ *
+ * Every plugin has its own keys. The values of each plugin are kept decoded
+ * in an LRU holding at most chat_state_bytes (default 1MB) of serialized
+ * values, so hot chats never touch the database and one plugin can't push
+ * out the state of another. Everything is written through to the Store under
+ * the namespace chat/<plugin>/<chat id>, bypassing its read cache, so it
+ * survives restarts and isn't cached twice. Every operation holds one lock,
+ * so an incr from two runs never loses a count.
+ *
+ * All of the methods are thread safe.
+ */
+class ChatState {
+public:
+    ChatState();
+
+    ChatState(const ChatState &) = delete;
+    ChatState &operator=(const ChatState &) = delete;
+
+    /**
+     * Reads a value
+     *
+     * @param plugin the name of the plugin the value belongs to
+     * @param chat the chat id
+     * @param key the key
+     * @param value set to the value if there is one
+     * @return false if there is no value
+     */
+    bool get(const std::string &plugin, int64_t chat, const std::string &key,
+             json *value);
+
+    /**
+     * Writes a value, null deletes it
+     */
+    void set(const std::string &plugin, int64_t chat, const std::string &key,
+             const json &value);
+
+    /**
+     * Adds to a number, a missing or non-number value counts as 0
+     *
+     * @return the new value
+     */
+    double incr(const std::string &plugin, int64_t chat, const std::string &key,
+                double delta);
+
+    /**
+     * The state of all plugins
+     */
+    static ChatState &global();
+
+private:
+    struct Entry {
+        json value; // null if the key doesn't exist
+        size_t bytes;
+        std::list<std::string>::iterator lru;
+    };
+
+    // the cached values of one plugin
+    struct PluginCache {
+        std::unordered_map<std::string, Entry> entries; // by chat:key
+        std::list<std::string> lru; // most recently used first
+        size_t bytes;
+
+        PluginCache() : bytes(0) {}
+    };
+
+    Entry &load(const std::string &plugin, int64_t chat, const std::string &key);
+    void save(const std::string &plugin, int64_t chat, const std::string &key,
+              const json &value);
+    void trim(PluginCache &cache);
+
+    std::mutex mutex;
+    std::unordered_map<std::string, PluginCache> plugins;
+    size_t maxBytes;
+};
+
+#endif
@@ -21,12 +21,16 @@
 #include <array>
 #include <string>
 #include <memory>
+#include <mutex>
+#include <atomic>
 #include "json.hpp"
 
+class ConfigSaver;
+
 class Config : public nlohmann::json {
 public:
     static Config *loadConfig(const std::string &filename);
-    virtual ~Config() { if (changed) { save(); } }
+    virtual ~Config();
 
     inline bool contains(const std::string &option) const {
         return find(option) != end();
@@ -46,15 +50,71 @@ public:
         }
     }
 
-    inline void set(const std::string &option, nlohmann::json::const_reference value) {
-        (*this)[option] = value;
-    }
+    /**
+     * Sets an option and queues the config to be saved
+     *
+     * Changes must go through here (or hold lock() and call setChanged())
+     * since the config is copied on the saver thread.
+     */
+    void set(const std::string &option, nlohmann::json::const_reference value);
 
+    /**
+     * Locks out the saver thread while modifying the config directly
+     */
+    std::unique_lock<std::mutex> lock() { return std::unique_lock<std::mutex>(mutex); }
+
+    /**
+     * Writes the config now if it changed, on the calling thread
+     */
     void save();
-    void setChanged() { changed = true; }
+
+    /**
+     * Marks the config changed, the ConfigSaver writes it in the background
+     */
+    void setChanged();
+
+    const std::string &getFilename() const { return filename; }
+
+    /**
+     * Replaces the contents with a newer version of the file
+     *
+     * Unsaved changes win over the file, they overwrite it once they're saved.
+     * @param contents the parsed file
+     * @return false if nothing changed
+     */
+    bool reload(const nlohmann::json &contents);
 
     static void loadGlobalConfig();
-    static const Config *global() { return m_global.get(); }
+
+    /**
+     * The current global config
+     *
+     * Never waits for a reload. A reload publishes a new immutable snapshot,
+     * an old one is freed once nobody holds it. Keep the returned pointer
+     * while working with references into the config, but read it again for
+     * each new unit of work so that reloaded values are picked up.
+     */
+    static std::shared_ptr<const Config> global() { return std::atomic_load(&m_global); }
+
+    /**
+     * Counts the global config reloads, for caches of options to notice them
+     */
+    static unsigned generation() { return m_generation.load(std::memory_order_acquire); }
+
+    /**
+     * Reloads config.json, keeping the current one if the new one is broken
+     *
+     * @return false if the new config wasn't used
+     */
+    static bool reloadGlobalConfig();
+
+    /**
+     * Starts reloading config.json whenever it is written
+     *
+     * @return false if the file can't be watched
+     */
+    static bool watchGlobalConfig();
+    static void stopWatchingGlobalConfig();
 
 
     static const std::string PB_VERSION;
@@ -63,10 +123,26 @@ private:
     Config(const nlohmann::json &config, const std::string &filename);
     Config(const std::string &filename);
 
-    static std::unique_ptr<Config> m_global;
+    friend class ConfigSaver;
+
+    /**
+     * Copies the config if it changed and marks it saved
+     *
+     * @return false if there was nothing to save
+     */
+    bool snapshot(nlohmann::json *data);
+
+    static bool checkGlobal(const Config &config);
+    static void publishGlobal(std::unique_ptr<Config> config);
+
+    static std::shared_ptr<const Config> m_global;
+    static std::atomic<unsigned> m_generation;
 
     std::string filename;
+    std::mutex mutex;
     bool changed;
+    // set while the config is queued in the ConfigSaver
+    std::atomic<bool> scheduled;
 };
 
 #endif
@@ -0,0 +1,98 @@
+/**
+ *  Copyright (C) 2015  Andrew Kallmeyer <fsmv@sapium.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the Lesser GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  Lesser GNU General Public License for more details.
+ *
+ *  You should have received a copy of the Lesser GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CONFIGSAVER_H_
+#define _CONFIGSAVER_H_
+
+#include <string>
+#include <map>
+#include <unordered_set>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+
+class Config;
+
+/**
+ * Writes changed configs to disk on a background thread
+ *
+ * A config that calls setChanged() is written config_save_ms later, so any
+ * number of changes in between cost one write and the thread that made them
+ * never waits for the disk. Files are written compactly to a temporary file
+ * that is then renamed over the old one, a crash never leaves half a config.
+ *
+ * All of the methods are thread safe.
+ */
+class ConfigSaver {
+public:
+    ConfigSaver();
+    ~ConfigSaver();
+
+    ConfigSaver(const ConfigSaver &) = delete;
+    ConfigSaver &operator=(const ConfigSaver &) = delete;
+
+    /**
+     * Starts the saver thread, configured from the global config
+     */
+    void start();
+
+    /**
+     * Writes every waiting config and stops the thread
+     *
+     * Configs changed after this are written when they're destroyed.
+     */
+    void stop();
+
+    /**
+     * Queues a changed config to be written
+     *
+     * @return false if the saver isn't running
+     */
+    bool schedule(Config *config);
+
+    /**
+     * Removes a config from the queue, call it before the config is destroyed
+     */
+    void forget(Config *config);
+
+    /**
+     * Atomically replaces a file with new contents
+     *
+     * @param filename the file to replace
+     * @param data the new contents
+     * @return false if the file couldn't be written, the old file is untouched
+     */
+    static bool writeFile(const std::string &filename, const std::string &data);
+
+    static ConfigSaver &global();
+
+private:
+    void saver();
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::unordered_set<Config *> dirty;
+    // files that failed to write, tried again with the next batch
+    std::map<std::string, std::string> failed;
+    std::chrono::milliseconds interval;
+    bool running;
+    bool stopping;
+    std::thread thread;
+};
+
+#endif
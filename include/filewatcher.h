@@ -0,0 +1,80 @@
+/**
+ *  Copyright (C) 2015  Andrew Kallmeyer <fsmv@sapium.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the Lesser GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  Lesser GNU General Public License for more details.
+ *
+ *  You should have received a copy of the Lesser GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _FILEWATCHER_H_
+#define _FILEWATCHER_H_
+
+#include <string>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <functional>
+
+/**
+ * Watches a directory and reports files that were written to it
+ *
+ * Editors tend to touch a file several times when saving, so changes are
+ * collected until the directory has been quiet for the debounce time and then
+ * the callback is called once per changed file, from the watcher thread. A
+ * directory that is never quiet, like one being synced, is still reported
+ * once the first change is maxDelay old.
+ *
+ * Only supported on linux (inotify), elsewhere start() fails.
+ */
+class FileWatcher {
+public:
+    typedef std::function<void(const std::string &file)> Callback;
+
+    /**
+     * @param dir the directory to watch
+     * @param callback called with the name (not the path) of changed files
+     * @param debounce how long the directory must be quiet before reporting
+     * @param maxDelay the longest a change waits for the directory to be quiet
+     */
+    FileWatcher(const std::string &dir, Callback callback,
+                std::chrono::milliseconds debounce = std::chrono::milliseconds(200),
+                std::chrono::milliseconds maxDelay = std::chrono::milliseconds(2000));
+    ~FileWatcher();
+
+    FileWatcher(const FileWatcher &) = delete;
+    FileWatcher &operator=(const FileWatcher &) = delete;
+
+    /**
+     * Starts the watcher thread
+     *
+     * @return false if the directory could not be watched
+     */
+    bool start();
+
+    /**
+     * Stops the watcher thread, called by the destructor
+     */
+    void stop();
+
+private:
+    void watchLoop();
+
+    std::string dir;
+    Callback callback;
+    std::chrono::milliseconds debounce;
+    std::chrono::milliseconds maxDelay;
+    int fd;
+    std::atomic<bool> running;
+    std::thread thread;
+};
+
+#endif
@@ -0,0 +1,128 @@
+/**
+ *  Copyright (C) 2015  Andrew Kallmeyer <fsmv@sapium.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the Lesser GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  Lesser GNU General Public License for more details.
+ *
+ *  You should have received a copy of the Lesser GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _FLOODFILTER_H_
+#define _FLOODFILTER_H_
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <chrono>
+#include "json.hpp"
+#include "metrics.h"
+using json = nlohmann::json;
+
+/**
+ * A fixed number of token buckets indexed by a hash of the key
+ *
+ * Each key may take burst tokens at once, and tokens come back at rate per
+ * second. A bucket remembers the key it belongs to and starts over full when
+ * a different key hashes to it, so memory never grows with the number of
+ * keys. Two keys that are active at the same time and hash to the same bucket
+ * keep resetting it, which can only let them through more often, never drop
+ * an innocent key because of the other.
+ */
+class TokenBuckets {
+public:
+    /**
+     * @param count the number of buckets, rounded up to a power of two
+     * @param rate tokens per second, 0 for no limit
+     * @param burst the most tokens a bucket holds
+     */
+    TokenBuckets(size_t count, double rate, double burst);
+
+    /**
+     * Takes a token from the key's bucket
+     *
+     * @param key the user or chat id
+     * @param now the current time
+     * @param first set to true when this is the key's first refusal since it
+     *        last got a token, may be nullptr
+     * @return false if the bucket is empty
+     */
+    bool take(int64_t key, std::chrono::steady_clock::time_point now,
+              bool *first = nullptr);
+
+    /**
+     * Changes the limits, the buckets keep their tokens
+     */
+    void setLimits(double rate, double burst);
+
+private:
+    struct Bucket {
+        int64_t key;
+        double tokens;
+        std::chrono::steady_clock::time_point updated;
+        bool limited;
+    };
+
+    std::vector<Bucket> buckets;
+    size_t mask;
+    double rate;
+    double burst;
+};
+
+/**
+ * Drops updates from users and chats that send faster than their limit,
+ * before any plugin sees them
+ *
+ * Off unless flood_control is set. The limits are read from the global
+ * config: flood_user_rate (messages per second, default 1) and
+ * flood_user_burst (default 5) per sender, flood_chat_rate (default 5) and
+ * flood_chat_burst (default 20) per chat, and flood_buckets (default 4096)
+ * buckets for each. The first dropped update of a sender or chat is logged at
+ * INFO, the rest until it gets through again at DEBUG. The counts are exported
+ * as pb_flood_allowed_total and pb_flood_dropped_total.
+ *
+ * allow() is only called by the dispatcher, the counters can be read from any
+ * thread.
+ */
+class FloodFilter {
+public:
+    FloodFilter();
+
+    /**
+     * Reads the limits again, after the global config was reloaded
+     *
+     * The number of buckets only changes with a restart.
+     */
+    void configure();
+
+    /**
+     * Checks an update against the limits of its sender and chat
+     *
+     * Updates without a sender or chat are always allowed.
+     * @param update the Update object from telegram
+     * @return false if the update should be dropped
+     */
+    bool allow(const json &update);
+
+    uint64_t getAllowed() const { return allowed.value(); }
+    uint64_t getUserDropped() const { return userDropped.value(); }
+    uint64_t getChatDropped() const { return chatDropped.value(); }
+
+private:
+    bool enabled;
+    TokenBuckets users;
+    TokenBuckets chats;
+
+    Counter &allowed;
+    Counter &userDropped;
+    Counter &chatDropped;
+};
+
+#endif
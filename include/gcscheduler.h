@@ -0,0 +1,96 @@
+/**
+ *  Copyright (C) 2015  Andrew Kallmeyer <fsmv@sapium.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the Lesser GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  Lesser GNU General Public License for more details.
+ *
+ *  You should have received a copy of the Lesser GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _GCSCHEDULER_H_
+#define _GCSCHEDULER_H_
+
+#include <chrono>
+#include <cstddef>
+#include "plugin.h"
+
+/**
+ * Moves lua garbage collection into the time between updates
+ *
+ * When the dispatcher has nothing to do it hands the plugins to idle() which
+ * runs incremental collection steps on them in turn, a small time budget per
+ * call, so the allocation debt is paid off before the next message comes in.
+ * After a burst of updates each plugin also gets one full collection. When
+ * updates keep coming so the dispatcher is never idle, busy() runs the same
+ * slices once gc_max_busy_ms has passed without one.
+ */
+class GCScheduler {
+public:
+    /**
+     * Reads the gc_idle_budget_us, gc_idle_interval_ms, gc_burst_updates and
+     * gc_max_busy_ms options from the global config
+     */
+    GCScheduler();
+
+    /**
+     * Reads the options again, after the global config was reloaded
+     */
+    void configure();
+
+    /**
+     * Tells the scheduler how many updates were just dispatched
+     *
+     * @param count the number of updates
+     */
+    void updatesHandled(size_t count);
+
+    /**
+     * Does at most one budget worth of collection work
+     *
+     * @param plugins the plugins to collect
+     */
+    void idle(const PluginSet &plugins);
+
+    /**
+     * Called after each round of dispatched updates, does one budget worth
+     * of collection work if idle() wasn't called for too long
+     *
+     * @param plugins the plugins to collect
+     */
+    void busy(const PluginSet &plugins);
+
+    /**
+     * How long the dispatcher should wait for updates before calling idle()
+     */
+    std::chrono::milliseconds nextWait() const;
+
+private:
+    bool needsWork(Plugin &plugin) const;
+    void slice(const PluginSet &plugins);
+
+    std::chrono::microseconds budget;
+    std::chrono::milliseconds interval;
+    size_t burstUpdates;
+    std::chrono::milliseconds maxBusy;
+
+    //!updates dispatched since the last round of full collections
+    size_t handled;
+    //!plugins left to fully collect after a burst
+    size_t pendingFull;
+    //!true if some plugin may still have collection work to do
+    bool pending;
+    //!round robin position in the plugins list
+    size_t next;
+    //!when the last slice ran
+    std::chrono::steady_clock::time_point lastSlice;
+};
+
+#endif
@@ -0,0 +1,95 @@
+/**
+ *  Copyright (C) 2015  Andrew Kallmeyer <fsmv@sapium.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the Lesser GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  Lesser GNU General Public License for more details.
+ *
+ *  You should have received a copy of the Lesser GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HTTP_H_
+#define _HTTP_H_
+
+#include <string>
+#include <list>
+#include <memory>
+
+namespace curlpp {
+    class Easy;
+}
+
+/**
+ * A curl handle borrowed from the shared connection pool
+ *
+ * curl keeps connections open on a handle between requests, so reusing
+ * handles gives keep-alive to every host the bot talks to. Creating one blocks
+ * while http_max_connections handles are already in use. Plugin fetches may
+ * only hold http_max_fetch_connections of them, so slow fetches can't keep
+ * the bot's telegram calls waiting. The handle is reset and given back to the
+ * pool when this is destroyed.
+ */
+class PooledHandle {
+public:
+    /**
+     * @param fetch true if the handle is for a plugin's fetch
+     */
+    explicit PooledHandle(bool fetch = false);
+    ~PooledHandle();
+
+    PooledHandle(const PooledHandle &) = delete;
+    PooledHandle &operator=(const PooledHandle &) = delete;
+
+    curlpp::Easy &operator*() { return *handle; }
+    curlpp::Easy *operator->() { return handle.get(); }
+
+private:
+    std::unique_ptr<curlpp::Easy> handle;
+    bool fetch;
+};
+
+struct HttpRequest {
+    std::string url;
+    // GET, POST, or any other method
+    std::string method;
+    // sent as the request body if it isn't empty
+    std::string body;
+    // complete header lines, ex: "Accept: text/plain"
+    std::list<std::string> headers;
+    // 0 for the http_timeout_ms option
+    long timeoutMs;
+    // seconds to cache a successful GET response, 0 to not use the cache
+    int cacheTTL;
+
+    HttpRequest() : method("GET"), timeoutMs(0), cacheTTL(0) {}
+};
+
+struct HttpResponse {
+    // the http status code, 0 if the request failed
+    long status;
+    std::string body;
+    // description of the failure if status is 0
+    std::string error;
+
+    HttpResponse() : status(0) {}
+};
+
+/**
+ * Performs an http request for a plugin using a pooled connection
+ *
+ * Blocks until the request finishes, use from an io worker. Cached responses
+ * are shared by requests with the same url and headers.
+ *
+ * @param request the request to make
+ * @return the response, possibly from the cache
+ */
+HttpResponse httpFetch(const HttpRequest &request);
+
+#endif
@@ -0,0 +1,102 @@
+/**
+ *  Copyright (C) 2015  Andrew Kallmeyer <fsmv@sapium.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the Lesser GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  Lesser GNU General Public License for more details.
+ *
+ *  You should have received a copy of the Lesser GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _LANES_H_
+#define _LANES_H_
+
+#include <deque>
+#include <string>
+#include <chrono>
+#include <functional>
+#include <cstddef>
+
+/**
+ * The priority classes of plugin runs
+ */
+enum Lane {
+    //!commands and matches, someone is waiting for the reply
+    LANE_INTERACTIVE,
+    //!alwaysTrigger runs, nobody is waiting on them
+    LANE_BACKGROUND,
+    LANE_COUNT
+};
+
+/**
+ * Queues plugin runs in priority lanes for the dispatcher
+ *
+ * Interactive runs go first so a slow background plugin doesn't hold up
+ * command replies. So that a steady stream of commands can't starve the
+ * background lane, one background run is let through after every
+ * lane_background_every interactive runs, or as soon as the oldest
+ * background run has waited lane_max_delay_ms.
+ *
+ * Only use it from the dispatcher thread.
+ */
+class LaneScheduler {
+public:
+    /**
+     * Reads the lane_background_every and lane_max_delay_ms options from the
+     * global config
+     */
+    LaneScheduler();
+
+    /**
+     * Reads the options again, after the global config was reloaded
+     */
+    void configure();
+
+    /**
+     * Queues a run
+     *
+     * @param lane the lane to queue it in
+     * @param job the run
+     */
+    void push(Lane lane, std::function<void()> job);
+
+    /**
+     * Runs the next job by priority
+     *
+     * @return the lane of the job that ran, LANE_COUNT if nothing was queued
+     */
+    Lane runNext();
+
+    bool empty() const { return size(LANE_INTERACTIVE) + size(LANE_BACKGROUND) == 0; }
+    size_t size(Lane lane) const { return lanes[lane].size(); }
+
+    /**
+     * Parses a lane name, "interactive" or "background"
+     *
+     * @param name the name
+     * @param lane set to the lane if the name is known
+     * @return false if the name isn't a lane
+     */
+    static bool parseLane(const std::string &name, Lane *lane);
+
+private:
+    struct Job {
+        std::function<void()> run;
+        std::chrono::steady_clock::time_point queued;
+    };
+
+    std::deque<Job> lanes[LANE_COUNT];
+    size_t backgroundEvery;
+    std::chrono::milliseconds maxDelay;
+    //!interactive runs since the last background run
+    size_t streak;
+};
+
+#endif
@@ -26,8 +26,13 @@
 #define _LOGGER_H_
 
 #include <cstdio>
+#include <cstddef>
+#include <cstdint>
 #include <string>
+#include <sstream>
 #include <memory>
+#include <atomic>
+#include <chrono>
 #include <functional>
 
 /**
@@ -49,11 +54,60 @@
  * with a name for your class. For example: "static Logger logger("my class")"
  * Then in any method of that class call the appropriate logging method with
  * your message.
+ *
+ * Prefer the LOG_ERROR, LOG_WARN, LOG_INFO and LOG_DEBUG macros, which take a
+ * format string where each {} is replaced by the next argument:
+ * LOG_DEBUG(logger, "Update {} from {}", update, ip). The arguments are only
+ * evaluated and formatted if the message will be logged, and levels above
+ * PB_LOG_COMPILED_LEVEL are removed at compile time.
+ *
+ * Once startAsync() is called messages are copied into a lock free ring buffer
+ * owned by the calling thread and a background thread timestamps, formats and
+ * writes them, so logging costs the caller a memcpy. Before that, and after
+ * stopAsync(), messages are written right away under a lock.
  */
 class Logger {
 public:
     enum LogLevel { LVL_ERROR, LVL_WARN, LVL_INFO, LVL_DEBUG };
 
+    //!How messages are written to the log file
+    enum Format {
+        //!one line of text per message, like the console
+        FORMAT_TEXT,
+        //!one JSON object per line, read it with pblog
+        FORMAT_JSON
+    };
+
+    /**
+     * Tags the messages logged by the current thread with an update
+     *
+     * The previous context comes back when it goes out of scope.
+     */
+    class Context {
+    public:
+        /**
+         * @param updateId the update being handled, 0 for none
+         * @param chatId the chat it came from, 0 for none
+         */
+        Context(int64_t updateId, int64_t chatId);
+        ~Context();
+
+        Context(const Context &) = delete;
+        Context &operator=(const Context &) = delete;
+
+    private:
+        int64_t oldUpdateId;
+        int64_t oldChatId;
+    };
+
+    //!What a thread does when its ring buffer is full
+    enum OverflowPolicy {
+        //!wait for the logging thread to make room
+        OVERFLOW_BLOCK,
+        //!drop the message, the number dropped is logged later
+        OVERFLOW_DROP
+    };
+
     /**
      * Construct a new instance with a "class name" to use
      *
@@ -108,6 +162,41 @@ public:
         log(LVL_DEBUG, message.c_str());
     }
 
+    /**
+     * Formats and logs a message, check willLog() first (the macros do)
+     *
+     * @param level the level to log at
+     * @param format the message with a {} for each argument
+     * @param args the values for the {}s, anything that has operator<<
+     */
+    template<typename... Args>
+    void logf(LogLevel level, const char *format, const Args &... args) {
+        std::string message;
+        Logger::format(message, format, args...);
+        log(level, message.c_str());
+    }
+
+    /**
+     * Appends format to out with each {} replaced by the next argument, {{
+     * and }} are a literal brace
+     */
+    template<typename T, typename... Args>
+    static void format(std::string &out, const char *format, const T &arg,
+                       const Args &... args) {
+        format = appendLiteral(out, format);
+        if (*format) {
+            appendValue(out, arg);
+            Logger::format(out, format + 2, args...);
+        }
+    }
+
+    static void format(std::string &out, const char *format) {
+        while (*(format = appendLiteral(out, format))) {
+            out += "{}"; // more {}s than arguments
+            format += 2;
+        }
+    }
+
     /**
      * Determines whether or not the logger will log at a given level or not
      *
@@ -154,6 +243,61 @@ public:
      */
     static void setLogFile(const char *file);
 
+    /**
+     * Sets the format of the log file, the console always gets text
+     *
+     * @param format the format
+     */
+    static void setFormat(Format format);
+
+    /**
+     * Parses a format name, "text" or "json"
+     *
+     * @param format the name
+     * @return the format, FORMAT_TEXT if the name is unknown
+     */
+    static Format parseFormat(const char *format);
+
+    /**
+     * Starts a new log file when the current one gets too big or too old
+     *
+     * The old files are renamed to file.1, file.2 and so on, the oldest
+     * beyond keep are deleted.
+     * @param maxBytes the size to rotate at, 0 for no limit
+     * @param maxAge the age to rotate at, 0 for no limit
+     * @param keep how many old files to keep
+     */
+    static void setRotation(size_t maxBytes, std::chrono::seconds maxAge, unsigned keep);
+
+    /**
+     * Starts the background logging thread
+     *
+     * The buffered messages are written when the program exits.
+     * @param bufferRecords the size of each thread's ring buffer in records,
+     *        a record holds about 200 characters of a message and longer
+     *        messages than fit in the whole buffer are cut
+     * @param policy what to do when a thread's buffer is full
+     */
+    static void startAsync(size_t bufferRecords, OverflowPolicy policy);
+
+    /**
+     * Writes the buffered messages and stops the logging thread
+     */
+    static void stopAsync();
+
+    /**
+     * Returns the number of messages dropped because a buffer was full
+     */
+    static uint64_t getDropped();
+
+    /**
+     * Parses an overflow policy name, "block" or "drop"
+     *
+     * @param policy the name
+     * @return the policy, OVERFLOW_BLOCK if the name is unknown
+     */
+    static OverflowPolicy parseOverflowPolicy(const char *policy);
+
     /**
      * Returns the global log level
      * @returns the global log level
@@ -206,11 +350,51 @@ private:
     static const char *levelStr[4];
 
     //!The global log level shared by all instances
-    static LogLevel globalLevel;
+    static std::atomic<int> globalLevel;
 
     //!The global log file which all instances log to
     static std::unique_ptr<FILE, std::function<void(FILE*)>> logFile;
 
+    //!Appends format up to the first {}, returns where it stopped
+    static const char *appendLiteral(std::string &out, const char *format);
+
+    static void appendValue(std::string &out, const std::string &value) { out += value; }
+    static void appendValue(std::string &out, const char *value) { out += value ? value : "(null)"; }
+    static void appendValue(std::string &out, char *value) { appendValue(out, (const char *)value); }
+    static void appendValue(std::string &out, char value) { out += value; }
+    static void appendValue(std::string &out, int value) { out += std::to_string(value); }
+    static void appendValue(std::string &out, long value) { out += std::to_string(value); }
+    static void appendValue(std::string &out, long long value) { out += std::to_string(value); }
+    static void appendValue(std::string &out, unsigned value) { out += std::to_string(value); }
+    static void appendValue(std::string &out, unsigned long value) { out += std::to_string(value); }
+    static void appendValue(std::string &out, unsigned long long value) { out += std::to_string(value); }
+
+    template<typename T>
+    static void appendValue(std::string &out, const T &value) {
+        std::ostringstream stream;
+        stream << value;
+        out += stream.str();
+    }
+
+    //!Prints a message to the console and the log file, hold the output lock
+    struct Line {
+        std::chrono::system_clock::time_point time;
+        const char *timeStr;
+        LogLevel level;
+        const char *name;
+        const char *message;
+        bool flush;
+        int64_t updateId;
+        int64_t chatId;
+    };
+
+    static void write(const Line &line);
+
+    //!Starts the next log file if the current one is due, hold the output lock
+    static void rotate(std::chrono::system_clock::time_point now);
+
+    friend class LogBackend;
+
     //!The name of this logger instance which gets printed in each message
     const char *name;
     //!The log level for this instance which may override the global level
@@ -219,4 +403,29 @@ private:
     bool forceFlush;
 };
 
+/**
+ * The most verbose level that is compiled in, statements logging above it
+ * are removed. Release builds (NDEBUG) drop debug messages unless it is set.
+ */
+#ifndef PB_LOG_COMPILED_LEVEL
+#ifdef NDEBUG
+#define PB_LOG_COMPILED_LEVEL 2 // Logger::LVL_INFO
+#else
+#define PB_LOG_COMPILED_LEVEL 3 // Logger::LVL_DEBUG
+#endif
+#endif
+
+//the constant check folds away, the arguments aren't evaluated unless logged
+#define PB_LOG(logger, level, ...) \
+    do { \
+        if ((level) <= PB_LOG_COMPILED_LEVEL && (logger).willLog(level)) { \
+            (logger).logf((level), __VA_ARGS__); \
+        } \
+    } while (0)
+
+#define LOG_ERROR(logger, ...) PB_LOG(logger, Logger::LVL_ERROR, __VA_ARGS__)
+#define LOG_WARN(logger, ...) PB_LOG(logger, Logger::LVL_WARN, __VA_ARGS__)
+#define LOG_INFO(logger, ...) PB_LOG(logger, Logger::LVL_INFO, __VA_ARGS__)
+#define LOG_DEBUG(logger, ...) PB_LOG(logger, Logger::LVL_DEBUG, __VA_ARGS__)
+
 #endif
@@ -0,0 +1,137 @@
+/**
+ *  Copyright (C) 2015  Andrew Kallmeyer <fsmv@sapium.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the Lesser GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  Lesser GNU General Public License for more details.
+ *
+ *  You should have received a copy of the Lesser GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _LUAALLOC_H_
+#define _LUAALLOC_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <vector>
+#include <chrono>
+
+/**
+ * Memory allocator for a single plugin's lua_State
+ *
+ * Small blocks come from per size class free lists that are carved out of
+ * larger arenas, so the churn of short lived message strings doesn't go
+ * through malloc. Blocks bigger than the largest size class go to the system
+ * allocator. Every block counts against an optional hard limit, once the
+ * limit is hit lua gets NULL back and raises a memory error in the plugin
+ * instead of growing the whole process.
+ *
+ * The allocation itself is not thread safe (neither is the lua_State), but the
+ * counters may be read from any thread.
+ */
+class LuaAllocator {
+public:
+    struct Stats {
+        //!bytes currently handed out to lua
+        size_t used;
+        //!highest value used has ever reached
+        size_t peak;
+        //!bytes held in arenas, including free pooled blocks
+        size_t reserved;
+        //!the hard limit, 0 if unlimited
+        size_t limit;
+        //!number of new blocks requested by lua
+        uint64_t allocations;
+        //!number of blocks freed by lua
+        uint64_t frees;
+        //!number of requests refused because of the limit
+        uint64_t failures;
+        //!allocations per second since the previous call to sample()
+        double allocationRate;
+    };
+
+    /**
+     * @param limit the maximum number of bytes lua may use, 0 for no limit
+     */
+    LuaAllocator(size_t limit = 0);
+    ~LuaAllocator();
+
+    LuaAllocator(const LuaAllocator &) = delete;
+    LuaAllocator &operator=(const LuaAllocator &) = delete;
+
+    /**
+     * The lua_Alloc function, pass the LuaAllocator as the user data
+     */
+    static void *alloc(void *ud, void *ptr, size_t osize, size_t nsize);
+
+    size_t getUsed() const { return used.load(std::memory_order_relaxed); }
+    size_t getPeak() const { return peak.load(std::memory_order_relaxed); }
+    size_t getLimit() const { return limit.load(std::memory_order_relaxed); }
+
+    /**
+     * Sets the hard memory limit
+     *
+     * Lowering the limit below the current usage does not free anything, it
+     * only makes further growth fail.
+     *
+     * @param limit the maximum number of bytes, 0 for no limit
+     */
+    void setLimit(size_t limit) {
+        this->limit.store(limit, std::memory_order_relaxed);
+    }
+
+    /**
+     * Reads the counters and computes the allocation rate since the last call
+     *
+     * Only call this from one thread at a time.
+     * @return the current statistics
+     */
+    Stats sample();
+
+private:
+    static const size_t GRANULARITY = 16;
+    static const size_t MAX_POOLED = 512;
+    static const size_t NUM_CLASSES = MAX_POOLED / GRANULARITY;
+    static const size_t ARENA_SIZE = 64 * 1024;
+
+    struct FreeBlock {
+        FreeBlock *next;
+    };
+
+    //!the number of bytes a request of the given size really takes up
+    static inline size_t blockSize(size_t size) {
+        if (size <= MAX_POOLED) {
+            return (size + GRANULARITY - 1) / GRANULARITY * GRANULARITY;
+        }
+        return size;
+    }
+
+    void *reallocate(void *ptr, size_t osize, size_t nsize);
+    void *allocPooled(size_t size);
+    void freePooled(void *ptr, size_t size);
+    void reserveArenaSlot();
+    //!turns a malloc'd block into pool memory that is freed with the arenas
+    void adoptBlock(void *ptr, size_t size);
+    void addUsed(size_t bytes);
+
+    FreeBlock *freeLists[NUM_CLASSES];
+    std::vector<char *> arenas;
+    char *arenaNext;
+    size_t arenaLeft;
+
+    std::atomic<size_t> used, peak, limit, reserved;
+    std::atomic<uint64_t> allocations, frees, failures;
+
+    uint64_t lastAllocations;
+    std::chrono::steady_clock::time_point lastSample;
+};
+
+#endif
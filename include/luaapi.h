@@ -35,4 +35,13 @@ struct Plugin;
  */
 void injectAPIFunctions(lua_State *L);
 
+/**
+ * Pushes a json object or array onto the stack as a lua table
+ *
+ * Arrays become tables with keys starting at 1.
+ * @param L the stack to push onto
+ * @param j the object or array to push
+ */
+void pushJsonTable(lua_State *L, const json &j);
+
 #endif
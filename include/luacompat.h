@@ -0,0 +1,56 @@
+/**
+ *  Copyright (C) 2015  Andrew Kallmeyer <fsmv@sapium.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the Lesser GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  Lesser GNU General Public License for more details.
+ *
+ *  You should have received a copy of the Lesser GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _LUACOMPAT_H_
+#define _LUACOMPAT_H_
+
+/**
+ * Includes the lua headers and papers over the differences between lua 5.2
+ * and LuaJIT (which has the lua 5.1 api) for the functions the bot uses.
+ *
+ * Build with -DUSE_LUAJIT=ON to use LuaJIT, which defines PB_LUAJIT.
+ */
+
+extern "C" {
+    #include "lua.h"
+    #include "lualib.h"
+    #include "lauxlib.h"
+#ifdef PB_LUAJIT
+    #include "luajit.h"
+#endif
+}
+
+#if LUA_VERSION_NUM < 502
+
+#ifndef LUA_OK
+#define LUA_OK 0
+#endif
+
+#define lua_rawlen(L, idx) lua_objlen(L, idx)
+
+// 5.1 resumes without the thread doing the resuming
+#define lua_resume(L, from, nargs) lua_resume(L, nargs)
+
+#endif
+
+#ifdef PB_LUAJIT
+#define PB_LUA_RELEASE LUAJIT_VERSION
+#else
+#define PB_LUA_RELEASE LUA_RELEASE
+#endif
+
+#endif
@@ -0,0 +1,203 @@
+/**
+ *  Copyright (C) 2015  Andrew Kallmeyer <fsmv@sapium.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the Lesser GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  Lesser GNU General Public License for more details.
+ *
+ *  You should have received a copy of the Lesser GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <string>
+#include <map>
+#include <memory>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <cstddef>
+#include <cstdint>
+
+//!number of slots each counter is split into, threads share them round robin
+static const size_t METRIC_SHARDS = 16;
+
+/**
+ * The slot of the calling thread
+ */
+inline size_t metricShard() {
+    static std::atomic<size_t> next(0);
+    static thread_local size_t shard = next++ % METRIC_SHARDS;
+    return shard;
+}
+
+class Metric {
+public:
+    virtual ~Metric() {}
+
+    /**
+     * Appends the samples in the prometheus text format
+     *
+     * @param name the metric name
+     * @param labels the labels, like plugin="echo", may be empty
+     */
+    virtual void write(std::string &out, const std::string &name,
+                       const std::string &labels) const = 0;
+};
+
+/**
+ * A count that only goes up
+ *
+ * Each thread adds to its own slot with a relaxed atomic, so counting never
+ * waits on another thread. Reading adds up the slots.
+ */
+class Counter : public Metric {
+public:
+    Counter();
+
+    void add(uint64_t n = 1) {
+        shards[metricShard()].value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    uint64_t value() const;
+
+    void write(std::string &out, const std::string &name,
+               const std::string &labels) const override;
+
+private:
+    // padded to a cache line so threads don't fight over it
+    struct Shard {
+        std::atomic<uint64_t> value;
+        char padding[64 - sizeof(std::atomic<uint64_t>)];
+    };
+    Shard shards[METRIC_SHARDS];
+};
+
+/**
+ * A value that is set, like a queue length
+ */
+class Gauge : public Metric {
+public:
+    Gauge() : current(0) {}
+
+    void set(int64_t value) { current.store(value, std::memory_order_relaxed); }
+    int64_t value() const { return current.load(std::memory_order_relaxed); }
+
+    void write(std::string &out, const std::string &name,
+               const std::string &labels) const override;
+
+private:
+    std::atomic<int64_t> current;
+};
+
+/**
+ * Counts durations in fixed buckets from 100us to 10s, sharded like Counter
+ */
+class Histogram : public Metric {
+public:
+    static const size_t NUM_BUCKETS = 15;
+
+    Histogram();
+
+    void observe(std::chrono::nanoseconds duration);
+
+    void write(std::string &out, const std::string &name,
+               const std::string &labels) const override;
+
+private:
+    struct Shard {
+        // the last one is the overflow bucket, +Inf
+        std::atomic<uint64_t> buckets[NUM_BUCKETS + 1];
+        std::atomic<uint64_t> count;
+        std::atomic<uint64_t> nanoseconds;
+    };
+    Shard shards[METRIC_SHARDS];
+};
+
+/**
+ * Times a block and adds it to a histogram when it goes out of scope
+ */
+class ScopedTimer {
+public:
+    explicit ScopedTimer(Histogram &histogram)
+        : histogram(histogram), start(std::chrono::steady_clock::now()) {}
+    ~ScopedTimer() { histogram.observe(std::chrono::steady_clock::now() - start); }
+
+    ScopedTimer(const ScopedTimer &) = delete;
+    ScopedTimer &operator=(const ScopedTimer &) = delete;
+
+private:
+    Histogram &histogram;
+    std::chrono::steady_clock::time_point start;
+};
+
+/**
+ * Every metric of the bot, served on /metrics in the prometheus text format
+ *
+ * Looking a metric up takes a lock, so keep the reference it returns instead
+ * of looking it up on every update. Metrics are never removed, the references
+ * stay valid for the life of the program.
+ */
+class Metrics {
+public:
+    /**
+     * Finds or creates a metric
+     *
+     * @param name the metric name, like pb_updates_received_total
+     * @param help the description, only used the first time the name is seen
+     * @param labels the labels built with label(), empty for none
+     */
+    Counter &counter(const std::string &name, const std::string &help,
+                     const std::string &labels = "");
+    Gauge &gauge(const std::string &name, const std::string &help,
+                 const std::string &labels = "");
+    Histogram &histogram(const std::string &name, const std::string &help,
+                         const std::string &labels = "");
+
+    /**
+     * Adds a function that updates gauges right before they are rendered,
+     * for values that are cheaper to read than to keep up to date
+     */
+    void addCollector(std::function<void()> collector);
+
+    /**
+     * Renders every metric in the prometheus text format
+     */
+    std::string render();
+
+    /**
+     * Formats a label, escaping the value
+     *
+     * @return key="value"
+     */
+    static std::string label(const std::string &key, const std::string &value);
+
+    static Metrics &global();
+
+private:
+    struct Family {
+        std::string type;
+        std::string help;
+        std::map<std::string, std::unique_ptr<Metric>> metrics;
+    };
+
+    template<typename T>
+    T &get(const std::string &name, const char *type, const std::string &help,
+           const std::string &labels);
+
+    std::mutex mutex;
+    std::map<std::string, Family> families;
+    std::vector<std::function<void()>> collectors;
+};
+
+#endif
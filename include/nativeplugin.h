@@ -0,0 +1,127 @@
+/**
+ *  Copyright (C) 2015  Andrew Kallmeyer <fsmv@sapium.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the Lesser GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  Lesser GNU General Public License for more details.
+ *
+ *  You should have received a copy of the Lesser GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _NATIVEPLUGIN_H_
+#define _NATIVEPLUGIN_H_
+
+/**
+ * Interface for plugins written in C++
+ *
+ * A native plugin is a shared object named <name>.so in the plugins directory,
+ * it is used instead of <name>.lua if both exist. It has to export:
+ *
+ *     extern "C" int pb_plugin_abi_version() { return PB_NATIVE_ABI_VERSION; }
+ *     extern "C" NativePlugin *pb_create_plugin() { return new MyPlugin(); }
+ *     extern "C" void pb_destroy_plugin(NativePlugin *p) { delete p; }
+ *
+ * Since C++ objects cross the boundary it must be built with the same compiler
+ * and json.hpp as the bot. Native plugins run on the dispatcher thread without
+ * any protection, a crash in one takes down the bot.
+ */
+
+#include <string>
+#include <functional>
+#include "json.hpp"
+#include "config.h"
+#include "http.h"
+using json = nlohmann::json;
+
+#define PB_NATIVE_ABI_VERSION 3
+
+/**
+ * The bot api for a single run of a native plugin
+ */
+class PluginContext {
+public:
+    typedef std::function<void(PluginContext &context, const HttpResponse &response)>
+        FetchCallback;
+    typedef std::function<void(PluginContext &context, bool ok, const std::string &filename,
+                               const std::string &type)> DownloadCallback;
+
+    virtual ~PluginContext() {}
+
+    /**
+     * The update that triggered the run
+     */
+    virtual const json &update() const = 0;
+
+    /**
+     * Sends a message to the chat the update came from
+     *
+     * The messages are sent in order once run (or the callback) returns, the
+     * same way as the replies of lua plugins, so they can be answered in the
+     * webhook response and replayed from the reply cache.
+     *
+     * @return false if the update has no chat, like an inline query
+     */
+    virtual bool send(const std::string &message, bool markdown = true,
+                      bool disablePreview = false) = 0;
+
+    /**
+     * Same as send() but as a reply to the update's message
+     *
+     * @return false if the update has no chat or message
+     */
+    virtual bool reply(const std::string &message, bool markdown = true,
+                       bool disablePreview = false) = 0;
+
+    /**
+     * The plugin's config, change it with Config::set() so it gets saved
+     */
+    virtual Config &config() = 0;
+
+    /**
+     * Downloads the file attached to the update's message into the plugin's
+     * directory on an io worker
+     *
+     * Run must not block the dispatcher thread, so this returns right away.
+     * done is called later on the dispatcher thread with a context for the
+     * same update, ok is false if there is no file or the download failed and
+     * type is the message type, see messageType in the lua api.
+     */
+    virtual void downloadFile(DownloadCallback done) = 0;
+
+    /**
+     * Makes an http request with the shared connection pool on an io worker,
+     * done is called with the response like for downloadFile()
+     */
+    virtual void fetch(const HttpRequest &request, FetchCallback done) = 0;
+};
+
+class NativePlugin {
+public:
+    virtual ~NativePlugin() {}
+
+    /**
+     * Returns the same fields as getInfo in a lua plugin, ex:
+     * {"version": "0.1.2", "description": "...", "commands": {"cmd": "usage"},
+     *  "matches": ["regex"], "commandOnly": false, "alwaysTrigger": false}
+     */
+    virtual json getInfo() = 0;
+
+    /**
+     * Called like run in a lua plugin
+     *
+     * @param context the api for this run
+     * @param message the message text
+     * @param match the command or regex that triggered the run, or ANY
+     */
+    virtual void run(PluginContext &context, const std::string &message,
+                     const std::string &match) = 0;
+};
+
+#endif
@@ -19,31 +19,92 @@
 #define _PLUGINS_H_
 
 #include <map>
+#include <unordered_map>
+#include <vector>
 #include <string>
 #include <regex>
 #include <memory>
+#include <atomic>
+#include <chrono>
+#include <functional>
 
-extern "C" {
-    #include "lua.h"
-}
+#include "luacompat.h"
 
 #include "json.hpp"
 using json = nlohmann::json;
 
 #include "config.h"
+#include "luaalloc.h"
+#include "telegram.h"
+#include "lanes.h"
+#include "metrics.h"
 
 struct lua_State;
+struct NativeLibrary;
+class Plugin;
+
+// A message sent by a run, kept to replay cached replies
+struct CachedMessage {
+    std::string text;
+    bool reply;
+    bool markdown;
+    bool disablePreview;
+};
 
-class Plugin {
+// State information for a single call of run
+struct PluginRunState {
+    // The plugin being run
+    Plugin *plugin;
+    // the update message that trigger the run call
+    json update;
+    // if the run call was triggered with a regex match
+    bool regex;
+    // the string and regex that triggered the run if regex is true
+    std::pair<std::string, std::regex> match;
+    // the coroutine run is executing in
+    lua_State *thread;
+    // registry reference keeping the coroutine alive
+    int threadRef;
+    // set if the messages this run sends go in the reply cache
+    std::string cacheKey;
+    std::chrono::seconds cacheTTL;
+    // the messages sent so far, only recorded if cacheKey is set
+    std::vector<CachedMessage> replies;
+    // keeps the webhook connection of the update held, see holdWebhookReply()
+    std::shared_ptr<void> hold;
+    // when the run was started, for the run time metric
+    std::chrono::steady_clock::time_point started;
+};
+
+// Garbage collection counters for a plugin's lua state
+struct GCStats {
+    // number of incremental steps run by the scheduler
+    std::atomic<uint64_t> steps;
+    // number of full collections run by the scheduler
+    std::atomic<uint64_t> fullCollections;
+    // total time spent in scheduled collection
+    std::atomic<uint64_t> nanoseconds;
+    // memory in use when the last scheduled cycle finished
+    size_t lastCycleUsed;
+
+    GCStats() : steps(0), fullCollections(0), nanoseconds(0), lastCycleUsed(0) {}
+};
+
+class Plugin : public std::enable_shared_from_this<Plugin> {
 public:
     /**
-     * Loads a plugin from a lua source file
+     * Loads a plugin from a shared object if there is one (see
+     * nativeplugin.h) or from a lua source file
      *
-     * @param name the name without extension of the lua source file in the
-     * plugins directory
+     * @param name the name without extension of the lua source file or shared
+     * object in the plugins directory
      * @throws invalid_argument if there is any error in loading the plugin
      */
     Plugin(const std::string &name);
+    ~Plugin();
+
+    Plugin(const Plugin &) = delete;
+    Plugin &operator=(const Plugin &) = delete;
 
     /**
      * Conditionally call the plugin's lua run method if the message matches any
@@ -51,37 +112,357 @@ public:
      * 
      * @param update update to check
      */
-    void run(const json &update);
+    void run(const json &update) { run(update, getUpdateType(update)); }
+
+    /**
+     * Same as run(update) for an update whose type is already known
+     *
+     * @param update update to check
+     * @param type the type of the update
+     */
+    void run(const json &update, UpdateType type);
+
+    /**
+     * Queues the runs an update triggers instead of running them right away
+     *
+     * Runs from commands and matches go in the interactive lane and
+     * alwaysTrigger runs in the background lane, unless the plugin option
+     * priority puts every run of the plugin in one lane.
+     *
+     * @param update update to check, shared by the queued runs
+     * @param type the type of the update
+     * @param lanes the scheduler to queue the runs in
+     * @param hold kept by the runs until they finish, see holdWebhookReply()
+     */
+    void schedule(const std::shared_ptr<const json> &update, UpdateType type,
+                  LaneScheduler &lanes, const std::shared_ptr<void> &hold = nullptr);
+
+    /**
+     * Returns true if any update of the given type can trigger the plugin,
+     * from the updates field of getInfo and whether it has commands
+     */
+    bool wantsUpdate(UpdateType type) const {
+        return (subscriptions & (1u << type)) != 0;
+    }
+
+    /**
+     * Continues a run that yielded while waiting for io
+     *
+     * @param thread the coroutine of the run
+     * @param nargs the number of values already pushed on the coroutine's
+     * stack, they are returned from the api function that yielded
+     */
+    void resume(lua_State *thread, int nargs);
+
+    /**
+     * Finds the state of the run executing in a coroutine
+     *
+     * @param thread the coroutine
+     * @return the run state, nullptr if the coroutine isn't a run
+     */
+    PluginRunState *getRunState(lua_State *thread);
+
+    /**
+     * Returns the run that is executing lua on this thread right now
+     *
+     * Used by the ffi api functions, which don't get a lua_State.
+     * @return the run state, nullptr if no run is executing
+     */
+    static PluginRunState *currentRun();
+
+    /**
+     * Returns true if the plugin declared async = true in getInfo, so the
+     * api functions may yield its run while they wait on io
+     */
+    bool isAsync() const { return async; }
+
+    /**
+     * Returns the number of runs waiting on io
+     */
+    size_t runsInFlight() const { return runs.size(); }
+
+    /**
+     * Returns true if the plugin always triggers and defined runBatch, so its
+     * updates are collected and delivered together
+     */
+    bool isBatched() const { return batched; }
+
+    /**
+     * Queues a background run of runBatch with the collected updates if the
+     * batch is due
+     *
+     * A batch is due once it has batch_max updates or its oldest update has
+     * waited batch_latency_ms. Updates that are past the plugin's deadline by
+     * the time the run comes up are left out.
+     * @param lanes the scheduler to queue the run on
+     * @param force deliver the batch even if it isn't due
+     */
+    void flushBatch(LaneScheduler &lanes, bool force = false);
+
+    /**
+     * Returns when the collected batch is due
+     *
+     * @return the time, time_point::max() if nothing is collected
+     */
+    std::chrono::steady_clock::time_point batchDeadline() const;
 
     std::string getPath() const;
     std::string getDescription() { return description; }
     std::string getName() { return name; }
 
-    std::unique_ptr<Config> config;
+    /**
+     * Returns the memory counters of the plugin's lua state
+     */
+    LuaAllocator &getAllocator() { return *allocator; }
+
+    /**
+     * Runs incremental garbage collection steps until either the budget is
+     * used up or a collection cycle finishes
+     *
+     * @param budget the maximum time to spend collecting
+     * @return true if a cycle finished
+     */
+    bool collectGarbage(std::chrono::microseconds budget);
+
+    /**
+     * Runs a full garbage collection cycle
+     */
+    void fullCollect();
+
+    /**
+     * Runs a full collection if the plugin has used up half of the room it
+     * had under memory_limit after the last cycle, or allocated more than
+     * gc_max_debt since then
+     *
+     * Lua's emergency collection on a failed allocation is off while its
+     * collector is stopped, this takes its place before each run. The debt
+     * ceiling bounds the memory of plugins without a limit when the bot is
+     * never idle long enough for the scheduler.
+     */
+    void collectNearLimit();
+
+    GCStats &getGCStats() { return *gcStats; }
+
+    /**
+     * Returns the number of runs skipped because their message was older than
+     * the deadline
+     */
+    uint64_t getShed() const { return shed; }
+
+    /**
+     * Returns how many of the skipped runs got the stale_reply instead
+     */
+    uint64_t getShedReplies() const { return shedReplies; }
+
+    /**
+     * Returns how many command runs were answered from the reply cache
+     */
+    uint64_t getCacheHits() const { return cacheHits; }
+
+    /**
+     * Returns the description and the usage of every command, one per line,
+     * built when the plugin is loaded
+     */
+    const std::string &getHelpText() const { return helpText; }
+
+    /**
+     * Reads a tuning option for this plugin from the global config
+     *
+     * Looks for plugin_options.<plugin name>.<option> first and then falls back
+     * to plugin_options.default.<option>
+     *
+     * @param option the name of the option
+     * @param default_value the value to use if it isn't set anywhere
+     */
+    template<typename T>
+    T option(const std::string &option, const T &default_value) const;
+
+    /**
+     * Finds a tuning option for this plugin, the same way as option()
+     *
+     * @param option the name of the option
+     * @param value set to a copy of the value, the global config may be
+     *        reloaded after this returns
+     * @return false if it isn't set anywhere
+     */
+    bool findOption(const std::string &option, json *value) const;
+
+    // shared so that a reloaded plugin keeps the config of the old instance
+    std::shared_ptr<Config> config;
 
 private:
+    // must be declared before the lua state so that it is destroyed after it
+    std::unique_ptr<LuaAllocator> allocator;
     std::unique_ptr<lua_State, decltype(&lua_close)> luaState;
+    // set instead of the lua state for native plugins
+    std::unique_ptr<NativeLibrary> native;
+    std::unique_ptr<GCStats> gcStats;
+    // lua's own collector is stopped, only the scheduler collects
+    bool manualGC;
+    //!bytes allocated since the last cycle that force a full collection
+    size_t maxDebt;
+    std::unordered_map<lua_State *, std::unique_ptr<PluginRunState>> runs;
     std::map<std::string, std::string> commands;
     std::map<std::string, std::regex> matches;
     std::string description;
     std::string name;
     bool commandOnly;
     bool alwaysTrigger;
-};
+    bool async;
+    // bits of the UpdateTypes that trigger the plugin, and the ones that
+    // trigger it without matching a command
+    unsigned int subscriptions;
+    unsigned int alwaysTypes;
+    // the lane set with the priority option, if fixedLane
+    bool fixedLane;
+    Lane lane;
 
-// State information for a single call of run
-struct PluginRunState {
-    // The plugin being run
-    Plugin *plugin;
-    // the update message that trigger the run call
-    json update;
-    // if the run call was triggered with a regex match
-    bool regex;
-    // the string and regex that triggered the run if regex is true
-    std::pair<std::string, std::regex> match;
+    // runs for messages older than these are skipped, 0 means no deadline
+    std::chrono::seconds deadline;
+    std::map<std::string, std::chrono::seconds> commandDeadlines;
+    std::string staleReply;
+    std::atomic<uint64_t> shed;
+    std::atomic<uint64_t> shedReplies;
+
+    // commands marked cacheable in getInfo and their recorded replies
+    struct CacheRule {
+        enum Scope { GLOBAL, CHAT, USER };
+        std::chrono::seconds ttl;
+        Scope scope;
+    };
+    struct CachedReply {
+        std::vector<CachedMessage> messages;
+        std::chrono::steady_clock::time_point expires;
+    };
+    std::map<std::string, CacheRule> cacheRules;
+    std::unordered_map<std::string, CachedReply> replyCache;
+    size_t replyCacheMax;
+    std::atomic<uint64_t> cacheHits;
+    std::string helpText;
+
+    // updates waiting for runBatch
+    bool batched;
+    std::vector<json> batch;
+    std::chrono::steady_clock::time_point batchStart;
+    size_t batchMax;
+    std::chrono::milliseconds batchLatency;
+
+    // owned by Metrics::global(), a reloaded plugin gets the same ones
+    Histogram &runTime;
+    Histogram &matchTime;
+    Counter &runErrors;
+
+    void loadNative(const std::string &library);
+    void loadLua();
+    void loadInfo(const json &info);
+    lua_State *newRun(const json &update, const std::string &match,
+                      const std::regex *regex,
+                      const std::shared_ptr<void> &hold = nullptr);
+    typedef std::function<void(const std::string &message, const std::string &match,
+                               const std::regex *regex, bool always)> TriggerCallback;
+    void forEachTrigger(const json &update, UpdateType type,
+                        const TriggerCallback &callback);
+    void loadDeadlines();
+    bool isStale(const json &update, const std::string &match) const;
+    void shedRun(const json &update, const std::shared_ptr<void> &hold);
+    void runBatch(std::vector<json> &updates);
+    void startRun(const json &update, const std::string &message,
+                  const std::string &match, const std::regex *regex,
+                  const std::shared_ptr<void> &hold = nullptr);
+    std::string replyCacheKey(const CacheRule &rule, const json &update,
+                              const std::string &match, const std::string &message) const;
+    bool serveCached(const std::string &key, const json &update,
+                     const std::shared_ptr<void> &hold);
+    void storeReplies(const std::string &key, std::chrono::seconds ttl,
+                      const std::vector<CachedMessage> &messages);
+    void finishRun(lua_State *thread, bool ok);
 };
 
-bool loadPlugins(std::vector<Plugin> *plugins);
+template<typename T>
+T Plugin::option(const std::string &option, const T &default_value) const {
+    json value;
+    return findOption(option, &value) ? value.get<T>() : default_value;
+}
+
+typedef std::vector<std::shared_ptr<Plugin>> PluginSet;
+
+/**
+ * Loads all of the plugins listed in the global config
+ *
+ * The plugins are loaded in parallel on load_threads threads, by default one
+ * per core. Plugins that fail to load are logged and left out.
+ *
+ * @return the plugins that loaded, in the order of the config
+ */
+std::shared_ptr<const PluginSet> loadPlugins();
+
+/**
+ * Makes a set of plugins the one used to handle updates
+ *
+ * The first call marks the bot as ready, see waitForPlugins()
+ *
+ * @param plugins the new plugin set
+ */
+void publishPlugins(std::shared_ptr<const PluginSet> plugins);
+
+/**
+ * Returns the current plugin set, safe to call from any thread
+ *
+ * @return the plugins, nullptr if they haven't been published yet
+ */
+std::shared_ptr<const PluginSet> getPlugins();
+
+/**
+ * Blocks until a plugin set has been published
+ */
+void waitForPlugins();
+
+/**
+ * Loads a plugin again and swaps it into the plugin set
+ *
+ * The new instance is built on an io worker and swapped in by the dispatcher
+ * between updates. It keeps the config of the old instance and the old one
+ * stays alive until its running coroutines are done. If loading fails the old
+ * instance is kept. A plugin listed in the plugins option that isn't loaded
+ * yet is added to the set, names that aren't listed are ignored.
+ *
+ * Safe to call from any thread.
+ *
+ * @param name the name of the plugin
+ */
+void reloadPlugin(const std::string &name);
+
+/**
+ * Loads the plugins added to the plugins option and drops the ones removed
+ * from it, call it on the dispatcher thread after the global config changed
+ */
+void syncPlugins();
+
+/**
+ * Reloads listed plugins when their source file in the plugins directory
+ * changes, and their config when <name>.json changes
+ *
+ * @return false if the directory can't be watched
+ */
+bool watchPlugins();
+
+/**
+ * Stops watching the plugins directory
+ */
+void stopWatchingPlugins();
+
+/**
+ * Queues the batches that are due, call it on the dispatcher thread
+ *
+ * Also queues what is left in the batches of plugins that were reloaded.
+ *
+ * @param plugins the plugins to check
+ * @param lanes the scheduler to queue the batch runs on
+ * @param force deliver every batch, due or not
+ * @return how long until the next batch is due
+ */
+std::chrono::milliseconds flushBatches(const PluginSet &plugins, LaneScheduler &lanes,
+                                       bool force = false);
 
 void onUpdate(json message);
 
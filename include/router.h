@@ -0,0 +1,58 @@
+/**
+ *  Copyright (C) 2015  Andrew Kallmeyer <fsmv@sapium.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the Lesser GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  Lesser GNU General Public License for more details.
+ *
+ *  You should have received a copy of the Lesser GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ROUTER_H_
+#define _ROUTER_H_
+
+#include <memory>
+#include <vector>
+#include "plugin.h"
+#include "telegram.h"
+
+/**
+ * Index from update type to the plugins that want that type
+ *
+ * The dispatcher only runs the plugins listed for an update's type, so
+ * plugins that never look at stickers or callback queries are never entered
+ * for them. The index is rebuilt when a new plugin set is published.
+ */
+class UpdateRouter {
+public:
+    /**
+     * Rebuilds the index if the plugin set is not the one indexed already
+     *
+     * @param plugins the current plugin set
+     */
+    void update(const std::shared_ptr<const PluginSet> &plugins);
+
+    /**
+     * Returns the plugins that want updates of a type, in config order
+     *
+     * The pointers stay valid until the next call to update()
+     * @param type the update type
+     */
+    const std::vector<Plugin *> &route(UpdateType type) const {
+        return index[type];
+    }
+
+private:
+    //!keeps the indexed plugins alive
+    std::shared_ptr<const PluginSet> plugins;
+    std::vector<Plugin *> index[UPDATE_TYPE_COUNT];
+};
+
+#endif
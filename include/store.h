@@ -0,0 +1,184 @@
+/**
+ *  Copyright (C) 2015  Andrew Kallmeyer <fsmv@sapium.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the Lesser GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  Lesser GNU General Public License for more details.
+ *
+ *  You should have received a copy of the Lesser GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _STORE_H_
+#define _STORE_H_
+
+#include <string>
+#include <list>
+#include <unordered_map>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+struct sqlite3;
+struct sqlite3_stmt;
+
+/**
+ * Prepared statements of one sqlite connection, compiled on first use
+ */
+class StatementCache {
+public:
+    StatementCache() : db(nullptr) {}
+    ~StatementCache() { clear(); }
+
+    StatementCache(const StatementCache &) = delete;
+    StatementCache &operator=(const StatementCache &) = delete;
+
+    void setDatabase(sqlite3 *db) { clear(); this->db = db; }
+
+    /**
+     * Returns the compiled statement for some sql, reset and unbound
+     *
+     * @param sql the statement, must be a string literal (it is the key)
+     * @return the statement, nullptr if it didn't compile
+     */
+    sqlite3_stmt *get(const char *sql);
+
+    /**
+     * Finalizes every statement, call it before closing the connection
+     */
+    void clear();
+
+private:
+    sqlite3 *db;
+    std::unordered_map<const char *, sqlite3_stmt *> statements;
+};
+
+/**
+ * Persistent key value store for plugins in an sqlite database
+ *
+ * Keys live in a namespace, normally the name of the plugin. Reads go through
+ * an LRU cache of store_cache_entries entries. Writes update the cache right
+ * away and are committed by a background thread in one transaction every
+ * store_flush_ms, or sooner once store_batch_size writes are waiting, so a
+ * burst of writes costs one fsync. The database runs in WAL mode so reads
+ * don't wait for the commits.
+ *
+ * All of the methods are thread safe.
+ */
+class Store {
+public:
+    Store();
+    ~Store();
+
+    Store(const Store &) = delete;
+    Store &operator=(const Store &) = delete;
+
+    /**
+     * Opens or creates the database and starts the writer thread
+     *
+     * @param filename the database file
+     * @return false if the database couldn't be opened
+     */
+    bool open(const std::string &filename);
+
+    /**
+     * Commits the waiting writes, stops the writer and closes the database
+     */
+    void close();
+
+    bool isOpen() const { return reader != nullptr; }
+
+    /**
+     * Reads a value
+     *
+     * @param ns the namespace
+     * @param key the key
+     * @param value set to the value if it exists
+     * @param cached false to leave the value out of the read cache, for
+     *        callers that keep their own
+     * @return false if there is no value
+     */
+    bool get(const std::string &ns, const std::string &key, std::string *value,
+             bool cached = true);
+
+    /**
+     * Writes a value, it is committed in the background
+     *
+     * @param cached false to leave the value out of the read cache
+     */
+    void set(const std::string &ns, const std::string &key, const std::string &value,
+             bool cached = true);
+
+    /**
+     * Deletes a value, it is committed in the background
+     *
+     * @param cached false to leave the deletion out of the read cache
+     */
+    void remove(const std::string &ns, const std::string &key, bool cached = true);
+
+    /**
+     * Blocks until every write made so far is committed
+     */
+    void flush();
+
+    /**
+     * The store opened by main, configured from the global config
+     */
+    static Store &global();
+
+private:
+    // a missing value is cached too, so misses don't hit the database again
+    struct CacheEntry {
+        bool exists;
+        std::string value;
+        std::list<std::string>::iterator lru;
+    };
+    struct Write {
+        std::string ns;
+        std::string key;
+        bool remove;
+        std::string value;
+    };
+
+    static std::string makeKey(const std::string &ns, const std::string &key);
+    void cache(const std::string &fullKey, bool exists, const std::string &value);
+    void uncache(const std::string &fullKey);
+    void write(Write w, bool cached);
+    void writer();
+    bool commit(std::map<std::string, Write> &batch);
+
+    sqlite3 *reader;
+    sqlite3 *writerDb;
+    StatementCache readStatements;
+    StatementCache writeStatements;
+
+    // guards the cache, the pending writes and the reader connection
+    std::mutex mutex;
+    std::unordered_map<std::string, CacheEntry> entries;
+    std::list<std::string> lru; // most recently used first
+    size_t maxEntries;
+
+    std::map<std::string, Write> pending;
+    // writes taken by the writer but not committed yet, still readable
+    std::map<std::string, Write> committing;
+    uint64_t queued, committed;
+    std::condition_variable writeCV;
+    std::condition_variable committedCV;
+    std::chrono::milliseconds flushInterval;
+    size_t batchSize;
+    bool flushRequested;
+    bool stopping;
+    std::thread writerThread;
+};
+
+#endif
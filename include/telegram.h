@@ -31,10 +31,24 @@ using json = nlohmann::json;
  */
 bool setWebhook(const std::string &url, std::string certFile = "");
 
-void tg_sendMessage(const std::string &message, int chat_id,
+/**
+ * Stops all calls to the telegram api, used by the benchmarks
+ *
+ * @param dryRun if true api methods are logged instead of called
+ */
+void tg_setDryRun(bool dryRun);
+
+void tg_sendMessage(const std::string &message, int64_t chat_id,
                     int message_id = -1, bool markdown = true,
                     bool disable_link_preview = false);
 
+/**
+ * Calls a Bot API method described the way a webhook response would
+ *
+ * @param call the parameters as strings plus "method", the method name
+ */
+void tg_sendCall(const json &call);
+
 bool tg_downloadFile(const std::string &file_id, const std::string &filename);
 
 /**
@@ -45,4 +59,108 @@ bool tg_downloadFile(const std::string &file_id, const std::string &filename);
  */
 std::string getMessageText(const json &update);
 
+/**
+ * Returns the type of a Message object and the id of the file attached to it
+ *
+ * @param message the Message object from telegram
+ * @param file_id set to the id of the attached file if there is one and this
+ *        isn't nullptr
+ * @return AUDIO, FILE, PHOTO, STICKER, VIDEO, CONTACT, LOCATION, TEXT or
+ *         UNKNOWN
+ */
+std::string getMessageFile(const json &message, std::string *file_id);
+
+/**
+ * Reads when the message in an Update object was sent or last edited
+ *
+ * @param update the Update object from telegram
+ * @param date set to the unix time if the update has one
+ * @return false if the update isn't a message
+ */
+bool getUpdateDate(const json &update, int64_t *date);
+
+/**
+ * Reads the id of the chat an update came from
+ *
+ * @param update the Update object from telegram
+ * @param chat set to the chat id if the update has a chat
+ * @return false if the update has no chat
+ */
+bool getUpdateChat(const json &update, int64_t *chat);
+
+/**
+ * Returns the Message object of an update, for a callback query the message
+ * its button was on
+ *
+ * @param update the Update object from telegram
+ * @return nullptr if the update has no message, like an inline query
+ */
+const json *getUpdateMessage(const json &update);
+
+/**
+ * Reads the id of the message an update is about, the one a reply goes to
+ *
+ * @param update the Update object from telegram
+ * @param message_id set to the message id if the update has a message
+ * @return false if the update has no message
+ */
+bool getUpdateMessageId(const json &update, int *message_id);
+
+/**
+ * Returns the User object of whoever caused an update
+ *
+ * @param update the Update object from telegram
+ * @return nullptr if the update has no sender, like a channel post
+ */
+const json *getUpdateSender(const json &update);
+
+/**
+ * The kinds of update plugins can subscribe to
+ */
+enum UpdateType {
+    UPDATE_TEXT,
+    UPDATE_PHOTO,
+    UPDATE_STICKER,
+    UPDATE_AUDIO,
+    UPDATE_VOICE,
+    UPDATE_VIDEO,
+    UPDATE_DOCUMENT,
+    UPDATE_CONTACT,
+    UPDATE_LOCATION,
+    UPDATE_CHAT_MEMBER,
+    UPDATE_EDITED_MESSAGE,
+    UPDATE_CHANNEL_POST,
+    UPDATE_CALLBACK_QUERY,
+    UPDATE_INLINE_QUERY,
+    UPDATE_OTHER,
+    UPDATE_TYPE_COUNT
+};
+
+/**
+ * Works out which kind of update an Update object is
+ *
+ * Messages are split up by their content, anything that isn't known is
+ * UPDATE_OTHER.
+ * @param update the Update object from telegram
+ * @return the type
+ */
+UpdateType getUpdateType(const json &update);
+
+/**
+ * Returns the name plugins use for an update type, e.g. "edited_message"
+ *
+ * @param type the type
+ * @return the name
+ */
+const char *getUpdateTypeName(UpdateType type);
+
+/**
+ * Looks up an update type by the name plugins use for it
+ *
+ * @param name the name, see getUpdateTypeName()
+ * @param type set to the type if the name is known
+ * @return false if the name isn't an update type
+ */
+bool parseUpdateType(const std::string &name, UpdateType *type);
+
 #endif
@@ -0,0 +1,182 @@
+/**
+ *  Copyright (C) 2015  Andrew Kallmeyer <fsmv@sapium.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the Lesser GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  Lesser GNU General Public License for more details.
+ *
+ *  You should have received a copy of the Lesser GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TRACING_H_
+#define _TRACING_H_
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <cstdio>
+#include <cstdint>
+#include <atomic>
+
+/**
+ * Records how long each stage of handling an update took, for a sample of
+ * the updates, in the Chrome trace event format
+ *
+ * An update is sampled by a hash of its update_id, so every thread makes the
+ * same decision without sharing anything and an unsampled update costs one
+ * multiply. Spans of sampled updates are buffered and written to trace_file
+ * by a background thread every trace_flush_ms. Open the file in
+ * chrome://tracing or ui.perfetto.dev; each span has the update id in its
+ * args.
+ *
+ * The stages are: ingest (webhook request until the update is queued), queue
+ * (until the dispatcher takes it), dispatch, match (per plugin), lane (waiting
+ * for its turn), run (each slice of the lua coroutine), io queue and the Bot
+ * API call.
+ *
+ * All of the methods are thread safe.
+ */
+class Tracer {
+public:
+    typedef std::chrono::steady_clock::time_point TimePoint;
+
+    /**
+     * Makes the spans of the current thread belong to an update, if the
+     * update is sampled, and restores the previous one when destroyed
+     */
+    class Context {
+    public:
+        explicit Context(int64_t updateId);
+        ~Context();
+
+        Context(const Context &) = delete;
+        Context &operator=(const Context &) = delete;
+
+    private:
+        int64_t previous;
+    };
+
+    /**
+     * Records the time until it is destroyed as a span of the current
+     * thread's update, does nothing if there is none
+     */
+    class Span {
+    public:
+        Span(const char *category, const std::string &name);
+        ~Span();
+
+        Span(const Span &) = delete;
+        Span &operator=(const Span &) = delete;
+
+    private:
+        int64_t updateId;
+        const char *category;
+        std::string name;
+        TimePoint start;
+    };
+
+    Tracer();
+    ~Tracer();
+
+    Tracer(const Tracer &) = delete;
+    Tracer &operator=(const Tracer &) = delete;
+
+    /**
+     * Opens trace_file and starts the writer thread if trace_sample_rate is
+     * above 0
+     *
+     * @return false if tracing is on but the file couldn't be opened
+     */
+    bool start();
+
+    /**
+     * Writes the buffered spans and closes the file
+     */
+    void stop();
+
+    /**
+     * Whether the spans of an update are recorded
+     */
+    bool sampled(int64_t updateId) const {
+        // fibonacci hashing spreads the sequential ids
+        uint64_t limit = threshold.load(std::memory_order_relaxed);
+        return limit != 0 && updateId != 0 &&
+               static_cast<uint64_t>(updateId) * 0x9e3779b97f4a7c15ULL < limit;
+    }
+
+    /**
+     * The update the current thread works on if it is sampled, otherwise 0
+     */
+    static int64_t current();
+
+    /**
+     * Records a span
+     *
+     * @param updateId the update, nothing is recorded if it isn't sampled
+     * @param category the stage, like "lua"
+     * @param name the name shown on the span
+     */
+    void record(int64_t updateId, const char *category, const std::string &name,
+                TimePoint start, TimePoint end);
+
+    /**
+     * Notes that an update was queued for the dispatcher
+     */
+    void queued(int64_t updateId, TimePoint when);
+
+    /**
+     * Records the queue span of an update the dispatcher took
+     */
+    void dequeued(int64_t updateId);
+
+    /**
+     * Names the calling thread in the trace
+     */
+    void nameThread(const std::string &name);
+
+    static Tracer &global();
+
+private:
+    struct Event {
+        int64_t updateId;
+        const char *category;
+        std::string name;
+        int64_t start; // microseconds since the tracer started
+        int64_t duration;
+        unsigned thread;
+    };
+
+    static unsigned threadNumber();
+    int64_t micros(TimePoint time) const;
+    void writer();
+    void writeEvents(std::vector<Event> &events);
+
+    std::atomic<uint64_t> threshold;
+    TimePoint epoch;
+    FILE *file;
+    bool first;
+    size_t maxEvents;
+    std::chrono::milliseconds flushInterval;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<Event> events;
+    std::vector<std::pair<unsigned, std::string>> threadNames;
+    std::unordered_map<int64_t, TimePoint> waiting;
+    uint64_t dropped;
+    bool stopping;
+    std::thread thread;
+};
+
+#endif
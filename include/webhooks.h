@@ -20,6 +20,8 @@
 
 #include <cstdint>
 #include <queue>
+#include <chrono>
+#include <memory>
 #include "json.hpp"
 using json = nlohmann::json;
 
@@ -32,6 +34,16 @@ using json = nlohmann::json;
  */
 int startServer(uint16_t port, const char *ip);
 
+/**
+ * Sets whether or not the server accepts updates
+ *
+ * While not accepting, updates are answered with 503 Service Unavailable so
+ * telegram delivers them again later. The server starts out not accepting.
+ *
+ * @param accepting true once the bot is ready to handle updates
+ */
+void setAcceptingUpdates(bool accepting);
+
 /**
  * Stop the webhooks server 
  */
@@ -44,8 +56,77 @@ void stopServer();
 std::queue<json> popAllUpdates();
 
 /**
- * Blocks until there is an update
+ * Blocks until there is an update, the dispatcher is woken up or the timeout
+ * passes
+ *
+ * @param timeout the maximum time to wait
+ * @return true if there are updates waiting or wakeDispatcher() was called
+ */
+bool waitForUpdate(std::chrono::milliseconds timeout);
+
+/**
+ * Marks that the runs triggered by an update may answer it in the webhook
+ * response
+ *
+ * With webhook_reply on, the connection that delivered an update is held for
+ * up to webhook_reply_ms. The held connection is released when every copy of
+ * the returned handle is gone. Keep one with every run the update triggers.
+ *
+ * @param update the update being dispatched
+ * @return the handle, nullptr if the update's connection isn't held
+ */
+std::shared_ptr<void> holdWebhookReply(const json &update);
+
+/**
+ * Marks the Bot API calls made on the current thread as coming from a run of
+ * a held update, and restores the previous one when destroyed
+ *
+ * Only the runs of the held update may answer in its webhook response, other
+ * runs sending to the same chat at the same time go the normal way.
+ */
+class WebhookReplyScope {
+public:
+    /**
+     * @param update_id the update whose run is working, 0 for none
+     */
+    explicit WebhookReplyScope(int64_t update_id);
+    ~WebhookReplyScope();
+
+    WebhookReplyScope(const WebhookReplyScope &) = delete;
+    WebhookReplyScope &operator=(const WebhookReplyScope &) = delete;
+
+    /**
+     * The update set on the current thread, 0 if none
+     */
+    static int64_t current();
+
+private:
+    int64_t previous;
+};
+
+/**
+ * Offers a Bot API call to the held connection of an update from the chat
+ *
+ * Only calls made in the WebhookReplyScope of the held update are taken. If
+ * the update's runs finish in time having offered exactly one call it goes
+ * back to telegram in the webhook response. Otherwise the connection sends
+ * every offered call the normal way, in order, including the ones offered by
+ * runs still going while it does.
+ *
+ * @param chat_id the chat the call is for
+ * @param call the method and its parameters, like {"method": "sendMessage", ...}
+ * @return true if the call was taken, false if the caller should send it
+ */
+bool offerWebhookReply(int64_t chat_id, const json &call);
+
+/**
+ * Returns true if updates are waiting to be popped, doesn't block
+ */
+bool hasPendingUpdates();
+
+/**
+ * Wakes up the thread blocked in waitForUpdate() even if there are no updates
  */
-void waitForUpdate();
+void wakeDispatcher();
 
 #endif
\ No newline at end of file
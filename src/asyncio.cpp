@@ -0,0 +1,132 @@
+/**
+ *  Copyright (C) 2015  Andrew Kallmeyer <fsmv@sapium.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the Lesser GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  Lesser GNU General Public License for more details.
+ *
+ *  You should have received a copy of the Lesser GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "asyncio.h"
+#include "webhooks.h"
+#include "logger.h"
+#include "tracing.h"
+
+#include <queue>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+static Logger logger("AsyncIO");
+
+struct IOJob {
+    std::function<void()> work;
+    std::function<void()> done;
+    //!the sampled update that submitted it, 0 if none
+    int64_t traced;
+    //!the held update whose run submitted it, see WebhookReplyScope
+    int64_t replyUpdate;
+    std::chrono::steady_clock::time_point submitted;
+};
+
+static std::mutex jobsMutex, completedMutex;
+static std::condition_variable jobsCV;
+static std::queue<IOJob> jobs;
+static std::queue<std::function<void()>> completed;
+static std::vector<std::thread> workers;
+static bool stopping = false;
+
+static void ioWorker() {
+    Tracer::global().nameThread("io worker");
+    while (true) {
+        IOJob job;
+        {
+            std::unique_lock<std::mutex> l(jobsMutex);
+            jobsCV.wait(l, []() { return stopping || !jobs.empty(); });
+            if (stopping) {
+                return;
+            }
+            job = std::move(jobs.front());
+            jobs.pop();
+        }
+
+        // blocking calls made by the job belong to the update that sent it
+        Tracer::Context traceContext(job.traced);
+        WebhookReplyScope replyScope(job.replyUpdate);
+        if (job.traced) {
+            Tracer::global().record(job.traced, "io", "io queue", job.submitted,
+                                    std::chrono::steady_clock::now());
+        }
+
+        try {
+            job.work();
+        } catch (std::exception &e) {
+            LOG_ERROR(logger, "Uncaught exception in io job: {}", e.what());
+        }
+
+        {
+            std::lock_guard<std::mutex> l(completedMutex);
+            completed.push(std::move(job.done));
+        }
+        wakeDispatcher();
+    }
+}
+
+void startIOWorkers(unsigned int count) {
+    if (count == 0) {
+        // async runs would wait for their io forever
+        LOG_WARN(logger, "io_threads must be at least 1, starting 1 io worker");
+        count = 1;
+    }
+    stopping = false;
+    for (unsigned int i = 0; i < count; ++i) {
+        workers.emplace_back(ioWorker);
+    }
+    LOG_DEBUG(logger, "Started {} io workers", count);
+}
+
+void stopIOWorkers() {
+    {
+        std::lock_guard<std::mutex> l(jobsMutex);
+        stopping = true;
+    }
+    jobsCV.notify_all();
+
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    workers.clear();
+}
+
+void submitIO(std::function<void()> work, std::function<void()> done) {
+    {
+        std::lock_guard<std::mutex> l(jobsMutex);
+        jobs.push(IOJob{std::move(work), std::move(done), Tracer::current(),
+                        WebhookReplyScope::current(), std::chrono::steady_clock::now()});
+    }
+    jobsCV.notify_one();
+}
+
+size_t runIOCompletions() {
+    std::queue<std::function<void()>> ready;
+    {
+        std::lock_guard<std::mutex> l(completedMutex);
+        std::swap(ready, completed);
+    }
+
+    size_t count = ready.size();
+    while (!ready.empty()) {
+        ready.front()();
+        ready.pop();
+    }
+    return count;
+}
@@ -0,0 +1,138 @@
+/**
+ *  Copyright (C) 2015  Andrew Kallmeyer <fsmv@sapium.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the Lesser GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  Lesser GNU General Public License for more details.
+ *
+ *  You should have received a copy of the Lesser GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "chatstate.h"
+#include "store.h"
+#include "config.h"
+#include "logger.h"
+
+#include <algorithm>
+#include <cmath>
+
+static Logger logger("ChatState");
+
+static std::string chatNamespace(const std::string &plugin, int64_t chat) {
+    return "chat/" + plugin + "/" + std::to_string(chat);
+}
+
+/**
+ * A number as json, whole ones as integers so they are serialized exactly
+ */
+static json numberValue(double n) {
+    if (std::floor(n) == n && std::fabs(n) <= 9007199254740992.0) {
+        return static_cast<int64_t>(n);
+    }
+    return n;
+}
+
+ChatState::ChatState()
+    : maxBytes(std::max(1, Config::global()->get<int>("chat_state_bytes", 1 << 20))) {}
+
+ChatState &ChatState::global() {
+    static ChatState state;
+    return state;
+}
+
+ChatState::Entry &ChatState::load(const std::string &plugin, int64_t chat,
+                                  const std::string &key) {
+    PluginCache &cache = plugins[plugin];
+    std::string fullKey = std::to_string(chat) + ":" + key;
+    auto entry = cache.entries.find(fullKey);
+    if (entry != cache.entries.end()) {
+        cache.lru.splice(cache.lru.begin(), cache.lru, entry->second.lru);
+        return entry->second;
+    }
+
+    json value;
+    std::string stored;
+    if (Store::global().get(chatNamespace(plugin, chat), key, &stored, false)) {
+        try {
+            value = json::parse(stored)["v"];
+        } catch (std::invalid_argument &e) {
+            LOG_ERROR(logger, "Corrupt chat state {} of {} in chat {}", key, plugin, chat);
+        }
+    }
+
+    cache.lru.push_front(fullKey);
+    Entry &loaded = cache.entries[fullKey];
+    loaded.value = value;
+    loaded.bytes = fullKey.size() + stored.size();
+    loaded.lru = cache.lru.begin();
+    cache.bytes += loaded.bytes;
+    return loaded;
+}
+
+void ChatState::save(const std::string &plugin, int64_t chat, const std::string &key,
+                     const json &value) {
+    PluginCache &cache = plugins[plugin];
+    Entry &entry = cache.entries[std::to_string(chat) + ":" + key];
+    entry.value = value;
+    cache.bytes -= entry.bytes;
+    entry.bytes = entry.lru->size();
+
+    if (value.is_null()) {
+        Store::global().remove(chatNamespace(plugin, chat), key, false);
+    } else {
+        json stored;
+        stored["v"] = value;
+        std::string serialized = stored.dump();
+        entry.bytes += serialized.size();
+        Store::global().set(chatNamespace(plugin, chat), key, serialized, false);
+    }
+    cache.bytes += entry.bytes;
+}
+
+void ChatState::trim(PluginCache &cache) {
+    // the most recent entry stays even if it is bigger than the limit alone
+    while (cache.bytes > maxBytes && cache.lru.size() > 1) {
+        // it's already in the store, dropping it only costs a reload
+        auto oldest = cache.entries.find(cache.lru.back());
+        cache.bytes -= oldest->second.bytes;
+        cache.entries.erase(oldest);
+        cache.lru.pop_back();
+    }
+}
+
+bool ChatState::get(const std::string &plugin, int64_t chat, const std::string &key,
+                    json *value) {
+    std::lock_guard<std::mutex> l(mutex);
+    const Entry &entry = load(plugin, chat, key);
+    bool exists = !entry.value.is_null();
+    if (exists) {
+        *value = entry.value;
+    }
+    trim(plugins[plugin]);
+    return exists;
+}
+
+void ChatState::set(const std::string &plugin, int64_t chat, const std::string &key,
+                    const json &value) {
+    std::lock_guard<std::mutex> l(mutex);
+    load(plugin, chat, key);
+    save(plugin, chat, key, value);
+    trim(plugins[plugin]);
+}
+
+double ChatState::incr(const std::string &plugin, int64_t chat, const std::string &key,
+                       double delta) {
+    std::lock_guard<std::mutex> l(mutex);
+    const Entry &entry = load(plugin, chat, key);
+    double result = (entry.value.is_number() ? entry.value.get<double>() : 0) + delta;
+    save(plugin, chat, key, numberValue(result));
+    trim(plugins[plugin]);
+    return result;
+}
@@ -16,78 +16,249 @@
  */
 
 #include "config.h"
+#include "configsaver.h"
+#include "filewatcher.h"
 #include "logger.h"
-#include <fstream>
-#include <iterator>
 #include <array>
 #include <string>
+#include <vector>
+#include <cstring>
+#include <cerrno>
+#include <istream>
+#include <streambuf>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 static const std::array<std::string, 3> REQ_CONF_OPTS = { "token", "api_url", "webhook_url" };
 static Logger logger("config");
+static const std::string GLOBAL_DIR = "./";
 static const std::string GLOBAL_FILE = "config.json";
 
 const std::string Config::PB_VERSION = "0.1.2";
-std::unique_ptr<Config> Config::m_global = nullptr;
+std::shared_ptr<const Config> Config::m_global;
+std::atomic<unsigned> Config::m_generation(0);
 using json = nlohmann::json;
 
+static std::unique_ptr<FileWatcher> globalWatcher;
+
+static void applyLogLevel(const Config &config) {
+    auto idx = config.find("log_level");
+    if (idx != config.end()) {
+        Logger::setGlobalLogLevel(Logger::parseLogLevel(idx->get<std::string>().c_str()));
+    }
+}
+
+bool Config::checkGlobal(const Config &config) {
+    bool ok = true;
+    for (auto option : REQ_CONF_OPTS) {
+        if (!config.contains(option)) {
+            LOG_ERROR(logger, "Global config missing required option: {}", option);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+void Config::publishGlobal(std::unique_ptr<Config> config) {
+    // the old snapshot goes away with its last reader
+    std::atomic_store(&m_global, std::shared_ptr<const Config>(std::move(config)));
+    ++m_generation;
+}
+
 /**
  * Initialize the global config file
  */
 void Config::loadGlobalConfig() {
-    m_global.reset(loadConfig(GLOBAL_FILE));
-    if (!m_global) {
-        logger.error("Could not load global config file");
-        m_global.reset(nullptr);
+    std::unique_ptr<Config> config(loadConfig(GLOBAL_FILE));
+    if (!config || !checkGlobal(*config)) {
+        LOG_ERROR(logger, "Could not load global config file");
+        return;
     }
 
-    Logger::setLogFile(m_global->get<std::string>("log_file", "output.log").c_str());
+    Logger::setLogFile(config->get<std::string>("log_file", "output.log").c_str());
+    applyLogLevel(*config);
+    publishGlobal(std::move(config));
+}
 
-    auto idx = m_global->find("log_level");
-    if (idx != m_global->end()) {
-        Logger::setGlobalLogLevel(Logger::parseLogLevel(idx->get<std::string>().c_str()));
+bool Config::reloadGlobalConfig() {
+    std::unique_ptr<Config> config(loadConfig(GLOBAL_FILE));
+    if (!config || !checkGlobal(*config)) {
+        LOG_ERROR(logger, "Keeping the old global config");
+        return false;
     }
 
-    for (auto option : REQ_CONF_OPTS) {
-        idx = m_global->find("option");
-        if (idx != m_global->end()) {
-            logger.error("Global config missing required option: " + option);
-            m_global.reset(nullptr);
+    std::shared_ptr<const Config> current = global();
+    if (current && static_cast<const json &>(*current) == static_cast<const json &>(*config)) {
+        return false;
+    }
+
+    if (current && config->get<std::string>("log_file", "output.log")
+                   != current->get<std::string>("log_file", "output.log")) {
+        LOG_WARN(logger, "log_file only changes after a restart");
+    }
+    applyLogLevel(*config);
+    publishGlobal(std::move(config));
+    LOG_INFO(logger, "Reloaded {}", GLOBAL_FILE);
+    return true;
+}
+
+bool Config::watchGlobalConfig() {
+    globalWatcher.reset(new FileWatcher(GLOBAL_DIR, [](const std::string &file) {
+        if (file == GLOBAL_FILE) {
+            reloadGlobalConfig();
         }
+    }));
+
+    if (!globalWatcher->start()) {
+        globalWatcher.reset(nullptr);
+        return false;
     }
+    return true;
+}
+
+void Config::stopWatchingGlobalConfig() {
+    globalWatcher.reset(nullptr);
 }
 
 Config::Config(const json &config, const std::string &filename) 
-    : json(config), filename(filename), changed(false) {
+    : json(config), filename(filename), changed(false), scheduled(false) {
+}
+
+Config::~Config() {
+    if (scheduled) {
+        ConfigSaver::global().forget(this);
+    }
+    if (changed) {
+        save();
+    }
+}
+
+void Config::set(const std::string &option, json::const_reference value) {
+    {
+        std::lock_guard<std::mutex> l(mutex);
+        (*this)[option] = value;
+    }
+    setChanged();
+}
+
+void Config::setChanged() {
+    bool queued;
+    {
+        std::lock_guard<std::mutex> l(mutex);
+        changed = true;
+        queued = scheduled;
+    }
+    if (!queued) {
+        ConfigSaver::global().schedule(this);
+    }
+}
+
+bool Config::snapshot(json *data) {
+    std::lock_guard<std::mutex> l(mutex);
+    if (!changed) {
+        return false;
+    }
+    *data = static_cast<const json &>(*this);
+    changed = false;
+    // a change after this has to queue the config again
+    scheduled = false;
+    return true;
+}
+
+namespace {
+/**
+ * A read only memory mapping of a whole file, read as a stream so the parser
+ * works on the mapped pages without copying the file
+ */
+class MappedFile : public std::streambuf {
+public:
+    MappedFile() : data(nullptr), size(0) {}
+    ~MappedFile() {
+        if (data) {
+            munmap(data, size);
+        }
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    /**
+     * @return false if the file couldn't be mapped, errno is set
+     */
+    bool map(int fd) {
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            return false;
+        }
+        if (st.st_size == 0) {
+            return true; // mmap refuses empty mappings
+        }
+
+        void *mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED) {
+            return false;
+        }
+        data = static_cast<char *>(mapped);
+        size = st.st_size;
+        madvise(data, size, MADV_SEQUENTIAL);
+        setg(data, data, data + size);
+        return true;
+    }
+
+private:
+    char *data;
+    size_t size;
+};
 }
 
 Config *Config::loadConfig(const std::string &filename) {
-    std::ifstream f(filename);
     json jConfig;
 
-    if(!f.good()) {
-        logger.debug("Could not open config file: " + filename);
+    int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOG_DEBUG(logger, "Could not open config file: {}", filename);
         return new Config(jConfig, filename);
     }
 
-    std::istream_iterator<char> it(f), eof;
-    std::string config_json(it, eof);
+    // the mapping stays valid after the file is closed
+    MappedFile file;
+    bool mapped = file.map(fd);
+    int error = errno;
+    close(fd);
+    if (!mapped) {
+        LOG_ERROR(logger, "Could not read config file {}: {}", filename, strerror(error));
+        return nullptr;
+    }
 
     try {
-        jConfig = json::parse(config_json);
+        std::istream stream(&file);
+        jConfig = json::parse(stream);
     } catch (std::invalid_argument &e) {
-        logger.error("Syntax error in config file: " + std::string(e.what()));
+        LOG_ERROR(logger, "Syntax error in config file: {}", e.what());
         return nullptr;
     }
 
     return new Config(jConfig, filename);
 }
 
+bool Config::reload(const json &contents) {
+    std::lock_guard<std::mutex> l(mutex);
+    if (changed || static_cast<const json &>(*this) == contents) {
+        return false;
+    }
+    json::operator=(contents);
+    return true;
+}
+
 void Config::save() {
-    std::ofstream f(filename);
-    if (f.good()) {
-        f << std::setw(4) << static_cast<json>(*this);
-        changed = false;
-    } else {
-        logger.error("Could not write config file: " + filename);
+    json data;
+    if (!snapshot(&data)) {
+        return;
+    }
+    if (!ConfigSaver::writeFile(filename, data.dump())) {
+        std::lock_guard<std::mutex> l(mutex);
+        changed = true;
     }
 }
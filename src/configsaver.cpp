@@ -0,0 +1,154 @@
+/**
+ *  Copyright (C) 2015  Andrew Kallmeyer <fsmv@sapium.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the Lesser GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  Lesser GNU General Public License for more details.
+ *
+ *  You should have received a copy of the Lesser GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "configsaver.h"
+#include "config.h"
+#include "logger.h"
+
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include <vector>
+#include <utility>
+#include <unistd.h>
+
+static Logger logger("ConfigSaver");
+
+ConfigSaver::ConfigSaver()
+    : interval(0), running(false), stopping(false) {}
+
+ConfigSaver::~ConfigSaver() {
+    stop();
+}
+
+ConfigSaver &ConfigSaver::global() {
+    static ConfigSaver saver;
+    return saver;
+}
+
+void ConfigSaver::start() {
+    std::lock_guard<std::mutex> l(mutex);
+    if (running) {
+        return;
+    }
+    interval = std::chrono::milliseconds(
+        Config::global()->get<int>("config_save_ms", 1000));
+    running = true;
+    stopping = false;
+    thread = std::thread(&ConfigSaver::saver, this);
+}
+
+void ConfigSaver::stop() {
+    {
+        std::lock_guard<std::mutex> l(mutex);
+        if (!running) {
+            return;
+        }
+        stopping = true;
+    }
+    cv.notify_one();
+    thread.join(); // writes what is left first
+
+    std::lock_guard<std::mutex> l(mutex);
+    running = false;
+}
+
+bool ConfigSaver::schedule(Config *config) {
+    {
+        std::lock_guard<std::mutex> l(mutex);
+        if (!running || stopping) {
+            return false;
+        }
+        config->scheduled = true;
+        if (!dirty.insert(config).second) {
+            return true; // already waiting, this change goes out with it
+        }
+    }
+    cv.notify_one();
+    return true;
+}
+
+void ConfigSaver::forget(Config *config) {
+    std::lock_guard<std::mutex> l(mutex);
+    dirty.erase(config);
+    config->scheduled = false;
+}
+
+bool ConfigSaver::writeFile(const std::string &filename, const std::string &data) {
+    std::string tmp = filename + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "wb");
+    if (!f) {
+        LOG_ERROR(logger, "Could not write config file {}: {}", tmp, strerror(errno));
+        return false;
+    }
+
+    bool ok = fwrite(data.data(), 1, data.size(), f) == data.size()
+              && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), filename.c_str()) != 0) {
+        LOG_ERROR(logger, "Could not write config file {}: {}", filename, strerror(errno));
+        remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+void ConfigSaver::saver() {
+    std::unique_lock<std::mutex> l(mutex);
+    while (true) {
+        cv.wait(l, [this]{ return stopping || !dirty.empty() || !failed.empty(); });
+        // let more changes pile up so they go out in one write
+        cv.wait_for(l, interval, [this]{ return stopping; });
+
+        // copy under the config's lock, the slow dump happens without it
+        std::vector<std::pair<std::string, nlohmann::json>> snapshots;
+        for (Config *config : dirty) {
+            nlohmann::json data;
+            if (config->snapshot(&data)) {
+                snapshots.emplace_back(config->getFilename(), std::move(data));
+            }
+        }
+        dirty.clear();
+        std::map<std::string, std::string> files;
+        files.swap(failed);
+        bool stop = stopping;
+        l.unlock();
+
+        for (auto &snapshot : snapshots) {
+            files[snapshot.first] = snapshot.second.dump();
+        }
+        std::map<std::string, std::string> retry;
+        for (auto &file : files) {
+            if (!writeFile(file.first, file.second)) {
+                retry.insert(std::move(file));
+            }
+        }
+
+        l.lock();
+        for (auto &file : retry) {
+            // a newer snapshot that failed too replaces this one
+            failed.insert(std::move(file));
+        }
+        if (stop) {
+            for (auto &file : failed) {
+                LOG_ERROR(logger, "Lost changes to config file {}", file.first);
+            }
+            failed.clear();
+            return;
+        }
+    }
+}
@@ -0,0 +1,126 @@
+/**
+ *  Copyright (C) 2015  Andrew Kallmeyer <fsmv@sapium.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the Lesser GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  Lesser GNU General Public License for more details.
+ *
+ *  You should have received a copy of the Lesser GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "filewatcher.h"
+#include "logger.h"
+
+#include <set>
+#include <cstring>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+
+static Logger logger("FileWatcher");
+
+// how often the thread checks if it should stop
+static const int POLL_MS = 100;
+
+FileWatcher::FileWatcher(const std::string &dir, Callback callback,
+                         std::chrono::milliseconds debounce,
+                         std::chrono::milliseconds maxDelay)
+    : dir(dir), callback(callback), debounce(debounce), maxDelay(maxDelay),
+      fd(-1), running(false) {
+}
+
+FileWatcher::~FileWatcher() {
+    stop();
+}
+
+#ifdef __linux__
+
+bool FileWatcher::start() {
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+        LOG_ERROR(logger, "Could not create inotify instance: {}", strerror(errno));
+        return false;
+    }
+
+    if (inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        LOG_ERROR(logger, "Could not watch {}: {}", dir, strerror(errno));
+        close(fd);
+        fd = -1;
+        return false;
+    }
+
+    running = true;
+    thread = std::thread(&FileWatcher::watchLoop, this);
+    LOG_DEBUG(logger, "Watching {}", dir);
+    return true;
+}
+
+void FileWatcher::stop() {
+    running = false;
+    if (thread.joinable()) {
+        thread.join();
+    }
+    if (fd >= 0) {
+        close(fd);
+        fd = -1;
+    }
+}
+
+void FileWatcher::watchLoop() {
+    using namespace std::chrono;
+    alignas(struct inotify_event) char buffer[4096];
+    std::set<std::string> changed;
+    auto lastEvent = steady_clock::now();
+    auto firstEvent = lastEvent; // of the changes not reported yet
+
+    while (running) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, POLL_MS) > 0) {
+            ssize_t len;
+            while ((len = read(fd, buffer, sizeof(buffer))) > 0) {
+                for (char *p = buffer; p < buffer + len;) {
+                    auto event = reinterpret_cast<struct inotify_event *>(p);
+                    if (event->len > 0) {
+                        if (changed.empty()) {
+                            firstEvent = steady_clock::now();
+                        }
+                        changed.insert(event->name);
+                    }
+                    p += sizeof(struct inotify_event) + event->len;
+                }
+            }
+            lastEvent = steady_clock::now();
+        }
+
+        auto now = steady_clock::now();
+        if (!changed.empty() &&
+            (now - lastEvent >= debounce || now - firstEvent >= maxDelay)) {
+            for (const std::string &file : changed) {
+                callback(file);
+            }
+            changed.clear();
+        }
+    }
+}
+
+#else
+
+bool FileWatcher::start() {
+    LOG_WARN(logger, "Watching files is not supported on this platform");
+    return false;
+}
+
+void FileWatcher::stop() {
+}
+
+#endif
@@ -0,0 +1,139 @@
+/**
+ *  Copyright (C) 2015  Andrew Kallmeyer <fsmv@sapium.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the Lesser GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  Lesser GNU General Public License for more details.
+ *
+ *  You should have received a copy of the Lesser GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "floodfilter.h"
+#include "config.h"
+#include "logger.h"
+#include "telegram.h"
+
+#include <algorithm>
+
+static Logger logger("FloodFilter");
+
+// splitmix64, ids are sequential so they need mixing before masking
+static inline uint64_t mix(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+TokenBuckets::TokenBuckets(size_t count, double rate, double burst)
+    : rate(rate), burst(std::max(burst, 1.0)) {
+
+    size_t size = 1;
+    while (size < count) {
+        size <<= 1;
+    }
+    buckets.resize(size, Bucket{0, this->burst, std::chrono::steady_clock::time_point(),
+                                false});
+    mask = size - 1;
+}
+
+void TokenBuckets::setLimits(double rate, double burst) {
+    this->rate = rate;
+    this->burst = std::max(burst, 1.0);
+}
+
+bool TokenBuckets::take(int64_t key, std::chrono::steady_clock::time_point now,
+                        bool *first) {
+    if (rate <= 0) {
+        return true;
+    }
+
+    Bucket &bucket = buckets[mix(static_cast<uint64_t>(key)) & mask];
+    if (bucket.key != key) {
+        bucket = Bucket{key, burst, now, false};
+    }
+    double elapsed = std::chrono::duration<double>(now - bucket.updated).count();
+    bucket.tokens = std::min(burst, bucket.tokens + elapsed * rate);
+    bucket.updated = now;
+
+    if (bucket.tokens < 1) {
+        if (first) {
+            *first = !bucket.limited;
+        }
+        bucket.limited = true;
+        return false;
+    }
+    bucket.tokens -= 1;
+    bucket.limited = false;
+    return true;
+}
+
+FloodFilter::FloodFilter()
+    : enabled(Config::global()->get<bool>("flood_control", false)),
+      users(Config::global()->get<int>("flood_buckets", 4096),
+            Config::global()->get<double>("flood_user_rate", 1),
+            Config::global()->get<double>("flood_user_burst", 5)),
+      chats(Config::global()->get<int>("flood_buckets", 4096),
+            Config::global()->get<double>("flood_chat_rate", 5),
+            Config::global()->get<double>("flood_chat_burst", 20)),
+      allowed(Metrics::global().counter("pb_flood_allowed_total",
+          "Updates that passed the flood limits")),
+      userDropped(Metrics::global().counter("pb_flood_dropped_total",
+          "Updates dropped by the flood limits", Metrics::label("limit", "user"))),
+      chatDropped(Metrics::global().counter("pb_flood_dropped_total",
+          "Updates dropped by the flood limits", Metrics::label("limit", "chat"))) {}
+
+void FloodFilter::configure() {
+    std::shared_ptr<const Config> config = Config::global();
+    enabled = config->get<bool>("flood_control", false);
+    users.setLimits(config->get<double>("flood_user_rate", 1),
+                    config->get<double>("flood_user_burst", 5));
+    chats.setLimits(config->get<double>("flood_chat_rate", 5),
+                    config->get<double>("flood_chat_burst", 20));
+}
+
+bool FloodFilter::allow(const json &update) {
+    if (!enabled) {
+        return true;
+    }
+
+    // the same sender and chat the plugins see
+    const json *from = getUpdateSender(update);
+    auto fromId = from ? from->find("id") : update.end();
+    int64_t chat;
+    bool hasChat = getUpdateChat(update, &chat);
+
+    auto now = std::chrono::steady_clock::now();
+    bool first = false;
+    if (from && fromId != from->end() && fromId->is_number() &&
+        !users.take(fromId->get<int64_t>(), now, &first)) {
+
+        userDropped.add();
+        if (first) {
+            LOG_INFO(logger, "User {} is over the flood limit, dropping their updates",
+                     *fromId);
+        } else {
+            LOG_DEBUG(logger, "Dropped update from user {}", *fromId);
+        }
+        return false;
+    }
+    if (hasChat && !chats.take(chat, now, &first)) {
+        chatDropped.add();
+        if (first) {
+            LOG_INFO(logger, "Chat {} is over the flood limit, dropping its updates", chat);
+        } else {
+            LOG_DEBUG(logger, "Dropped update in chat {}", chat);
+        }
+        return false;
+    }
+
+    allowed.add();
+    return true;
+}
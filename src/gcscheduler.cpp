@@ -0,0 +1,109 @@
+/**
+ *  Copyright (C) 2015  Andrew Kallmeyer <fsmv@sapium.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the Lesser GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  Lesser GNU General Public License for more details.
+ *
+ *  You should have received a copy of the Lesser GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "gcscheduler.h"
+#include "config.h"
+#include "logger.h"
+
+static Logger logger("GC");
+
+// how long to sleep when there is no collection work left
+static const std::chrono::milliseconds MAX_WAIT(1000);
+
+GCScheduler::GCScheduler()
+    : handled(0), pendingFull(0), pending(false), next(0),
+      lastSlice(std::chrono::steady_clock::now()) {
+    configure();
+}
+
+void GCScheduler::configure() {
+    std::shared_ptr<const Config> config = Config::global();
+    budget = std::chrono::microseconds(config->get<int>("gc_idle_budget_us", 2000));
+    interval = std::chrono::milliseconds(config->get<int>("gc_idle_interval_ms", 10));
+    burstUpdates = config->get<int>("gc_burst_updates", 100);
+    maxBusy = std::chrono::milliseconds(config->get<int>("gc_max_busy_ms", 100));
+}
+
+void GCScheduler::updatesHandled(size_t count) {
+    handled += count;
+    pending = true;
+}
+
+std::chrono::milliseconds GCScheduler::nextWait() const {
+    if (pending || pendingFull > 0 || (burstUpdates && handled >= burstUpdates)) {
+        return interval;
+    }
+    return MAX_WAIT;
+}
+
+bool GCScheduler::needsWork(Plugin &plugin) const {
+    // nothing was allocated since the last cycle we finished
+    return plugin.getAllocator().getUsed() != plugin.getGCStats().lastCycleUsed;
+}
+
+void GCScheduler::idle(const PluginSet &plugins) {
+    slice(plugins);
+}
+
+void GCScheduler::busy(const PluginSet &plugins) {
+    if (std::chrono::steady_clock::now() - lastSlice < maxBusy) {
+        return;
+    }
+    LOG_DEBUG(logger, "No idle time for {}ms, collecting between updates", maxBusy.count());
+    slice(plugins);
+}
+
+void GCScheduler::slice(const PluginSet &plugins) {
+    lastSlice = std::chrono::steady_clock::now();
+    if (plugins.empty()) {
+        pending = false;
+        return;
+    }
+
+    if (burstUpdates && handled >= burstUpdates) {
+        LOG_DEBUG(logger, "Full collection after {} updates", handled);
+        handled = 0;
+        pendingFull = plugins.size();
+    }
+
+    // one full collection per call so an update arriving isn't held up for
+    // the collection of every plugin
+    if (pendingFull > 0) {
+        --pendingFull;
+        plugins[pendingFull % plugins.size()]->fullCollect();
+        return;
+    }
+
+    using namespace std::chrono;
+    auto end = steady_clock::now() + budget;
+    size_t checked = 0;
+    bool work = false;
+    while (checked < plugins.size() && steady_clock::now() < end) {
+        Plugin &plugin = *plugins[next % plugins.size()];
+        if (needsWork(plugin)) {
+            work = true;
+            auto left = duration_cast<microseconds>(end - steady_clock::now());
+            if (!plugin.collectGarbage(left)) {
+                return; // out of time, continue with this plugin next call
+            }
+        }
+        next = (next + 1) % plugins.size();
+        ++checked;
+    }
+
+    pending = work;
+}
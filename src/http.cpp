@@ -0,0 +1,202 @@
+/**
+ *  Copyright (C) 2015  Andrew Kallmeyer <fsmv@sapium.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the Lesser GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  Lesser GNU General Public License for more details.
+ *
+ *  You should have received a copy of the Lesser GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "http.h"
+#include "config.h"
+#include "logger.h"
+
+#include <vector>
+#include <sstream>
+#include <algorithm>
+#include <unordered_map>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+
+#include <curlpp/cURLpp.hpp>
+#include <curlpp/Easy.hpp>
+#include <curlpp/Options.hpp>
+#include <curlpp/Infos.hpp>
+
+static Logger logger("HTTP");
+
+// must be declared before the pool so the handles are cleaned up first
+static curlpp::Cleanup cleanup;
+
+static std::mutex poolMutex;
+static std::condition_variable poolCV;
+static std::vector<std::unique_ptr<curlpp::Easy>> idleHandles;
+static size_t activeHandles = 0;
+// the part of activeHandles held by plugin fetches
+static size_t activeFetches = 0;
+
+struct CacheEntry {
+    std::chrono::steady_clock::time_point expires;
+    long status;
+    std::string body;
+};
+
+static std::mutex cacheMutex;
+static std::unordered_map<std::string, CacheEntry> cache;
+
+PooledHandle::PooledHandle(bool fetch) : fetch(fetch) {
+    size_t max = std::max(1, Config::global()->get<int>("http_max_connections", 8));
+    // leave at least one connection to telegram calls
+    size_t maxFetches = std::max<size_t>(1, std::min<size_t>(max > 1 ? max - 1 : 1,
+        Config::global()->get<int>("http_max_fetch_connections", max / 2)));
+
+    std::unique_lock<std::mutex> l(poolMutex);
+    poolCV.wait(l, [max, maxFetches, fetch]() {
+        return activeHandles < max && (!fetch || activeFetches < maxFetches);
+    });
+    ++activeHandles;
+    if (fetch) {
+        ++activeFetches;
+    }
+
+    if (!idleHandles.empty()) {
+        handle = std::move(idleHandles.back());
+        idleHandles.pop_back();
+    } else {
+        handle.reset(new curlpp::Easy());
+    }
+}
+
+PooledHandle::~PooledHandle() {
+    // reset only clears the options, the open connections are kept
+    handle->reset();
+
+    {
+        std::lock_guard<std::mutex> l(poolMutex);
+        idleHandles.push_back(std::move(handle));
+        --activeHandles;
+        if (fetch) {
+            --activeFetches;
+        }
+    }
+    // a fetch and a telegram call may be waiting on different limits
+    poolCV.notify_all();
+}
+
+/**
+ * The cache key of a GET request, the url and its headers in sorted order
+ */
+static std::string cacheKey(const HttpRequest &request) {
+    std::vector<std::string> headers(request.headers.begin(), request.headers.end());
+    std::sort(headers.begin(), headers.end());
+
+    std::string key = request.url;
+    for (const std::string &header : headers) {
+        key += '\n';
+        key += header;
+    }
+    return key;
+}
+
+static bool cacheLookup(const std::string &key, HttpResponse *response) {
+    std::lock_guard<std::mutex> l(cacheMutex);
+    auto entry = cache.find(key);
+    if (entry == cache.end()) {
+        return false;
+    }
+
+    if (entry->second.expires < std::chrono::steady_clock::now()) {
+        cache.erase(entry);
+        return false;
+    }
+
+    response->status = entry->second.status;
+    response->body = entry->second.body;
+    return true;
+}
+
+static void cacheStore(const std::string &key, int ttl, const HttpResponse &response) {
+    size_t max = Config::global()->get<int>("http_cache_entries", 256);
+    auto now = std::chrono::steady_clock::now();
+
+    std::lock_guard<std::mutex> l(cacheMutex);
+    if (cache.size() >= max) {
+        for (auto it = cache.begin(); it != cache.end();) {
+            if (it->second.expires < now) {
+                it = cache.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    if (cache.size() >= max && !cache.empty()) {
+        cache.erase(cache.begin());
+    }
+
+    CacheEntry &entry = cache[key];
+    entry.expires = now + std::chrono::seconds(ttl);
+    entry.status = response.status;
+    entry.body = response.body;
+}
+
+HttpResponse httpFetch(const HttpRequest &request) {
+    HttpResponse response;
+    bool cacheable = request.cacheTTL > 0 && request.method == "GET";
+    std::string key = cacheable ? cacheKey(request) : "";
+    if (cacheable && cacheLookup(key, &response)) {
+        return response;
+    }
+
+    using namespace curlpp::options;
+    std::stringstream result;
+    try {
+        PooledHandle handle(true);
+
+        handle->setOpt<Url>(request.url);
+        handle->setOpt<NoSignal>(true);
+        handle->setOpt<FollowLocation>(true);
+        handle->setOpt<TimeoutMs>(request.timeoutMs > 0 ? request.timeoutMs
+            : Config::global()->get<long>("http_timeout_ms", 10000));
+
+        if (request.method != "GET" && request.method != "POST") {
+            handle->setOpt<CustomRequest>(request.method);
+        }
+        if (!request.body.empty() || request.method == "POST") {
+            handle->setOpt<PostFields>(request.body);
+            handle->setOpt<PostFieldSize>(request.body.size());
+        }
+        if (!request.headers.empty()) {
+            handle->setOpt<HttpHeader>(request.headers);
+        }
+
+        handle->setOpt<WriteStream>(&result);
+        handle->perform();
+
+        response.status = curlpp::infos::ResponseCode::get(*handle);
+        response.body = result.str();
+    }
+
+    catch(curlpp::RuntimeError &e) {
+        response.error = e.what();
+    }
+    catch(curlpp::LogicError &e) {
+        response.error = e.what();
+    }
+
+    if (response.status == 0) {
+        LOG_WARN(logger, "Request to {} failed: {}", request.url, response.error);
+    } else if (cacheable && response.status == 200) {
+        cacheStore(key, request.cacheTTL, response);
+    }
+
+    return response;
+}
@@ -0,0 +1,72 @@
+/**
+ *  Copyright (C) 2015  Andrew Kallmeyer <fsmv@sapium.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the Lesser GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  Lesser GNU General Public License for more details.
+ *
+ *  You should have received a copy of the Lesser GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "lanes.h"
+#include "config.h"
+
+LaneScheduler::LaneScheduler() : streak(0) {
+    configure();
+}
+
+void LaneScheduler::configure() {
+    std::shared_ptr<const Config> config = Config::global();
+    backgroundEvery = config->get<int>("lane_background_every", 8);
+    maxDelay = std::chrono::milliseconds(config->get<int>("lane_max_delay_ms", 500));
+}
+
+void LaneScheduler::push(Lane lane, std::function<void()> job) {
+    lanes[lane].push_back(Job{std::move(job), std::chrono::steady_clock::now()});
+}
+
+Lane LaneScheduler::runNext() {
+    auto &interactive = lanes[LANE_INTERACTIVE];
+    auto &background = lanes[LANE_BACKGROUND];
+
+    Lane lane;
+    if (interactive.empty()) {
+        if (background.empty()) {
+            return LANE_COUNT;
+        }
+        lane = LANE_BACKGROUND;
+    } else if (!background.empty() &&
+               ((backgroundEvery && streak >= backgroundEvery) ||
+                std::chrono::steady_clock::now() - background.front().queued >= maxDelay)) {
+        lane = LANE_BACKGROUND; // don't starve the background lane
+    } else {
+        lane = LANE_INTERACTIVE;
+    }
+
+    // only count the interactive runs that a background run waited behind
+    streak = lane == LANE_INTERACTIVE && !background.empty() ? streak + 1 : 0;
+
+    // pop before running, the job may queue more jobs
+    std::function<void()> job = std::move(lanes[lane].front().run);
+    lanes[lane].pop_front();
+    job();
+    return lane;
+}
+
+bool LaneScheduler::parseLane(const std::string &name, Lane *lane) {
+    if (name == "interactive") {
+        *lane = LANE_INTERACTIVE;
+    } else if (name == "background") {
+        *lane = LANE_BACKGROUND;
+    } else {
+        return false;
+    }
+    return true;
+}
@@ -25,6 +25,13 @@
 #include <type_traits>
 #include <ctime>
 #include <cstring>
+#include <algorithm>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <cstdlib>
 
 #include "logger.h"
 
@@ -35,57 +42,605 @@ static const int MAX_TIME_STR_LEN = 21;
 
 //must be in the same order as the enum
 const char *Logger::levelStr[] = { "ERROR", "WARNING", "INFO", "DEBUG" };
-Logger::LogLevel Logger::globalLevel = LVL_INFO;
+std::atomic<int> Logger::globalLevel(LVL_INFO);
+
+//the log file's format and rotation, guarded by the output lock
+static Logger::Format fileFormat = Logger::FORMAT_TEXT;
+static std::string logFileName;
+static size_t fileBytes = 0;
+static std::chrono::system_clock::time_point fileOpened;
+static size_t rotateBytes = 0;
+static std::chrono::seconds rotateAge(0);
+static unsigned rotateKeep = 5;
+
+//the update the current thread is working on, 0 if none
+static thread_local int64_t contextUpdateId = 0;
+static thread_local int64_t contextChatId = 0;
 
 //The lambda here is the deleter for the unique_ptr
 //it is a destructor for the FILE pointer basically
 decltype(Logger::logFile) Logger::logFile(nullptr, [](FILE *ptr) {
-    fprintf(ptr,
-        "\n========================================"
-        "========================================\n\n");
+    if (fileFormat == Logger::FORMAT_TEXT) {
+        fprintf(ptr,
+            "\n========================================"
+            "========================================\n\n");
+    }
     fclose(ptr);
 });
 
 static Logger logger("Logger");
 
+//guards the console, the log file and the time conversion
+static std::mutex outputMutex;
+
+static void formatTime(time_t time, const char *format, char *timeStr) {
+    struct tm local;
+    localtime_r(&time, &local);
+    strftime(timeStr, MAX_TIME_STR_LEN - 1, format, &local);
+}
+
+/**
+ * One slot of a thread's ring buffer
+ *
+ * Longer messages take several records in a row, all but the last have more
+ * set. The records are only ever memcpy'd so the buffer needs no allocation.
+ */
+struct LogRecord {
+    static const size_t TEXT_SIZE = 200;
+
+    std::chrono::system_clock::time_point time;
+    const char *name;
+    Logger::LogLevel level;
+    bool flush;
+    bool more;
+    uint16_t length;
+    int64_t updateId;
+    int64_t chatId;
+    char text[TEXT_SIZE];
+};
+
+const size_t LogRecord::TEXT_SIZE;
+
+/**
+ * Single producer single consumer ring of records
+ *
+ * The owning thread is the producer and the logging thread the consumer. The
+ * indices only grow, the slot is the index modulo the capacity.
+ */
+class LogRing {
+public:
+    explicit LogRing(size_t capacity)
+        : orphaned(false), records(capacity), head(0), tail(0) {}
+
+    //!set when the thread exits, the ring is freed once it's drained
+    std::atomic<bool> orphaned;
+
+    size_t capacity() const { return records.size(); }
+
+    /**
+     * Space for count more records, only call from the producer
+     */
+    bool hasRoom(size_t count) const {
+        return tail.load(std::memory_order_relaxed)
+               - head.load(std::memory_order_acquire) + count <= records.size();
+    }
+
+    /**
+     * The slot of the i'th record after the last one written
+     */
+    LogRecord &slot(size_t i) {
+        return records[(tail.load(std::memory_order_relaxed) + i) % records.size()];
+    }
+
+    /**
+     * Hands count records written with slot() to the consumer
+     */
+    void commit(size_t count) {
+        tail.store(tail.load(std::memory_order_relaxed) + count, std::memory_order_release);
+    }
+
+    /**
+     * Moves every committed record out, only call from the consumer
+     */
+    template<typename F>
+    size_t consume(F callback) {
+        size_t first = head.load(std::memory_order_relaxed);
+        size_t last = tail.load(std::memory_order_acquire);
+        for (size_t i = first; i != last; ++i) {
+            callback(records[i % records.size()]);
+        }
+        head.store(last, std::memory_order_release);
+        return last - first;
+    }
+
+    bool empty() const {
+        return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+    }
+
+    size_t used() const {
+        return tail.load(std::memory_order_relaxed) - head.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::vector<LogRecord> records;
+    std::atomic<size_t> head;
+    std::atomic<size_t> tail;
+};
+
+/**
+ * The logging thread and the rings of every thread that logged
+ */
+class LogBackend {
+public:
+    LogBackend() : dropped(0), running(false), ringSize(0),
+                   policy(Logger::OVERFLOW_BLOCK), reportedDropped(0),
+                   cachedSecond(-1) {}
+
+    void start(size_t bufferRecords, Logger::OverflowPolicy policy);
+    void stop();
+
+    /**
+     * Queues a message from the calling thread
+     *
+     * @return false if it wasn't queued and should be written synchronously
+     */
+    bool push(Logger::LogLevel level, const char *name, const char *message, bool flush);
+
+    bool isRunning() const { return running.load(std::memory_order_acquire); }
+
+    std::atomic<uint64_t> dropped;
+
+private:
+    struct Entry {
+        std::chrono::system_clock::time_point time;
+        Logger::LogLevel level;
+        const char *name;
+        bool flush;
+        int64_t updateId;
+        int64_t chatId;
+        std::string message;
+    };
+
+    LogRing *threadRing();
+    LogRing *growRing(LogRing *ring, size_t count);
+    void loop();
+    void drain();
+
+    std::atomic<bool> running;
+    size_t ringSize;
+    Logger::OverflowPolicy policy;
+    std::thread thread;
+
+    std::mutex ringsMutex;
+    std::vector<std::shared_ptr<LogRing>> rings;
+
+    std::mutex wakeMutex;
+    std::condition_variable wake;
+
+    //!only touched by the consumer
+    std::vector<Entry> entries;
+    uint64_t reportedDropped;
+    time_t cachedSecond;
+    char cachedTime[MAX_TIME_STR_LEN];
+};
+
+// what a thread's ring starts at, short lived threads rarely need more
+static const size_t INITIAL_RING_RECORDS = 16;
+
+// how long the logging thread sleeps when nobody wakes it
+static const std::chrono::milliseconds LOG_INTERVAL(20);
+
+// never freed so that logging from static destructors is still safe
+static LogBackend *const backend = new LogBackend();
+
+// trivially destructible, so it can still be read after the handle is gone
+static thread_local bool threadExiting = false;
+
+namespace {
+/**
+ * Marks the thread's ring orphaned when the thread exits
+ */
+struct RingHandle {
+    std::shared_ptr<LogRing> ring;
+    ~RingHandle() {
+        threadExiting = true;
+        if (ring) {
+            ring->orphaned = true;
+        }
+    }
+};
+}
+
+static thread_local RingHandle threadRingHandle;
+
+LogRing *LogBackend::threadRing() {
+    if (!threadRingHandle.ring) {
+        threadRingHandle.ring = std::make_shared<LogRing>(
+            std::min(ringSize, INITIAL_RING_RECORDS));
+        std::lock_guard<std::mutex> l(ringsMutex);
+        rings.push_back(threadRingHandle.ring);
+    }
+    return threadRingHandle.ring.get();
+}
+
+/**
+ * Swaps a full ring for one twice as big, up to ringSize
+ *
+ * Waits for the logging thread to empty the old ring before the new one is
+ * published, so the thread's messages are written in the order they were
+ * logged no matter how the threads are merged. The old ring is orphaned and
+ * freed by the logging thread.
+ */
+LogRing *LogBackend::growRing(LogRing *ring, size_t count) {
+    while (!ring->empty() && isRunning()) {
+        wake.notify_one();
+        std::this_thread::yield();
+    }
+
+    size_t capacity = std::min(ringSize, std::max(ring->capacity() * 2, count));
+    auto bigger = std::make_shared<LogRing>(capacity);
+    {
+        std::lock_guard<std::mutex> l(ringsMutex);
+        rings.push_back(bigger);
+    }
+    threadRingHandle.ring->orphaned = true;
+    threadRingHandle.ring = bigger;
+    return bigger.get();
+}
+
+void LogBackend::start(size_t bufferRecords, Logger::OverflowPolicy policy) {
+    if (isRunning()) {
+        return;
+    }
+    ringSize = std::max<size_t>(bufferRecords, 16);
+    this->policy = policy;
+    running = true;
+    thread = std::thread(&LogBackend::loop, this);
+}
+
+void LogBackend::stop() {
+    if (!isRunning()) {
+        return;
+    }
+    running = false;
+    wake.notify_one();
+    thread.join();
+    drain(); // anything queued while the thread was finishing up
+}
+
+bool LogBackend::push(Logger::LogLevel level, const char *name,
+                      const char *message, bool flush) {
+    if (!isRunning() || threadExiting) {
+        return false;
+    }
+
+    LogRing *ring = threadRing();
+    size_t length = strlen(message);
+
+    // a message too long for even the biggest ring is cut, and says so
+    char marker[64];
+    size_t markerLength = 0;
+    size_t maxLength = ringSize * LogRecord::TEXT_SIZE;
+    if (length > maxLength) {
+        markerLength = snprintf(marker, sizeof(marker), "... [cut, %zu bytes in total]",
+                                length);
+        length = maxLength - markerLength;
+    }
+
+    size_t total = length + markerLength;
+    size_t count = std::max<size_t>(1, (total + LogRecord::TEXT_SIZE - 1)
+                                       / LogRecord::TEXT_SIZE);
+
+    while (!ring->hasRoom(count)) {
+        if (ring->capacity() < ringSize) {
+            ring = growRing(ring, count);
+            continue;
+        }
+        if (policy == Logger::OVERFLOW_DROP) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+        if (!isRunning()) {
+            return false;
+        }
+        wake.notify_one();
+        std::this_thread::yield();
+    }
+
+    auto now = std::chrono::system_clock::now();
+    const char *markerPart = marker;
+    for (size_t i = 0; i < count; ++i) {
+        LogRecord &record = ring->slot(i);
+        size_t part = std::min(total, LogRecord::TEXT_SIZE);
+        size_t fromMessage = std::min(length, part);
+        record.time = now;
+        record.name = name;
+        record.level = level;
+        record.flush = flush;
+        record.more = i + 1 < count;
+        record.updateId = contextUpdateId;
+        record.chatId = contextChatId;
+        record.length = part;
+        memcpy(record.text, message, fromMessage);
+        memcpy(record.text + fromMessage, markerPart, part - fromMessage);
+        message += fromMessage;
+        markerPart += part - fromMessage;
+        length -= fromMessage;
+        total -= part;
+    }
+    ring->commit(count);
+
+    // the thread checks every LOG_INTERVAL, only hurry it when it matters
+    if (level <= Logger::LVL_WARN || ring->used() * 2 > ring->capacity()) {
+        wake.notify_one();
+    }
+    return true;
+}
+
+void LogBackend::loop() {
+    while (isRunning()) {
+        {
+            std::unique_lock<std::mutex> l(wakeMutex);
+            wake.wait_for(l, LOG_INTERVAL);
+        }
+        drain();
+    }
+    drain();
+}
+
+void LogBackend::drain() {
+    std::vector<std::shared_ptr<LogRing>> current;
+    {
+        std::lock_guard<std::mutex> l(ringsMutex);
+        // a ring can go once its thread is gone or outgrew it, and it is drained
+        rings.erase(std::remove_if(rings.begin(), rings.end(),
+            [](const std::shared_ptr<LogRing> &ring) {
+                return ring->orphaned && ring->empty();
+            }), rings.end());
+        current = rings;
+    }
+
+    for (auto &ring : current) {
+        bool continued = false;
+        ring->consume([this, &continued](const LogRecord &record) {
+            if (continued) {
+                entries.back().message.append(record.text, record.length);
+            } else {
+                entries.push_back(Entry{record.time, record.level, record.name,
+                                        record.flush, record.updateId, record.chatId,
+                                        std::string(record.text, record.length)});
+            }
+            continued = record.more;
+        });
+    }
+
+    uint64_t droppedNow = dropped.load(std::memory_order_relaxed);
+    if (droppedNow != reportedDropped) {
+        entries.push_back(Entry{std::chrono::system_clock::now(), Logger::LVL_WARN,
+                                "Logger", true, 0, 0,
+                                std::to_string(droppedNow - reportedDropped)
+                                + " log messages dropped, the buffer was full"});
+        reportedDropped = droppedNow;
+    }
+
+    if (entries.empty()) {
+        return;
+    }
+
+    // each ring is in order, merge the threads by time
+    std::stable_sort(entries.begin(), entries.end(),
+        [](const Entry &a, const Entry &b) { return a.time < b.time; });
+
+    std::lock_guard<std::mutex> l(outputMutex);
+    for (const Entry &entry : entries) {
+        Logger::rotate(entry.time);
+        time_t second = std::chrono::system_clock::to_time_t(entry.time);
+        if (second != cachedSecond) {
+            formatTime(second, Logger::timeFormat, cachedTime);
+            cachedSecond = second;
+        }
+        Logger::write(Logger::Line{entry.time, cachedTime, entry.level, entry.name,
+                                   entry.message.c_str(), entry.flush,
+                                   entry.updateId, entry.chatId});
+    }
+    entries.clear();
+}
+
+/**
+ * Appends a string as a JSON string literal
+ */
+static void appendJsonString(std::string &out, const char *str) {
+    static const char HEX[] = "0123456789abcdef";
+    out += '"';
+    for (; *str; ++str) {
+        unsigned char c = *str;
+        switch (c) {
+        case '"': out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\t': out += "\\t"; break;
+        default:
+            if (c < 0x20) {
+                out += "\\u00";
+                out += HEX[c >> 4];
+                out += HEX[c & 0xf];
+            } else {
+                out += c;
+            }
+        }
+    }
+    out += '"';
+}
+
+void Logger::write(const Line &line) {
+    //print to console
+    printf(Logger::consolePrintFormat, line.timeStr, Logger::getLevelName(line.level),
+           line.name, line.message);
+
+    if (Logger::logFile.get()) {
+        //print to the file
+        if (fileFormat == FORMAT_JSON) {
+            std::string json = "{\"ts\":" + std::to_string(
+                std::chrono::duration_cast<std::chrono::milliseconds>(
+                    line.time.time_since_epoch()).count());
+            json += ",\"level\":\"";
+            json += Logger::getLevelName(line.level);
+            json += "\",\"logger\":";
+            appendJsonString(json, line.name);
+            if (line.updateId) {
+                json += ",\"update\":" + std::to_string(line.updateId);
+            }
+            if (line.chatId) {
+                json += ",\"chat\":" + std::to_string(line.chatId);
+            }
+            json += ",\"msg\":";
+            appendJsonString(json, line.message);
+            json += "}\n";
+            fileBytes += fwrite(json.data(), 1, json.size(), Logger::logFile.get());
+        } else {
+            int written = fprintf(Logger::logFile.get(), Logger::filePrintFormat,
+                                  line.timeStr, Logger::getLevelName(line.level),
+                                  line.name, line.message);
+            fileBytes += std::max(written, 0);
+        }
+
+        //flush if we're at either warn or error
+        if (line.flush || line.level <= LVL_WARN) {
+            fflush(Logger::logFile.get());
+        }
+    }
+}
+
+static FILE *openLogFile(const std::string &name) {
+    FILE *file = fopen(name.c_str(), "a");
+    if (file) {
+        fseek(file, 0, SEEK_END);
+        fileBytes = std::max(ftell(file), 0L);
+        fileOpened = std::chrono::system_clock::now();
+    }
+    return file;
+}
+
+void Logger::rotate(std::chrono::system_clock::time_point now) {
+    if (!logFile || !((rotateBytes && fileBytes >= rotateBytes) ||
+                      (rotateAge.count() && now - fileOpened >= rotateAge))) {
+        return;
+    }
+
+    logFile.reset(nullptr);
+    if (rotateKeep == 0) {
+        std::remove(logFileName.c_str());
+    } else {
+        // the rename over the last kept file deletes the oldest one
+        for (unsigned i = rotateKeep - 1; i > 0; --i) {
+            std::rename((logFileName + "." + std::to_string(i)).c_str(),
+                        (logFileName + "." + std::to_string(i + 1)).c_str());
+        }
+        std::rename(logFileName.c_str(), (logFileName + ".1").c_str());
+    }
+    logFile.reset(openLogFile(logFileName));
+}
+
 void Logger::log(LogLevel level, const char *message) {
     if (willLog(level)) {
+        if (backend->push(level, name, message, forceFlush)) {
+            return;
+        }
+
         //get time string
-        time_t currentTime;
-        time(&currentTime);
         char timeStr[MAX_TIME_STR_LEN];
-        strftime(timeStr, MAX_TIME_STR_LEN - 1,
-                 Logger::timeFormat, localtime(&currentTime));
-
-        //print to console
-        printf(Logger::consolePrintFormat, timeStr, Logger::getLevelName(level), name,
-               message);
-
-        if (Logger::logFile.get()) {
-            //print to the file
-            fprintf(Logger::logFile.get(), Logger::filePrintFormat, timeStr,
-                    Logger::getLevelName(level), name, message);
-			
-            //flush if we're at either warn or error
-            if (forceFlush || level <= LVL_WARN) {
-                fflush(Logger::logFile.get());
-            }
+        auto now = std::chrono::system_clock::now();
+        std::lock_guard<std::mutex> l(outputMutex);
+        formatTime(std::chrono::system_clock::to_time_t(now), timeFormat, timeStr);
+        rotate(now);
+        write(Line{now, timeStr, level, name, message, forceFlush,
+                   contextUpdateId, contextChatId});
+    }
+}
+
+const char *Logger::appendLiteral(std::string &out, const char *format) {
+    const char *start = format;
+    for (; *format; ++format) {
+        if ((format[0] == '{' && format[1] == '{') || (format[0] == '}' && format[1] == '}')) {
+            out.append(start, format + 1);
+            start = ++format + 1;
+        } else if (format[0] == '{' && format[1] == '}') {
+            break;
         }
     }
+    out.append(start, format);
+    return format;
 }
 
 void Logger::setLogFile(const char *file) {
+    std::unique_lock<std::mutex> l(outputMutex);
     if (strcmp(file, "NULL") != 0) {
-        Logger::logFile.reset(fopen(file, "a"));
+        logFileName = file;
+        Logger::logFile.reset(openLogFile(logFileName));
 
         if (!Logger::logFile.get()) {
-            logger.warn("Could not open log file"); //goes to the console
+            l.unlock();
+            LOG_WARN(logger, "Could not open log file"); //goes to the console
         }
     }else{ //if the file name was null just don't have a file
         Logger::logFile.reset(nullptr);
     }
 }
 
+void Logger::setFormat(Format format) {
+    std::lock_guard<std::mutex> l(outputMutex);
+    fileFormat = format;
+}
+
+Logger::Format Logger::parseFormat(const char *format) {
+    if (strcmp(format, "json") == 0) {
+        return FORMAT_JSON;
+    }
+    return FORMAT_TEXT;
+}
+
+void Logger::setRotation(size_t maxBytes, std::chrono::seconds maxAge, unsigned keep) {
+    std::lock_guard<std::mutex> l(outputMutex);
+    rotateBytes = maxBytes;
+    rotateAge = maxAge;
+    rotateKeep = keep;
+}
+
+Logger::Context::Context(int64_t updateId, int64_t chatId)
+    : oldUpdateId(contextUpdateId), oldChatId(contextChatId) {
+    contextUpdateId = updateId;
+    contextChatId = chatId;
+}
+
+Logger::Context::~Context() {
+    contextUpdateId = oldUpdateId;
+    contextChatId = oldChatId;
+}
+
+void Logger::startAsync(size_t bufferRecords, OverflowPolicy policy) {
+    static std::once_flag registered;
+    std::call_once(registered, []() {
+        std::atexit(Logger::stopAsync);
+    });
+    backend->start(bufferRecords, policy);
+}
+
+void Logger::stopAsync() {
+    backend->stop();
+}
+
+uint64_t Logger::getDropped() {
+    return backend->dropped.load(std::memory_order_relaxed);
+}
+
+Logger::OverflowPolicy Logger::parseOverflowPolicy(const char *policy) {
+    if (strcmp(policy, "drop") == 0) {
+        return OVERFLOW_DROP;
+    }
+    return OVERFLOW_BLOCK;
+}
+
 bool Logger::getForceFlush() const {
 	return forceFlush;
 }
@@ -95,11 +650,11 @@ void Logger::setForceFlush(bool forceFlush) {
 }
 
 bool Logger::willLog(LogLevel level) const {
-    return level <= globalLevel || level <= localLevel;
+    return level <= globalLevel.load(std::memory_order_relaxed) || level <= localLevel;
 }
 
 Logger::LogLevel Logger::getGlobalLogLevel() {
-    return Logger::globalLevel;
+    return static_cast<LogLevel>(Logger::globalLevel.load());
 }
 
 Logger::LogLevel Logger::getLocalLogLevel() const {
@@ -0,0 +1,209 @@
+/**
+ *  Copyright (C) 2015  Andrew Kallmeyer <fsmv@sapium.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the Lesser GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  Lesser GNU General Public License for more details.
+ *
+ *  You should have received a copy of the Lesser GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "luaalloc.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <new>
+
+const size_t LuaAllocator::GRANULARITY;
+const size_t LuaAllocator::MAX_POOLED;
+const size_t LuaAllocator::NUM_CLASSES;
+const size_t LuaAllocator::ARENA_SIZE;
+
+LuaAllocator::LuaAllocator(size_t limit)
+    : arenaNext(nullptr), arenaLeft(0), used(0), peak(0), limit(limit), reserved(0),
+      allocations(0), frees(0), failures(0), lastAllocations(0),
+      lastSample(std::chrono::steady_clock::now()) {
+
+    std::fill(freeLists, freeLists + NUM_CLASSES, nullptr);
+}
+
+LuaAllocator::~LuaAllocator() {
+    for (char *arena : arenas) {
+        std::free(arena);
+    }
+}
+
+void *LuaAllocator::alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+    return static_cast<LuaAllocator *>(ud)->reallocate(ptr, osize, nsize);
+}
+
+void LuaAllocator::addUsed(size_t bytes) {
+    size_t now = used.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    if (now > peak.load(std::memory_order_relaxed)) {
+        peak.store(now, std::memory_order_relaxed);
+    }
+}
+
+void *LuaAllocator::allocPooled(size_t size) {
+    size_t idx = size / GRANULARITY - 1;
+    FreeBlock *block = freeLists[idx];
+    if (block) {
+        freeLists[idx] = block->next;
+        return block;
+    }
+
+    if (arenaLeft < size) {
+        // the tail of the old arena is too small for this class, just drop it
+        char *arena = static_cast<char *>(std::malloc(ARENA_SIZE));
+        if (!arena) {
+            return nullptr;
+        }
+        try {
+            arenas.push_back(arena);
+        } catch (std::bad_alloc &e) {
+            std::free(arena);
+            return nullptr;
+        }
+        reserved.fetch_add(ARENA_SIZE, std::memory_order_relaxed);
+        reserveArenaSlot();
+        arenaNext = arena;
+        arenaLeft = ARENA_SIZE;
+    }
+
+    void *result = arenaNext;
+    arenaNext += size;
+    arenaLeft -= size;
+    return result;
+}
+
+void LuaAllocator::reserveArenaSlot() {
+    // keeps adoptBlock from having to allocate
+    try {
+        arenas.reserve(arenas.size() + 1);
+    } catch (std::bad_alloc &e) {
+    }
+}
+
+void LuaAllocator::adoptBlock(void *ptr, size_t size) {
+    try {
+        arenas.push_back(static_cast<char *>(ptr));
+    } catch (std::bad_alloc &e) {
+        return; // leaked when the allocator is destroyed, but still usable
+    }
+    reserved.fetch_add(size, std::memory_order_relaxed);
+    reserveArenaSlot();
+}
+
+void LuaAllocator::freePooled(void *ptr, size_t size) {
+    size_t idx = size / GRANULARITY - 1;
+    FreeBlock *block = static_cast<FreeBlock *>(ptr);
+    block->next = freeLists[idx];
+    freeLists[idx] = block;
+}
+
+void *LuaAllocator::reallocate(void *ptr, size_t osize, size_t nsize) {
+    // when ptr is NULL lua passes the object type in osize
+    size_t oldBlock = ptr ? blockSize(osize) : 0;
+
+    if (nsize == 0) {
+        if (ptr) {
+            if (oldBlock <= MAX_POOLED) {
+                freePooled(ptr, oldBlock);
+            } else {
+                std::free(ptr);
+            }
+            used.fetch_sub(oldBlock, std::memory_order_relaxed);
+            frees.fetch_add(1, std::memory_order_relaxed);
+        }
+        return nullptr;
+    }
+
+    size_t newBlock = blockSize(nsize);
+    if (ptr && newBlock == oldBlock) {
+        return ptr;
+    }
+
+    // shrinking must never fail, lua assumes it can't
+    size_t max = limit.load(std::memory_order_relaxed);
+    if (max != 0 && newBlock > oldBlock &&
+        used.load(std::memory_order_relaxed) + (newBlock - oldBlock) > max) {
+
+        failures.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    void *result;
+    if (oldBlock > MAX_POOLED && newBlock > MAX_POOLED) {
+        result = std::realloc(ptr, newBlock);
+        if (!result) {
+            if (newBlock > oldBlock) {
+                return nullptr;
+            }
+            result = ptr; // the old block is big enough
+        }
+    } else {
+        if (newBlock <= MAX_POOLED) {
+            result = allocPooled(newBlock);
+        } else {
+            result = std::malloc(newBlock);
+        }
+        if (!result) {
+            if (!ptr || newBlock > oldBlock) {
+                return nullptr;
+            }
+            // keep the block in place, once lua frees it the pool takes it
+            // as a block of the smaller class
+            if (oldBlock > MAX_POOLED) {
+                adoptBlock(ptr, oldBlock);
+            }
+            result = ptr;
+        } else if (ptr) {
+            std::memcpy(result, ptr, std::min(osize, nsize));
+            if (oldBlock <= MAX_POOLED) {
+                freePooled(ptr, oldBlock);
+            } else {
+                std::free(ptr);
+            }
+        }
+    }
+
+    if (!ptr) {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    if (newBlock > oldBlock) {
+        addUsed(newBlock - oldBlock);
+    } else {
+        used.fetch_sub(oldBlock - newBlock, std::memory_order_relaxed);
+    }
+
+    return result;
+}
+
+LuaAllocator::Stats LuaAllocator::sample() {
+    Stats stats;
+    stats.used = getUsed();
+    stats.peak = getPeak();
+    stats.limit = getLimit();
+    stats.reserved = reserved.load(std::memory_order_relaxed);
+    stats.allocations = allocations.load(std::memory_order_relaxed);
+    stats.frees = frees.load(std::memory_order_relaxed);
+    stats.failures = failures.load(std::memory_order_relaxed);
+
+    auto now = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(now - lastSample).count();
+    stats.allocationRate = seconds > 0
+        ? (stats.allocations - lastAllocations) / seconds : 0;
+    lastAllocations = stats.allocations;
+    lastSample = now;
+
+    return stats;
+}
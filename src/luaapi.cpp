@@ -20,15 +20,17 @@
 #include "plugin.h"
 #include "logger.h"
 #include "config.h"
+#include "asyncio.h"
+#include "http.h"
+#include "store.h"
+#include "chatstate.h"
 
-extern "C" {
-    #include "lua.h"
-    #include "lualib.h"
-    #include "lauxlib.h"
-}
+#include "luacompat.h"
 
 #include <cassert>
+#include <cmath>
 #include <algorithm>
+#include <memory>
 
 static Logger logger("LuaAPI");
 
@@ -41,7 +43,7 @@ static inline void pushVal(lua_State *L, json::const_reference elm) {
             break;
         case json::value_t::object:
         case json::value_t::array:
-            logger.error("Called internal function pushVal with invalid argument");
+            LOG_ERROR(logger, "Called internal function pushVal with invalid argument");
             assert(0);
             break;
         case json::value_t::string:
@@ -52,17 +54,21 @@ static inline void pushVal(lua_State *L, json::const_reference elm) {
             break;
         case json::value_t::number_integer:
         case json::value_t::number_float:
-            lua_pushnumber(L, elm.get<float>());
+            lua_pushnumber(L, elm.get<lua_Number>());
             break;
     }
 }
 
-static void pushJsonTable(lua_State *L, const json &j) {
+void pushJsonTable(lua_State *L, const json &j) {
     lua_newtable(L);
     int i = 0;
     luaL_checkstack(L, j.size(), "Could not fit table on stack");
     for (auto elm = j.begin(); elm != j.end(); ++elm) {
-        lua_pushstring(L, elm.key().c_str());
+        if (j.type() == json::value_t::array) {
+            lua_pushnumber(L, ++i); // lua arrays start at 1
+        } else {
+            lua_pushstring(L, elm.key().c_str());
+        }
         if (elm->type() == json::value_t::array ||
             elm->type() == json::value_t::object) {
 
@@ -78,8 +84,14 @@ static json::value_type readValue(lua_State *L, int stackIdx) {
     switch(lua_type(L, stackIdx)) {
         case LUA_TBOOLEAN:
             return static_cast<bool>(lua_toboolean(L, stackIdx));
-        case LUA_TNUMBER:
-            return lua_tonumber(L, stackIdx);
+        case LUA_TNUMBER: {
+            // whole numbers are kept as integers so they serialize exactly
+            lua_Number n = lua_tonumber(L, stackIdx);
+            if (std::floor(n) == n && std::fabs(n) <= 9007199254740992.0) {
+                return static_cast<int64_t>(n);
+            }
+            return n;
+        }
         case LUA_TSTRING:
             return std::string(lua_tostring(L, stackIdx));
         default:
@@ -99,7 +111,11 @@ static json readLuaTable(lua_State *L, int stackIdx) {
     // stack: nil, table
     while(lua_next(L, -2) != 0) {  // pop key. if next exists, push next key then value
         // stack: value, key, table
-        std::string key = std::string(lua_tostring(L, -2)); // read the key
+        // read a copy of the key, lua_tostring would turn a number key into
+        // a string and break lua_next
+        lua_pushvalue(L, -2);
+        std::string key = std::string(lua_tostring(L, -1));
+        lua_pop(L, 1);
         if (lua_istable(L, -1)) { // is value another table?
             result[key] = readLuaTable(L, -1);
         } else {
@@ -117,20 +133,82 @@ static json readLuaTable(lua_State *L, int stackIdx) {
     return result;
 }
 
-static const PluginRunState *getRunState(lua_State *L) {
-    lua_getglobal(L, "TG_RUN_STATE");
-    if(lua_islightuserdata(L, -1)) {
-        const void *ptr = lua_topointer(L, -1);
-        lua_pop(L, 1);
-        return reinterpret_cast<const PluginRunState *>(ptr);
+static PluginRunState *getRunState(lua_State *L) {
+    lua_getfield(L, LUA_REGISTRYINDEX, "PB_PLUGIN");
+    Plugin *plugin = static_cast<Plugin *>(lua_touserdata(L, -1));
+    lua_pop(L, 1);
+
+    PluginRunState *state = plugin ? plugin->getRunState(L) : nullptr;
+    if (!state) {
+        luaL_error(L, "API functions can only be called from run"); // long jumps
+    }
+    return state;
+}
+
+// returned by runIO when the run has to yield until its job is done
+static const int IO_YIELD = -1;
+
+/**
+ * Runs a blocking io job for an api function
+ *
+ * Async plugins yield the run until the job is done, everyone else blocks.
+ * The completion runs on the dispatcher thread and pushes the return values
+ * of the api function onto L.
+ *
+ * Use as the return statement of a helper whose result goes to yieldForIO.
+ * @return the number of values complete pushed, or IO_YIELD
+ */
+static int runIO(lua_State *L, const std::function<void()> &work,
+                 const std::function<int(lua_State *)> &complete) {
+    PluginRunState *currentRun = getRunState(L);
+    if (!currentRun->plugin->isAsync()) {
+        work();
+        return complete(L);
     }
 
-    return nullptr;
+    // keep the plugin alive in case it is reloaded while we wait
+    std::shared_ptr<Plugin> plugin = currentRun->plugin->shared_from_this();
+    submitIO(work, [L, plugin, complete]() {
+        plugin->resume(L, complete(L));
+    });
+    return IO_YIELD;
 }
 
-static void l_sendMessage(lua_State *L, bool reply) {
-    std::string message = std::string(luaL_checkstring(L, 1));
-    const PluginRunState *currentRun = getRunState(L);
+/**
+ * Finishes an api function that called runIO
+ *
+ * lua_yield longjmps out of the api function in lua 5.2, skipping the
+ * destructors of everything still in scope. The helper that called runIO has
+ * returned by now so nothing is left to destruct.
+ */
+static int yieldForIO(lua_State *L, int results) {
+    return results == IO_YIELD ? lua_yield(L, 0) : results;
+}
+
+/**
+ * Keeps a copy of a message for the reply cache if the run is cacheable
+ */
+static void recordReply(PluginRunState *run, const std::string &message,
+                        bool reply, bool markdown, bool disable_preview) {
+    if (!run->cacheKey.empty()) {
+        run->replies.push_back(CachedMessage{message, reply, markdown, disable_preview});
+    }
+}
+
+static int sendMessage(lua_State *L, bool reply) {
+    luaL_checkstring(L, 1);
+    PluginRunState *currentRun = getRunState(L);
+
+    // before any locals that need destructing, luaL_error doesn't run them
+    int64_t chat_id;
+    if (!getUpdateChat(currentRun->update, &chat_id)) {
+        return luaL_error(L, "The update has no chat to send to");
+    }
+    int reply_message = -1;
+    if (reply && !getUpdateMessageId(currentRun->update, &reply_message)) {
+        return luaL_error(L, "The update has no message to reply to");
+    }
+    std::string message = std::string(lua_tostring(L, 1));
 
     bool markdown = true, disable_preview = false;
     switch (lua_gettop(L)) { // read optional arguments; switch on number of args
@@ -144,29 +222,64 @@ static void l_sendMessage(lua_State *L, bool reply) {
         ;
     }
 
-    int reply_message = -1;
-    if (reply) {
-        reply_message = currentRun->update["message"]["message_id"].get<int>();
-    }
-
-    tg_sendMessage(message,
-             currentRun->update["message"]["chat"]["id"].get<int>(),
-             reply_message, markdown, disable_preview);
+    recordReply(currentRun, message, reply, markdown, disable_preview);
+    return runIO(L, [=]() {
+        tg_sendMessage(message, chat_id, reply_message, markdown, disable_preview);
+    }, [](lua_State *) { return 0; });
 }
 
 static int l_send(lua_State *L) {
-    l_sendMessage(L, false);
-    return 0;
+    return yieldForIO(L, sendMessage(L, false));
 }
 
 static int l_reply(lua_State *L) {
-    l_sendMessage(L, true);
-    return 0;
+    return yieldForIO(L, sendMessage(L, true));
 }
 
 static int l_getSender(lua_State *L) {
     const PluginRunState *currentRun = getRunState(L);
-    pushJsonTable(L, currentRun->update["message"]["from"]);
+    const json *sender = getUpdateSender(currentRun->update);
+    if (sender) {
+        pushJsonTable(L, *sender);
+    } else {
+        lua_pushnil(L);
+    }
+    return 1;
+}
+
+static int l_getUpdate(lua_State *L) {
+    const PluginRunState *currentRun = getRunState(L);
+    pushJsonTable(L, currentRun->update);
+    return 1;
+}
+
+static int l_updateType(lua_State *L) {
+    const PluginRunState *currentRun = getRunState(L);
+    lua_pushstring(L, getUpdateTypeName(getUpdateType(currentRun->update)));
+    return 1;
+}
+
+static int l_getHelp(lua_State *L) {
+    std::string help;
+    auto plugins = getPlugins();
+    if (!plugins) { // still loading
+        lua_pushstring(L, "");
+        return 1;
+    }
+    if (lua_isnoneornil(L, 1)) { // every plugin
+        for (auto &plugin : *plugins) {
+            help += plugin->getHelpText() + "\n";
+        }
+    } else {
+        std::string name = std::string(luaL_checkstring(L, 1));
+        for (auto &plugin : *plugins) {
+            if (plugin->getName() == name) {
+                help = plugin->getHelpText();
+            }
+        }
+    }
+
+    lua_pushlstring(L, help.data(), help.size());
     return 1;
 }
 
@@ -175,8 +288,7 @@ static int l_getConfig(lua_State *L) {
     std::string confopt = std::string(luaL_checkstring(L, 1));
 
     if (currentRun->plugin->config == nullptr) {
-        logger.warn("Missing config for plugin: " +
-                    currentRun->plugin->getName());
+        LOG_WARN(logger, "Missing config for plugin: {}", currentRun->plugin->getName());
         lua_pushnil(L);
         return 1;
     }
@@ -200,91 +312,362 @@ static int l_setConfig(lua_State *L) {
     const PluginRunState *currentRun = getRunState(L);
     auto &conf = *currentRun->plugin->config.get();
 
+    // saved in the background, setting it every message costs no disk io
     if (lua_istable(L, 2)) {
-        conf[confopt] = readLuaTable(L, 2);
+        conf.set(confopt, readLuaTable(L, 2));
     } else {
-        conf[confopt] = readValue(L, 2);
+        conf.set(confopt, readValue(L, 2));
     }
-
-    currentRun->plugin->config->setChanged();
     return 0;
 }
 
-static std::string getMsgFile(const json &message, std::string *file_id) {
-    auto contains = [message](const std::string &s) {
-        return message.find(s) != message.end();
-    };
+static int l_messageType(lua_State *L) {
+    const PluginRunState *currentRun = getRunState(L);
+    const json *msg = getUpdateMessage(currentRun->update);
+    lua_pushstring(L, msg ? getMessageFile(*msg, nullptr).c_str() : "UNKNOWN");
+    return 1;
+}
+
+static int downloadFile(lua_State *L) {
+    const PluginRunState *currentRun = getRunState(L);
+    const json *msg = getUpdateMessage(currentRun->update);
+    std::string file_id = "";
+    std::string type = msg ? getMessageFile(*msg, &file_id) : "UNKNOWN";
+
+    std::string filename = currentRun->plugin->getPath() + file_id;
+    std::shared_ptr<bool> success(new bool(false));
+    return runIO(L, [=]() {
+        if (file_id != "") {
+            *success = tg_downloadFile(file_id, filename);
+        }
+    }, [=](lua_State *L) {
+        if (*success) {
+            lua_pushstring(L, filename.c_str());
+        } else {
+            lua_pushnil(L);
+        }
+
+        lua_pushstring(L, type.c_str());
+        return 2;
+    });
+}
+
+static int l_downloadFile(lua_State *L) {
+    return yieldForIO(L, downloadFile(L));
+}
+
+static int fetch(lua_State *L) {
+    // before the request exists, the errors long jump past its destructor
+    const char *url = luaL_checkstring(L, 1);
+    if (!lua_istable(L, 2) && !lua_isnoneornil(L, 2)) {
+        return luaL_argerror(L, 2, "options must be a table");
+    }
+
+    HttpRequest request;
+    request.url = std::string(url);
 
-    if (contains("audio")) {
-        if (file_id) {
-            *file_id = message["audio"]["file_id"].get<std::string>();
+    if (lua_istable(L, 2)) { // read the options table
+        lua_getfield(L, 2, "method");
+        if (lua_isstring(L, -1)) {
+            request.method = std::string(lua_tostring(L, -1));
         }
-        return "AUDIO";
-    } else if (contains("document")) {
-        if (file_id) {
-            *file_id = message["document"]["file_id"].get<std::string>();
+        lua_getfield(L, 2, "body");
+        if (lua_isstring(L, -1)) {
+            request.body = std::string(lua_tostring(L, -1));
         }
-        return "FILE";
-    } else if (contains("photo")) {
-        if (file_id) {
-            auto photo = std::max_element(message["photo"].begin(),
-                                          message["photo"].end(),
-                [](const json &lhs, const json &rhs) {
-                    return lhs["width"].get<int>() * lhs["height"].get<int>() <
-                           rhs["width"].get<int>() * rhs["height"].get<int>();
-                });
-
-            *file_id = (*photo)["file_id"].get<std::string>();
+        lua_getfield(L, 2, "timeout");
+        if (lua_isnumber(L, -1)) {
+            request.timeoutMs = static_cast<long>(lua_tonumber(L, -1) * 1000);
         }
-        return "PHOTO";
-    } else if (contains("sticker")) {
-        if (file_id) {
-            *file_id = message["sticker"]["file_id"].get<std::string>();
+        lua_getfield(L, 2, "cache");
+        if (lua_isnumber(L, -1)) {
+            request.cacheTTL = static_cast<int>(lua_tonumber(L, -1));
         }
-        return "STICKER";
-    } else if (contains("video")) {
-        if (file_id) {
-            *file_id = message["video"]["file_id"].get<std::string>();
+        lua_pop(L, 4);
+
+        lua_getfield(L, 2, "headers");
+        if (lua_istable(L, -1)) {
+            lua_pushnil(L);
+            while (lua_next(L, -2) != 0) {
+                if (lua_type(L, -2) == LUA_TSTRING && lua_isstring(L, -1)) {
+                    request.headers.push_back(std::string(lua_tostring(L, -2))
+                        + ": " + std::string(lua_tostring(L, -1)));
+                }
+                lua_pop(L, 1);
+            }
         }
-        return "VIDEO";
-    } else if (contains("contact")) {
-        return "CONTACT";
-    } else if (contains("location")) {
-        return "LOCATION";
-    } else if (contains("text")) {
-        return "TEXT";
+        lua_pop(L, 1);
+    }
+
+    std::shared_ptr<HttpResponse> response(new HttpResponse);
+    return runIO(L, [=]() {
+        *response = httpFetch(request);
+    }, [=](lua_State *L) {
+        if (response->status == 0) {
+            lua_pushnil(L);
+            lua_pushstring(L, response->error.c_str());
+        } else {
+            lua_pushlstring(L, response->body.data(), response->body.size());
+            lua_pushnumber(L, response->status);
+        }
+        return 2;
+    });
+}
+
+static int l_fetch(lua_State *L) {
+    return yieldForIO(L, fetch(L));
+}
+
+/**
+ * Returns the store namespace of the plugin that owns the lua state
+ */
+static std::string storeNamespace(lua_State *L) {
+    lua_getfield(L, LUA_REGISTRYINDEX, "PB_PLUGIN");
+    Plugin *plugin = static_cast<Plugin *>(lua_touserdata(L, -1));
+    lua_pop(L, 1);
+    if (!plugin) {
+        luaL_error(L, "The store can't be used while the plugin loads");
+    }
+    return plugin->getName();
+}
+
+static int l_storeGet(lua_State *L) {
+    std::string key = std::string(luaL_checkstring(L, 1));
+    std::string value;
+    if (!Store::global().get(storeNamespace(L), key, &value)) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    json stored;
+    try {
+        stored = json::parse(value);
+    } catch (std::invalid_argument &e) {
+        LOG_ERROR(logger, "Corrupt store value for {}", key);
+        lua_pushnil(L);
+        return 1;
+    }
+
+    const json &v = stored["v"];
+    if (v.is_object() || v.is_array()) {
+        pushJsonTable(L, v);
     } else {
-        return "UNKNOWN";
+        pushVal(L, v);
     }
+    return 1;
 }
 
-static int l_messageType(lua_State *L) {
+static int l_storeSet(lua_State *L) {
+    std::string key = std::string(luaL_checkstring(L, 1));
+    if (lua_isnoneornil(L, 2)) {
+        Store::global().remove(storeNamespace(L), key);
+        return 0;
+    }
+    if (lua_isuserdata(L, 2) || lua_isthread(L, 2) || lua_isfunction(L, 2)) {
+        luaL_argerror(L, 2, "Cannot store a thread, function, or userdata");
+        return 0;
+    }
+
+    // wrapped so that plain values are valid json documents too
+    json stored;
+    stored["v"] = lua_istable(L, 2) ? readLuaTable(L, 2) : readValue(L, 2);
+    Store::global().set(storeNamespace(L), key, stored.dump());
+    return 0;
+}
+
+static int l_storeDelete(lua_State *L) {
+    std::string key = std::string(luaL_checkstring(L, 1));
+    Store::global().remove(storeNamespace(L), key);
+    return 0;
+}
+
+/**
+ * Reads the chat id argument at idx, defaulting to the chat of the run
+ */
+static int64_t chatArgument(lua_State *L, int idx) {
+    if (!lua_isnoneornil(L, idx)) {
+        return static_cast<int64_t>(luaL_checknumber(L, idx));
+    }
+
     const PluginRunState *currentRun = getRunState(L);
-    const auto &msg = currentRun->update["message"];
-    lua_pushstring(L, getMsgFile(msg, nullptr).c_str());
+    int64_t chat;
+    if (!getUpdateChat(currentRun->update, &chat)) {
+        luaL_error(L, "The update has no chat, pass a chat id");
+    }
+    return chat;
+}
+
+// chat state keys belong to the plugin of the run
+static std::string chatStatePlugin(lua_State *L) {
+    return getRunState(L)->plugin->getName();
+}
+
+static int l_chatStateGet(lua_State *L) {
+    int64_t chat = chatArgument(L, 2);
+    std::string key = std::string(luaL_checkstring(L, 1));
+    json value;
+    if (!ChatState::global().get(chatStatePlugin(L), chat, key, &value)) {
+        lua_pushnil(L);
+    } else if (value.is_object() || value.is_array()) {
+        pushJsonTable(L, value);
+    } else {
+        pushVal(L, value);
+    }
     return 1;
 }
 
-static int l_downloadFile(lua_State *L) {
-    const PluginRunState *currentRun = getRunState(L);
-    const auto &msg = currentRun->update["message"];
-    std::string file_id = "";
-    std::string type = getMsgFile(msg, &file_id);
+static int l_chatStateSet(lua_State *L) {
+    int64_t chat = chatArgument(L, 3);
+    std::string key = std::string(luaL_checkstring(L, 1));
+    std::string plugin = chatStatePlugin(L);
+    if (lua_isnoneornil(L, 2)) {
+        ChatState::global().set(plugin, chat, key, json());
+        return 0;
+    }
+    if (lua_isuserdata(L, 2) || lua_isthread(L, 2) || lua_isfunction(L, 2)) {
+        luaL_argerror(L, 2, "Cannot store a thread, function, or userdata");
+        return 0;
+    }
 
-    bool success = false;
-    std::string filename = currentRun->plugin->getPath() + file_id;
-    if (file_id != "") {
-        success = tg_downloadFile(file_id, filename);
+    json value = lua_istable(L, 2) ? readLuaTable(L, 2) : readValue(L, 2);
+    ChatState::global().set(plugin, chat, key, value);
+    return 0;
+}
+
+static int l_chatStateIncr(lua_State *L) {
+    int64_t chat = chatArgument(L, 3);
+    double delta = luaL_optnumber(L, 2, 1);
+    std::string key = std::string(luaL_checkstring(L, 1));
+    lua_pushnumber(L, ChatState::global().incr(chatStatePlugin(L), chat, key, delta));
+    return 1;
+}
+
+/*
+ * The ffi fast path
+ *
+ * Under LuaJIT calling a lua_CFunction stops the trace being compiled, so a
+ * hot loop that calls the api never gets jitted. These plain C functions are
+ * called through the ffi library instead, which the JIT compiles inline. They
+ * find the run through Plugin::currentRun() because they don't get a
+ * lua_State. The pb module below wraps them, and falls back to the normal api
+ * on stock lua so plugins using it run on both.
+ */
+extern "C" {
+
+/**
+ * Returns the type of the message that triggered the current run, see
+ * messageType(). The pointer is valid until the next call.
+ */
+const char *pb_message_type() {
+    static thread_local std::string type;
+    const PluginRunState *currentRun = Plugin::currentRun();
+    if (!currentRun) {
+        return "";
     }
+    const json *msg = getUpdateMessage(currentRun->update);
+    type = msg ? getMessageFile(*msg, nullptr) : "UNKNOWN";
+    return type.c_str();
+}
 
-    if (success) {
-        lua_pushstring(L, filename.c_str());
-    } else {
-        lua_pushnil(L);
+/**
+ * Reads a number from the current plugin's config
+ *
+ * @param key the config option
+ * @param def returned if the option isn't set or isn't a number
+ */
+double pb_config_number(const char *key, double def) {
+    const PluginRunState *currentRun = Plugin::currentRun();
+    if (!currentRun || !currentRun->plugin->config) {
+        return def;
+    }
+
+    const auto &conf = *currentRun->plugin->config;
+    auto elm = conf.find(key);
+    if (elm == conf.end() || !elm->is_number()) {
+        return def;
+    }
+    return elm->get<double>();
+}
+
+/**
+ * Queues a message to the chat of the current run
+ *
+ * Unlike send() this never waits for the message to be sent.
+ * @param reply nonzero to reply to the triggering message
+ * @return 0 if there is no current run or the update has no chat (or no
+ *         message to reply to), 1 otherwise
+ */
+int pb_send(const char *text, size_t len, int reply) {
+    PluginRunState *currentRun = Plugin::currentRun();
+    if (!currentRun) {
+        return 0;
     }
 
-    lua_pushstring(L, type.c_str());
-    return 2;
+    int64_t chat_id;
+    int reply_message = -1;
+    if (!getUpdateChat(currentRun->update, &chat_id) ||
+        (reply && !getUpdateMessageId(currentRun->update, &reply_message))) {
+        return 0;
+    }
+    std::string message(text, len);
+    recordReply(currentRun, message, reply != 0, true, false);
+    submitIO([=]() {
+        tg_sendMessage(message, chat_id, reply_message);
+    }, []() {});
+    return 1;
+}
+
+}
+
+#ifdef PB_LUAJIT
+static const char pbModule[] =
+    "local ffi = require 'ffi'\n"
+    "ffi.cdef[[\n"
+    "const char *pb_message_type();\n"
+    "double pb_config_number(const char *key, double def);\n"
+    "int pb_send(const char *text, size_t len, int reply);\n"
+    "]]\n"
+    "local C = ffi.C\n"
+    "return {\n"
+    "  jit = true,\n"
+    "  send = function(text) return C.pb_send(text, #text, 0) ~= 0 end,\n"
+    "  reply = function(text) return C.pb_send(text, #text, 1) ~= 0 end,\n"
+    "  messageType = function() return ffi.string(C.pb_message_type()) end,\n"
+    "  configNumber = function(key, def) return C.pb_config_number(key, def or 0) end,\n"
+    "}\n";
+#else
+static const char pbModule[] =
+    "local send, reply, messageType, getConfig = send, reply, messageType, getConfig\n"
+    "return {\n"
+    "  jit = false,\n"
+    "  send = function(text) send(text) return true end,\n"
+    "  reply = function(text) reply(text) return true end,\n"
+    "  messageType = messageType,\n"
+    "  configNumber = function(key, def)\n"
+    "    local value = getConfig(key)\n"
+    "    if type(value) == 'number' then return value end\n"
+    "    return def or 0\n"
+    "  end,\n"
+    "}\n";
+#endif
+
+/**
+ * Makes require "pb" load the fast path module
+ */
+static void injectModule(lua_State *L) {
+    lua_getglobal(L, "package");
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        return;
+    }
+    lua_getfield(L, -1, "preload");
+    if (luaL_loadbuffer(L, pbModule, sizeof(pbModule) - 1, "=pb") != LUA_OK) {
+        LOG_ERROR(logger, "Could not load the pb module: {}", lua_tostring(L, -1));
+        lua_pop(L, 3);
+        return;
+    }
+    lua_setfield(L, -2, "pb");
+    lua_pop(L, 2);
 }
 
 #define LUA_INJECT(func) \
@@ -295,8 +678,35 @@ void injectAPIFunctions(lua_State *L) {
     LUA_INJECT(send);
     LUA_INJECT(reply);
     LUA_INJECT(getSender);
+    LUA_INJECT(getUpdate);
+    LUA_INJECT(updateType);
+    LUA_INJECT(getHelp);
     LUA_INJECT(getConfig);
     LUA_INJECT(setConfig);
     LUA_INJECT(messageType);
     LUA_INJECT(downloadFile);
+    LUA_INJECT(fetch);
+
+    // store.get(key), store.set(key, value) and store.delete(key)
+    lua_newtable(L);
+    lua_pushcfunction(L, l_storeGet);
+    lua_setfield(L, -2, "get");
+    lua_pushcfunction(L, l_storeSet);
+    lua_setfield(L, -2, "set");
+    lua_pushcfunction(L, l_storeDelete);
+    lua_setfield(L, -2, "delete");
+    lua_setglobal(L, "store");
+
+    // chatState.get(key [, chat]), chatState.set(key, value [, chat]) and
+    // chatState.incr(key [, delta [, chat]])
+    lua_newtable(L);
+    lua_pushcfunction(L, l_chatStateGet);
+    lua_setfield(L, -2, "get");
+    lua_pushcfunction(L, l_chatStateSet);
+    lua_setfield(L, -2, "set");
+    lua_pushcfunction(L, l_chatStateIncr);
+    lua_setfield(L, -2, "incr");
+    lua_setglobal(L, "chatState");
+
+    injectModule(L);
 }
@@ -18,15 +18,85 @@
 #include <string>
 #include <iostream>
 #include <thread>
+#include <memory>
+#include <algorithm>
 
 #include "webhooks.h"
 #include "telegram.h"
 #include "logger.h"
 #include "config.h"
 #include "plugin.h"
+#include "gcscheduler.h"
+#include "router.h"
+#include "lanes.h"
+#include "floodfilter.h"
+#include "store.h"
+#include "configsaver.h"
+#include "metrics.h"
+#include "asyncio.h"
+#include "tracing.h"
 
 static bool running;
 static bool output;
+static std::unique_ptr<FloodFilter> floodFilter;
+
+static void printMemoryStats() {
+    auto plugins = getPlugins();
+    if (!plugins) {
+        std::cout << "Plugins are not loaded yet" << std::endl;
+        return;
+    }
+
+    for (auto &p : *plugins) {
+        LuaAllocator::Stats stats = p->getAllocator().sample();
+        std::cout << p->getName() << ": "
+                  << stats.used / 1024 << "KiB used, "
+                  << stats.peak / 1024 << "KiB peak, "
+                  << stats.reserved / 1024 << "KiB pooled, limit "
+                  << (stats.limit ? std::to_string(stats.limit / 1024) + "KiB"
+                                  : std::string("none")) << ", "
+                  << stats.allocationRate << " allocs/s, "
+                  << stats.failures << " failed" << std::endl;
+    }
+}
+
+static void printGCStats() {
+    auto plugins = getPlugins();
+    if (!plugins) {
+        std::cout << "Plugins are not loaded yet" << std::endl;
+        return;
+    }
+
+    for (auto &p : *plugins) {
+        GCStats &stats = p->getGCStats();
+        std::cout << p->getName() << ": "
+                  << stats.steps << " steps, "
+                  << stats.fullCollections << " full collections, "
+                  << stats.nanoseconds / 1000000 << "ms total" << std::endl;
+    }
+}
+
+static void printShedStats() {
+    auto plugins = getPlugins();
+    if (!plugins) {
+        std::cout << "Plugins are not loaded yet" << std::endl;
+        return;
+    }
+
+    for (auto &p : *plugins) {
+        std::cout << p->getName() << ": "
+                  << p->getShed() << " stale runs skipped, "
+                  << p->getShedReplies() << " stale replies, "
+                  << p->getCacheHits() << " cached replies" << std::endl;
+    }
+}
+
+static void printFloodStats() {
+    std::cout << floodFilter->getAllowed() << " updates allowed, "
+              << floodFilter->getUserDropped() << " dropped by user limit, "
+              << floodFilter->getChatDropped() << " dropped by chat limit"
+              << std::endl;
+}
 
 static void repl() {
     std::cout << "$ " << std::flush;
@@ -39,38 +109,153 @@ static void repl() {
 
     if (command == "quit") {
         running = false;
+    } else if (command == "memory") {
+        printMemoryStats();
+    } else if (command == "gc") {
+        printGCStats();
+    } else if (command == "shed") {
+        printShedStats();
+    } else if (command == "flood") {
+        printFloodStats();
+    } else if (command == "reload") {
+        auto plugins = getPlugins();
+        if (plugins) {
+            for (auto &p : *plugins) {
+                reloadPlugin(p->getName());
+            }
+        }
+    } else if (command.find("reload ") == 0) {
+        reloadPlugin(command.substr(std::string("reload ").size()));
     } else if (command != "") {
         std::cout << "Invalid command" << std::endl;
     }
 }
 
+/**
+ * Runs the queued plugin runs until they're done, but goes back for new
+ * updates after a background run so their commands can jump the queue
+ */
+static void runLanes(LaneScheduler &lanes) {
+    Lane lane;
+    while ((lane = lanes.runNext()) != LANE_COUNT) {
+        if (lane == LANE_BACKGROUND && hasPendingUpdates()) {
+            return;
+        }
+    }
+}
+
+/**
+ * Publishes the lua memory of each plugin when the metrics are read
+ */
+static void collectPluginMemory() {
+    std::shared_ptr<const PluginSet> plugins = getPlugins();
+    if (!plugins) {
+        return;
+    }
+    for (auto &plugin : *plugins) {
+        Metrics::global().gauge("pb_plugin_lua_bytes", "Memory used by the plugin's lua state",
+                                Metrics::label("plugin", plugin->getName()))
+            .set(plugin->getAllocator().getUsed());
+    }
+}
+
 static void runPlugins() {
-    std::vector<Plugin> plugins;
-    if (loadPlugins(&plugins)) {
-        while (running) {
-            waitForUpdate();
-
-            std::queue<json> updates = popAllUpdates();
-            while (!updates.empty()) {
-                auto update = updates.front();
-                updates.pop();
-
-                static int lastUpdateID = 0;
-                if (update.find("update_id") != update.end()) {
-                    int update_id = update["update_id"].get<int>();
-                    if (lastUpdateID >= update_id) {
-                        continue; // reject a message we've already seen
-                    }
-                    lastUpdateID = update_id;
+    Tracer::global().nameThread("dispatcher");
+    Metrics::global().addCollector(collectPluginMemory);
+    publishPlugins(loadPlugins());
+    setAcceptingUpdates(true);
+    startIOWorkers(std::max(0, Config::global()->get<int>("io_threads", 4)));
+
+    if (Config::global()->get<bool>("watch_plugins", true)) {
+        watchPlugins();
+    }
+
+    GCScheduler gc;
+    UpdateRouter router;
+    LaneScheduler lanes;
+    unsigned configGeneration = Config::generation();
+    Gauge *laneDepth[LANE_COUNT] = {
+        &Metrics::global().gauge("pb_lane_depth", "Plugin runs waiting in a lane",
+                                 Metrics::label("lane", "interactive")),
+        &Metrics::global().gauge("pb_lane_depth", "Plugin runs waiting in a lane",
+                                 Metrics::label("lane", "background"))
+    };
+    while (running) {
+        if (configGeneration != Config::generation()) {
+            configGeneration = Config::generation();
+            gc.configure();
+            lanes.configure();
+            floodFilter->configure();
+            syncPlugins();
+        }
+        for (int lane = 0; lane < LANE_COUNT; ++lane) {
+            laneDepth[lane]->set(lanes.size(static_cast<Lane>(lane)));
+        }
+
+        // delivers the batches collected from the last round of updates
+        auto wait = std::min(gc.nextWait(), flushBatches(*getPlugins(), lanes));
+        if (!lanes.empty()) {
+            wait = std::chrono::milliseconds(0); // only check for new updates
+        }
+        if (!waitForUpdate(wait)) {
+            if (lanes.empty()) {
+                gc.idle(*getPlugins());
+            } else {
+                runLanes(lanes);
+                gc.busy(*getPlugins());
+            }
+            continue;
+        }
+
+        // may swap in reloaded plugins, so get the plugin set after this
+        runIOCompletions();
+        auto plugins = getPlugins();
+        router.update(plugins);
+
+        std::queue<json> updates = popAllUpdates();
+        gc.updatesHandled(updates.size());
+        while (!updates.empty()) {
+            std::shared_ptr<const json> update(new json(std::move(updates.front())));
+            updates.pop();
+            // dropping the hold releases the webhook connection, so take it
+            // before anything can skip the update
+            std::shared_ptr<void> hold = holdWebhookReply(*update);
+
+            static int lastUpdateID = 0;
+            int update_id = 0;
+            if (update->find("update_id") != update->end()) {
+                update_id = (*update)["update_id"].get<int>();
+                Tracer::global().dequeued(update_id);
+                if (lastUpdateID >= update_id) {
+                    continue; // reject a message we've already seen
                 }
+                lastUpdateID = update_id;
+            }
 
-                std::for_each(plugins.begin(), plugins.end(),
-                [&update](Plugin &p) {
-                    p.run(update);
-                });
+            int64_t chat = 0;
+            getUpdateChat(*update, &chat);
+            Logger::Context logContext(update_id, chat);
+            Tracer::Context traceContext(update_id);
+            Tracer::Span span("dispatch", "dispatch");
+            if (!floodFilter->allow(*update)) {
+                continue;
+            }
+
+            UpdateType type = getUpdateType(*update);
+            for (Plugin *p : router.route(type)) {
+                p->schedule(update, type, lanes, hold);
             }
         }
+
+        runLanes(lanes);
+        gc.busy(*plugins);
+    }
+
+    flushBatches(*getPlugins(), lanes, true);
+    while (lanes.runNext() != LANE_COUNT) {
     }
+    stopWatchingPlugins();
+    stopIOWorkers();
 }
 
 int main(int argc, char **argv) {
@@ -78,20 +263,43 @@ int main(int argc, char **argv) {
     if (!Config::global()) {
         return 1;
     }
+    Logger::setFormat(Logger::parseFormat(
+        Config::global()->get<std::string>("log_format", "text").c_str()));
+    Logger::setRotation(Config::global()->get<long>("log_max_bytes", 64L << 20),
+        std::chrono::seconds(Config::global()->get<long>("log_max_age_hours", 0) * 3600),
+        Config::global()->get<int>("log_keep", 5));
+    Logger::startAsync(Config::global()->get<int>("log_buffer_records", 1024),
+        Logger::parseOverflowPolicy(
+            Config::global()->get<std::string>("log_overflow", "block").c_str()));
 
-    running = true;
-    std::thread pluginsThread(runPlugins);
+    if (!Tracer::global().start()) {
+        return 1;
+    }
 
-    if (!setWebhook(Config::global()->get<std::string>("webhook_url"), 
-               Config::global()->get<std::string>("webhook_self_signed_cert_file", ""))) {
+    floodFilter.reset(new FloodFilter());
+    ConfigSaver::global().start();
+    if (Config::global()->get<bool>("watch_config", true)) {
+        Config::watchGlobalConfig();
+    }
+    if (!Store::global().open(Config::global()->get<std::string>("store_file", "store.db"))) {
         return 1;
     }
 
+    running = true;
+    std::thread pluginsThread(runPlugins);
+
+    // the server answers 503 until the plugins are ready so telegram retries
     if(startServer(Config::global()->get<int>("port", 80),
                    Config::global()->get<std::string>("bind_address", "0.0.0.0").c_str())) {  
         return 1;
     }
 
+    waitForPlugins();
+    if (!setWebhook(Config::global()->get<std::string>("webhook_url"), 
+               Config::global()->get<std::string>("webhook_self_signed_cert_file", ""))) {
+        return 1;
+    }
+
     output = false;
     while(running) {
         repl();
@@ -99,6 +307,10 @@ int main(int argc, char **argv) {
 
     stopServer();
     pluginsThread.join();
+    Config::stopWatchingGlobalConfig();
+    Store::global().close();
+    ConfigSaver::global().stop();
+    Tracer::global().stop();
 
     return 0;
 }
@@ -0,0 +1,204 @@
+/**
+ *  Copyright (C) 2015  Andrew Kallmeyer <fsmv@sapium.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the Lesser GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  Lesser GNU General Public License for more details.
+ *
+ *  You should have received a copy of the Lesser GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "metrics.h"
+#include "logger.h"
+
+#include <cstdio>
+
+static Logger logger("Metrics");
+
+// upper bounds of the histogram buckets in seconds
+static const double BUCKETS[Histogram::NUM_BUCKETS] = {
+    0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025,
+    0.05, 0.1, 0.25, 0.5, 1, 2.5, 10
+};
+
+const size_t Histogram::NUM_BUCKETS;
+
+static std::string formatDouble(double value) {
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%.9g", value);
+    return buffer;
+}
+
+static void writeSample(std::string &out, const std::string &name,
+                        const std::string &labels, const std::string &value) {
+    out += name;
+    if (!labels.empty()) {
+        out += '{';
+        out += labels;
+        out += '}';
+    }
+    out += ' ';
+    out += value;
+    out += '\n';
+}
+
+Counter::Counter() {
+    for (Shard &shard : shards) {
+        shard.value = 0;
+    }
+}
+
+uint64_t Counter::value() const {
+    uint64_t total = 0;
+    for (const Shard &shard : shards) {
+        total += shard.value.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+void Counter::write(std::string &out, const std::string &name,
+                    const std::string &labels) const {
+    writeSample(out, name, labels, std::to_string(value()));
+}
+
+void Gauge::write(std::string &out, const std::string &name,
+                  const std::string &labels) const {
+    writeSample(out, name, labels, std::to_string(value()));
+}
+
+Histogram::Histogram() {
+    for (Shard &shard : shards) {
+        for (auto &bucket : shard.buckets) {
+            bucket = 0;
+        }
+        shard.count = 0;
+        shard.nanoseconds = 0;
+    }
+}
+
+void Histogram::observe(std::chrono::nanoseconds duration) {
+    double seconds = std::chrono::duration<double>(duration).count();
+    size_t bucket = 0;
+    while (bucket < NUM_BUCKETS && seconds > BUCKETS[bucket]) {
+        ++bucket;
+    }
+
+    Shard &shard = shards[metricShard()];
+    shard.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    shard.count.fetch_add(1, std::memory_order_relaxed);
+    shard.nanoseconds.fetch_add(duration.count(), std::memory_order_relaxed);
+}
+
+void Histogram::write(std::string &out, const std::string &name,
+                      const std::string &labels) const {
+    uint64_t buckets[NUM_BUCKETS + 1] = {};
+    uint64_t count = 0, nanoseconds = 0;
+    for (const Shard &shard : shards) {
+        for (size_t i = 0; i <= NUM_BUCKETS; ++i) {
+            buckets[i] += shard.buckets[i].load(std::memory_order_relaxed);
+        }
+        count += shard.count.load(std::memory_order_relaxed);
+        nanoseconds += shard.nanoseconds.load(std::memory_order_relaxed);
+    }
+
+    std::string prefix = labels.empty() ? "" : labels + ",";
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i <= NUM_BUCKETS; ++i) {
+        cumulative += buckets[i];
+        std::string le = i < NUM_BUCKETS ? formatDouble(BUCKETS[i]) : "+Inf";
+        writeSample(out, name + "_bucket", prefix + "le=\"" + le + "\"",
+                    std::to_string(cumulative));
+    }
+    writeSample(out, name + "_sum", labels, formatDouble(nanoseconds / 1e9));
+    writeSample(out, name + "_count", labels, std::to_string(count));
+}
+
+Metrics &Metrics::global() {
+    // never freed, threads may still count while static objects are destroyed
+    static Metrics *metrics = new Metrics();
+    return *metrics;
+}
+
+template<typename T>
+T &Metrics::get(const std::string &name, const char *type, const std::string &help,
+                const std::string &labels) {
+    std::lock_guard<std::mutex> l(mutex);
+    Family &family = families[name];
+    if (family.type.empty()) {
+        family.type = type;
+        family.help = help;
+    } else if (family.type != type) {
+        LOG_ERROR(logger, "Metric {} is a {}, not a {}", name, family.type, type);
+    }
+
+    std::unique_ptr<Metric> &metric = family.metrics[labels];
+    if (!metric) {
+        metric.reset(new T());
+    }
+    return static_cast<T &>(*metric);
+}
+
+Counter &Metrics::counter(const std::string &name, const std::string &help,
+                          const std::string &labels) {
+    return get<Counter>(name, "counter", help, labels);
+}
+
+Gauge &Metrics::gauge(const std::string &name, const std::string &help,
+                      const std::string &labels) {
+    return get<Gauge>(name, "gauge", help, labels);
+}
+
+Histogram &Metrics::histogram(const std::string &name, const std::string &help,
+                              const std::string &labels) {
+    return get<Histogram>(name, "histogram", help, labels);
+}
+
+void Metrics::addCollector(std::function<void()> collector) {
+    std::lock_guard<std::mutex> l(mutex);
+    collectors.push_back(std::move(collector));
+}
+
+std::string Metrics::render() {
+    std::vector<std::function<void()>> toRun;
+    {
+        std::lock_guard<std::mutex> l(mutex);
+        toRun = collectors;
+    }
+    // the collectors create gauges, so they can't run under the lock
+    for (auto &collector : toRun) {
+        collector();
+    }
+
+    std::string out;
+    std::lock_guard<std::mutex> l(mutex);
+    for (auto &family : families) {
+        out += "# HELP " + family.first + " " + family.second.help + "\n";
+        out += "# TYPE " + family.first + " " + family.second.type + "\n";
+        for (auto &metric : family.second.metrics) {
+            metric.second->write(out, family.first, metric.first);
+        }
+    }
+    return out;
+}
+
+std::string Metrics::label(const std::string &key, const std::string &value) {
+    std::string out = key + "=\"";
+    for (char c : value) {
+        if (c == '\\' || c == '"') {
+            out += '\\';
+            out += c;
+        } else if (c == '\n') {
+            out += "\\n";
+        } else {
+            out += c;
+        }
+    }
+    return out + "\"";
+}
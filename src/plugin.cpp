@@ -22,29 +22,42 @@
 #include <map>
 #include <string>
 #include <regex>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <dlfcn.h>
 #include "config.h"
 #include "logger.h"
 #include "telegram.h"
 #include "luaapi.h"
+#include "asyncio.h"
+#include "filewatcher.h"
+#include "nativeplugin.h"
+#include "http.h"
+#include "tracing.h"
+#include "webhooks.h"
 
-extern "C" {
-    #include "lua.h"
-    #include "lualib.h"
-    #include "lauxlib.h"
-}
+#include "luacompat.h"
 
 static Logger logger("Plugins");
 static const std::string pluginsDir = "plugins/";
+static const std::string cacheDir = pluginsDir + ".cache/";
 
 static bool getfield(lua_State *L, const char *key, const char **value) {
     lua_getfield(L, -1, key);
     if (lua_isnil(L, -1)) {
-        logger.debug("Missing key " + std::string(key));
+        LOG_DEBUG(logger, "Missing key {}", key);
         lua_pop(L, 1);
         return false;
     }
     if (!lua_isstring(L, -1)) {
-        logger.debug("Invalid type for key " + std::string(key) + " expected string");
+        LOG_DEBUG(logger, "Invalid type for key {} expected string", key);
         lua_pop(L, 1);
         return false;
     }
@@ -57,12 +70,12 @@ static bool getfield(lua_State *L, const char *key, const char **value) {
 static bool getfield(lua_State *L, const char *key, bool *value) {
     lua_getfield(L, -1, key);
     if (lua_isnil(L, -1)) {
-        logger.debug("Missing key " + std::string(key));
+        LOG_DEBUG(logger, "Missing key {}", key);
         lua_pop(L, 1);
         return false;
     }
     if (!lua_isboolean(L, -1)) {
-        logger.debug("Invalid type for key " + std::string(key) + " expected boolean");
+        LOG_DEBUG(logger, "Invalid type for key {} expected boolean", key);
         lua_pop(L, 1);
         return false;
     }
@@ -71,19 +84,37 @@ static bool getfield(lua_State *L, const char *key, bool *value) {
     return true;
 }
 
+static bool getfield(lua_State *L, const char *key, double *value) {
+    lua_getfield(L, -1, key);
+    if (lua_isnil(L, -1)) {
+        LOG_DEBUG(logger, "Missing key {}", key);
+        lua_pop(L, 1);
+        return false;
+    }
+    if (lua_type(L, -1) != LUA_TNUMBER) {
+        LOG_DEBUG(logger, "Invalid type for key {} expected number", key);
+        lua_pop(L, 1);
+        return false;
+    }
+    *value = lua_tonumber(L, -1);
+    lua_pop(L, 1);
+    return true;
+}
+
 static bool getfield_array(lua_State *L, const char *key, std::vector<std::string> *arr) {
     lua_getfield(L, -1, key);
     if (!lua_istable(L, -1)) {
-        logger.debug("Invalid type for key " + std::string(key) + " expected array");
+        LOG_DEBUG(logger, "Invalid type for key {} expected array", key);
+        lua_pop(L, 1);
         return false;
     }
 
     size_t n = lua_rawlen(L, -1);
-    for (int i = 1; i <= n; ++i) {
+    for (size_t i = 1; i <= n; ++i) {
         lua_rawgeti(L, -1, i);
         if (!lua_isstring(L, -1)) {
-            logger.debug("Invalid type in string array index=" + std::to_string(i));
-            lua_pop(L, 1);
+            LOG_DEBUG(logger, "Invalid type in string array index={}", i);
+            lua_pop(L, 2);
             return false;
         }
         const char *v;
@@ -96,19 +127,75 @@ static bool getfield_array(lua_State *L, const char *key, std::vector<std::strin
     return true;
 }
 
+/**
+ * Reads the cacheable table of getInfo into {command: {ttl, scope}}
+ *
+ * A command maps to either its ttl in seconds or a table with ttl and scope.
+ */
+static bool getcacheable(lua_State *L, json *cacheable) {
+    lua_getfield(L, -1, "cacheable");
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        return true;
+    }
+    if (!lua_istable(L, -1)) {
+        LOG_ERROR(logger, "cacheable must be a table");
+        lua_pop(L, 1);
+        return false;
+    }
+
+    lua_pushnil(L);
+    while (lua_next(L, -2) != 0) {
+        if (lua_type(L, -2) != LUA_TSTRING) {
+            LOG_ERROR(logger, "cacheable must map command names to ttls");
+            lua_pop(L, 3);
+            return false;
+        }
+        std::string command = lua_tostring(L, -2);
+
+        json rule;
+        rule["scope"] = "global";
+        if (lua_type(L, -1) == LUA_TNUMBER) {
+            rule["ttl"] = static_cast<int>(lua_tonumber(L, -1));
+        } else if (lua_istable(L, -1)) {
+            double ttl;
+            if (!getfield(L, "ttl", &ttl)) {
+                LOG_ERROR(logger, "Did not define ttl for cacheable command: {}", command);
+                lua_pop(L, 3);
+                return false;
+            }
+            rule["ttl"] = static_cast<int>(ttl);
+
+            const char *scope;
+            if (getfield(L, "scope", &scope)) {
+                rule["scope"] = std::string(scope);
+            }
+        } else {
+            LOG_ERROR(logger, "Invalid cache rule for command: {}", command);
+            lua_pop(L, 3);
+            return false;
+        }
+        (*cacheable)[command] = rule;
+        lua_pop(L, 1);
+    }
+
+    lua_pop(L, 1);
+    return true;
+}
+
 static bool getusages(lua_State *L, const std::vector<std::string> &commands,
                std::map<std::string, std::string> *commandUsages) {
     // We can hardcode since this method is specific to usages
     lua_getfield(L, -1, "usage");
     if (!lua_istable(L, -1)) {
-        logger.error("Usage list must be an array");
+        LOG_ERROR(logger, "Usage list must be an array");
         return false;
     }
 
     for (std::string command : commands) {
         const char *usage;
         if(!getfield(L, command.c_str(), &usage)) {
-            logger.error("Did not define usage for command: " + command);
+            LOG_ERROR(logger, "Did not define usage for command: {}", command);
             lua_pop(L, 1);
             return false;
         }
@@ -122,7 +209,7 @@ static bool getusages(lua_State *L, const std::vector<std::string> &commands,
 static bool checkVersion(std::string v) {
     static const std::regex versionCheck("\\d+\\.\\d+\\.\\d+");
     if (!std::regex_match(v, versionCheck)) {
-        logger.debug("Version string did not match the correct format");
+        LOG_DEBUG(logger, "Version string did not match the correct format");
         return false;
     }
 
@@ -145,26 +232,14 @@ static bool checkVersion(std::string v) {
     return true;
 }
 
-Plugin::Plugin(const std::string &name) : config(nullptr), luaState(luaL_newstate(), lua_close), name(name) {
-    config.reset(Config::loadConfig(pluginsDir + name + ".json"));
-    if (!config) {
-        throw std::invalid_argument("malformed config file");
-    }
-
-    lua_State *L = luaState.get();
-    if (L == nullptr) {
-        throw std::invalid_argument("Could not create lua state");
-    }
-
-    luaL_openlibs(L); // load the standard lua libraries
-
-    if (luaL_loadfile(L, (pluginsDir + name + ".lua").c_str())) { //load file
-        throw std::invalid_argument(lua_tostring(L, -1));
-    } 
-
-    if (lua_pcall(L, 0, 0, 0)) { // evaluate the globals in the file
-        throw std::invalid_argument(lua_tostring(L, -1));
-    }
+/**
+ * Calls getInfo and validates the table it returns
+ *
+ * @return the plugin info as json
+ * @throws invalid_argument if getInfo is missing or returns invalid data
+ */
+static json readInfo(lua_State *L) {
+    json info;
 
     lua_getglobal(L, "getInfo"); //find getInfo
     if (!lua_isfunction(L, -1)) {
@@ -189,6 +264,7 @@ Plugin::Plugin(const std::string &name) : config(nullptr), luaState(luaL_newstat
             throw std::invalid_argument("Plugin version "
                 + std::string(v) + " not compatible with bot version: " + Config::PB_VERSION);
         }
+        info["version"] = std::string(v);
     }
 
     { // get plugin description
@@ -196,84 +272,1031 @@ Plugin::Plugin(const std::string &name) : config(nullptr), luaState(luaL_newstat
         if (!getfield(L, "description", &v)) {
             throw std::invalid_argument("Did not define description");
         }
-        description = std::string(v);
+        info["description"] = std::string(v);
     }
 
     { // load the commandOnly field
-        if (!getfield(L, "commandOnly", &this->commandOnly)) {
-            commandOnly = false;
-        }
+        bool v = false;
+        getfield(L, "commandOnly", &v);
+        info["commandOnly"] = v;
     }
 
     { // load the alwaysTrigger field
-        if (!getfield(L, "alwaysTrigger", &this->alwaysTrigger)) {
-            alwaysTrigger = false;
-        }
+        bool v = false;
+        getfield(L, "alwaysTrigger", &v);
+        info["alwaysTrigger"] = v;
+    }
+
+    { // load the async field
+        bool v = false;
+        getfield(L, "async", &v);
+        info["async"] = v;
+    }
+
+    { // load the update types an alwaysTrigger plugin wants
+        std::vector<std::string> updateTypes;
+        getfield_array(L, "updates", &updateTypes);
+        info["updates"] = updateTypes;
     }
 
     { // load the regular expressions
         std::vector<std::string> matchStrings;
-        if (getfield_array(L, "matches", &matchStrings)) {
-            for (auto match : matchStrings) { // compile the regexes
-                try {
-                    auto reg = std::regex(match);
-                    matches[match] = reg;
-                } catch (std::regex_error &e) {
-                    logger.error(e.what());
-                    throw std::invalid_argument("Failed to load regex " + match + " for plugin " + name);
-                }
-            }
-        }
+        getfield_array(L, "matches", &matchStrings);
+        info["matches"] = matchStrings;
     }
 
     { // load commands and usages
         std::vector<std::string> commandStrings;
+        std::map<std::string, std::string> usages;
         if (getfield_array(L, "commands", &commandStrings)) {
-            if (!getusages(L, commandStrings, &commands)) {
+            if (!getusages(L, commandStrings, &usages)) {
                 throw std::invalid_argument("Failed to read usage strings");
             }
         }
+        json commands;
+        for (const auto &usage : usages) {
+            commands[usage.first] = usage.second;
+        }
+        info["commands"] = commands;
     }
 
-    // check if plugin has a way to be triggered
-    if ((commandOnly && commands.size() == 0) ||
-        (commands.size() == 0 && matches.size() == 0)) {
-        throw std::invalid_argument("Plugin will never be run");
+    { // load the commands whose replies may be cached
+        json cacheable = json::object();
+        if (!getcacheable(L, &cacheable)) {
+            throw std::invalid_argument("Failed to read cacheable commands");
+        }
+        info["cacheable"] = cacheable;
+    }
+
+    lua_pop(L, 1); // pop the info table
+    return info;
+}
+
+static int writeBytecode(lua_State *, const void *p, size_t sz, void *ud) {
+    static_cast<std::string *>(ud)->append(static_cast<const char *>(p), sz);
+    return 0;
+}
+
+static bool readFile(const std::string &filename, std::string *contents) {
+    std::ifstream f(filename, std::ios::binary);
+    if (!f.good()) {
+        return false;
+    }
+
+    std::stringstream ss;
+    ss << f.rdbuf();
+    *contents = ss.str();
+    return true;
+}
+
+// 64 bit FNV-1a, stable across builds unlike std::hash
+static uint64_t hashContents(const std::string &contents) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (unsigned char c : contents) {
+        hash = (hash ^ c) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/**
+ * Builds the metadata a cache entry for the given source must match
+ *
+ * The source is hashed rather than trusting its mtime, a hot reload can
+ * follow an edit within the timestamp granularity of the filesystem.
+ */
+static bool cacheKey(const std::string &source, json *key) {
+    std::string contents;
+    if (!readFile(source, &contents)) {
+        return false;
     }
 
+    // as a string, json numbers are signed
+    (*key)["hash"] = std::to_string(hashContents(contents));
+    (*key)["size"] = static_cast<int64_t>(contents.size());
+    (*key)["bot_version"] = Config::PB_VERSION;
+    // bump when readInfo learns a new field so old entries are rebuilt
+    (*key)["info_format"] = 2;
+    // lua and luajit bytecode are not compatible
+    (*key)["lua_version"] = PB_LUA_RELEASE;
+    return true;
+}
+
+/**
+ * Reads the compiled chunk and getInfo result of a plugin from the cache
+ *
+ * @return false if there is no entry or it is out of date
+ */
+static bool readCache(const std::string &name, const std::string &source,
+                      std::string *bytecode, json *info) {
+    json key;
+    std::string metaStr;
+    if (!cacheKey(source, &key) || !readFile(cacheDir + name + ".json", &metaStr)) {
+        return false;
+    }
+
+    try {
+        json meta = json::parse(metaStr);
+        for (auto field = key.begin(); field != key.end(); ++field) {
+            auto cachedField = meta.find(field.key());
+            if (cachedField == meta.end() || *cachedField != field.value()) {
+                LOG_DEBUG(logger, "Bytecode cache for {} is out of date", name);
+                return false;
+            }
+        }
+        *info = meta["info"];
+    } catch (std::exception &e) {
+        LOG_WARN(logger, "Corrupt bytecode cache for {}: {}", name, e.what());
+        return false;
+    }
+
+    return readFile(cacheDir + name + ".luac", bytecode);
+}
+
+static bool writeFileAtomic(const std::string &filename, const std::string &contents) {
+    std::string tmp = filename + ".tmp";
+    {
+        std::ofstream f(tmp, std::ios::binary | std::ios::trunc);
+        if (!f.good()) {
+            return false;
+        }
+        f.write(contents.data(), contents.size());
+        if (!f.good()) {
+            return false;
+        }
+    }
+    return std::rename(tmp.c_str(), filename.c_str()) == 0;
+}
+
+static void writeCache(const std::string &name, const std::string &source,
+                       const std::string &bytecode, const json &info) {
+    json meta;
+    if (!cacheKey(source, &meta)) {
+        return;
+    }
+    meta["info"] = info;
+
+    mkdir(cacheDir.c_str(), 0755); // fails harmlessly if it exists
+    // write the bytecode first, the entry is only valid once the metadata is
+    if (!writeFileAtomic(cacheDir + name + ".luac", bytecode) ||
+        !writeFileAtomic(cacheDir + name + ".json", meta.dump())) {
+        LOG_WARN(logger, "Could not write bytecode cache for {}", name);
+    }
+}
+
+/**
+ * Applies the defaults to and validates the info returned by a native plugin
+ *
+ * @throws invalid_argument if the info is invalid
+ */
+static json validateNativeInfo(const json &nativeInfo) {
+    json info = nativeInfo;
+    auto isType = [&info](const char *key, json::value_t type) {
+        auto field = info.find(key);
+        return field != info.end() && field->type() == type;
+    };
+
+    if (!isType("version", json::value_t::string)) {
+        throw std::invalid_argument("Did not define version");
+    }
+    std::string version = info["version"].get<std::string>();
+    if (!checkVersion(version)) {
+        throw std::invalid_argument("Plugin version " + version
+            + " not compatible with bot version: " + Config::PB_VERSION);
+    }
+
+    if (!isType("description", json::value_t::string)) {
+        throw std::invalid_argument("Did not define description");
+    }
+
+    for (const char *key : { "commandOnly", "alwaysTrigger" }) {
+        if (!isType(key, json::value_t::boolean)) {
+            info[key] = false;
+        }
+    }
+    info["async"] = false; // native plugins never yield
+
+    if (!isType("matches", json::value_t::array)) {
+        info["matches"] = std::vector<std::string>();
+    }
+    for (const auto &match : info["matches"]) {
+        if (match.type() != json::value_t::string) {
+            throw std::invalid_argument("Invalid type in matches, expected string");
+        }
+    }
+
+    if (!isType("updates", json::value_t::array)) {
+        info["updates"] = std::vector<std::string>();
+    }
+    for (const auto &type : info["updates"]) {
+        if (type.type() != json::value_t::string) {
+            throw std::invalid_argument("Invalid type in updates, expected string");
+        }
+    }
+
+    if (!isType("commands", json::value_t::object)) {
+        info["commands"] = json();
+    }
+    const json &commands = info["commands"];
+    for (auto command = commands.begin(); command != commands.end(); ++command) {
+        if (command.value().type() != json::value_t::string) {
+            throw std::invalid_argument("Did not define usage for command: " + command.key());
+        }
+    }
+
+    return info;
+}
+
+// A loaded shared object with its plugin instance
+struct NativeLibrary {
+    void *handle;
+    NativePlugin *plugin;
+    void (*destroy)(NativePlugin *);
+
+    /**
+     * @throws invalid_argument if the library can't be loaded
+     */
+    NativeLibrary(const std::string &name, const std::string &path)
+        : handle(nullptr), plugin(nullptr), destroy(nullptr) {
+
+        // dlopen hands back the already loaded library for a path it has
+        // seen, so load a copy to make reloading work
+        static std::atomic<unsigned int> loads(0);
+        std::string copy = cacheDir + name + "." + std::to_string(getpid())
+                         + "." + std::to_string(loads++) + ".so";
+        std::string contents;
+        mkdir(cacheDir.c_str(), 0755);
+        if (!readFile(path, &contents) || !writeFileAtomic(copy, contents)) {
+            throw std::invalid_argument("Could not copy " + path);
+        }
+
+        handle = dlopen(copy.c_str(), RTLD_NOW | RTLD_LOCAL);
+        unlink(copy.c_str()); // stays mapped
+        if (!handle) {
+            throw std::invalid_argument("Could not load library: " + std::string(dlerror()));
+        }
+
+        auto abiVersion = reinterpret_cast<int (*)()>(dlsym(handle, "pb_plugin_abi_version"));
+        auto create = reinterpret_cast<NativePlugin *(*)()>(dlsym(handle, "pb_create_plugin"));
+        destroy = reinterpret_cast<void (*)(NativePlugin *)>(dlsym(handle, "pb_destroy_plugin"));
+        if (!abiVersion || !create || !destroy) {
+            dlclose(handle);
+            throw std::invalid_argument("Library is missing the plugin entry points");
+        }
+        if (abiVersion() != PB_NATIVE_ABI_VERSION) {
+            dlclose(handle);
+            throw std::invalid_argument("Plugin was built for native abi version "
+                + std::to_string(abiVersion()) + " but the bot is version "
+                + std::to_string(PB_NATIVE_ABI_VERSION));
+        }
+
+        plugin = create();
+        if (!plugin) {
+            dlclose(handle);
+            throw std::invalid_argument("pb_create_plugin returned NULL");
+        }
+    }
+
+    ~NativeLibrary() {
+        destroy(plugin);
+        dlclose(handle);
+    }
+};
+
+/**
+ * Sends messages to a chat in order from a single io job
+ */
+static void sendInOrder(const std::vector<CachedMessage> &messages, int64_t chat_id,
+                        int message_id, const std::shared_ptr<void> &hold) {
+    submitIO([messages, chat_id, message_id, hold]() {
+        for (const auto &m : messages) {
+            tg_sendMessage(m.text, chat_id, m.reply ? message_id : -1,
+                           m.markdown, m.disablePreview);
+        }
+    }, []() {});
+}
+
+// The api given to native plugins for one run
+class NativeContext : public PluginContext {
+public:
+    NativeContext(Plugin *plugin, const json &update, const std::shared_ptr<void> &hold)
+        : plugin(plugin), currentUpdate(update), hold(hold) {}
+
+    const json &update() const override {
+        return currentUpdate;
+    }
+
+    bool send(const std::string &message, bool markdown,
+              bool disablePreview) override {
+        return queueMessage(message, false, markdown, disablePreview);
+    }
+
+    bool reply(const std::string &message, bool markdown,
+               bool disablePreview) override {
+        return queueMessage(message, true, markdown, disablePreview);
+    }
+
+    Config &config() override {
+        return *plugin->config;
+    }
+
+    void downloadFile(DownloadCallback done) override {
+        std::string file_id = "";
+        const json *msg = getUpdateMessage(currentUpdate);
+        std::string type = msg ? getMessageFile(*msg, &file_id) : "UNKNOWN";
+        std::string filename = plugin->getPath() + file_id;
+        std::shared_ptr<bool> success(new bool(false));
+        later([file_id, filename, success]() {
+            if (file_id != "") {
+                *success = tg_downloadFile(file_id, filename);
+            }
+        }, [done, filename, type, success](PluginContext &context) {
+            done(context, *success, filename, type);
+        });
+    }
+
+    void fetch(const HttpRequest &request, FetchCallback done) override {
+        std::shared_ptr<HttpResponse> response(new HttpResponse);
+        later([request, response]() {
+            *response = httpFetch(request);
+        }, [done, response](PluginContext &context) {
+            done(context, *response);
+        });
+    }
+
+    /**
+     * Sends the messages queued by the plugin, in the order it sent them
+     */
+    void flush() {
+        if (messages.empty()) {
+            return;
+        }
+        int64_t chat_id = 0;
+        int message_id = -1;
+        getUpdateChat(currentUpdate, &chat_id);
+        getUpdateMessageId(currentUpdate, &message_id);
+
+        // only the runs holding the update's connection may answer in it
+        auto updateId = currentUpdate.find("update_id");
+        WebhookReplyScope replyScope(hold && updateId != currentUpdate.end()
+                                     && updateId->is_number()
+                                     ? updateId->get<int64_t>() : 0);
+        sendInOrder(messages, chat_id, message_id, hold);
+    }
+
+    const std::vector<CachedMessage> &sent() const { return messages; }
+
+private:
+    bool queueMessage(const std::string &message, bool reply, bool markdown,
+                      bool disablePreview) {
+        int64_t chat_id;
+        int message_id;
+        if (!getUpdateChat(currentUpdate, &chat_id) ||
+            (reply && !getUpdateMessageId(currentUpdate, &message_id))) {
+            return false;
+        }
+        messages.push_back(CachedMessage{message, reply, markdown, disablePreview});
+        return true;
+    }
+
+    /**
+     * Runs work on an io worker, then callback on the dispatcher thread with
+     * a context for the same update
+     */
+    void later(std::function<void()> work,
+               std::function<void(PluginContext &)> callback) {
+        std::shared_ptr<Plugin> self = plugin->shared_from_this();
+        json update = currentUpdate;
+        std::shared_ptr<void> held = hold;
+        submitIO(work, [self, update, held, callback]() {
+            NativeContext context(self.get(), update, held);
+            try {
+                callback(context);
+            } catch (std::exception &e) {
+                LOG_ERROR(logger, "Error in io callback of plugin {}", self->getName());
+                LOG_ERROR(logger, "{}", e.what());
+            }
+            context.flush();
+        });
+    }
+
+    Plugin *plugin;
+    const json &currentUpdate;
+    std::shared_ptr<void> hold;
+    // sent once the run returns, so they go out in order
+    std::vector<CachedMessage> messages;
+};
+
+static int atPanic(lua_State *L) {
+    LOG_ERROR(logger, "Unprotected error in lua: {}", lua_tostring(L, -1));
+    return 0; // lua calls abort
+}
+
+Plugin::Plugin(const std::string &name)
+    : config(nullptr), allocator(new LuaAllocator()),
+      luaState(nullptr, lua_close), gcStats(new GCStats()), manualGC(false), maxDebt(0), name(name),
+      subscriptions(0), alwaysTypes(0), fixedLane(false), lane(LANE_INTERACTIVE),
+      deadline(0), shed(0), shedReplies(0), replyCacheMax(0), cacheHits(0),
+      batched(false), batchMax(0), batchLatency(0),
+      runTime(Metrics::global().histogram("pb_plugin_run_seconds",
+          "Time from the start to the end of a run, including io waits",
+          Metrics::label("plugin", name))),
+      matchTime(Metrics::global().histogram("pb_plugin_match_seconds",
+          "Time to match an update against the commands and regexes",
+          Metrics::label("plugin", name))),
+      runErrors(Metrics::global().counter("pb_plugin_errors_total",
+          "Runs that raised an error", Metrics::label("plugin", name))) {
+
+    config.reset(Config::loadConfig(pluginsDir + name + ".json"));
+    if (!config) {
+        throw std::invalid_argument("malformed config file");
+    }
+
+    std::string library = pluginsDir + name + ".so";
+    if (access(library.c_str(), F_OK) == 0) {
+        loadNative(library);
+    } else {
+        loadLua();
+    }
+
+    loadDeadlines();
+
+    std::string priority = option<std::string>("priority", "auto");
+    fixedLane = LaneScheduler::parseLane(priority, &lane);
+    if (!fixedLane && priority != "auto") {
+        LOG_WARN(logger, "Unknown priority {} for plugin {}", priority, name);
+    }
+
+    LOG_INFO(logger, "Loaded plugin {}", name);
+}
+
+Plugin::~Plugin() {
+}
+
+void Plugin::loadNative(const std::string &library) {
+    native.reset(new NativeLibrary(name, library));
+
+    json info;
+    try {
+        info = native->plugin->getInfo();
+    } catch (std::exception &e) {
+        throw std::invalid_argument("getInfo threw: " + std::string(e.what()));
+    }
+
+    loadInfo(validateNativeInfo(info));
+}
+
+void Plugin::loadLua() {
+    luaState.reset(lua_newstate(LuaAllocator::alloc, allocator.get()));
+    bool ownAllocator = true;
+#ifdef PB_LUAJIT
+    if (!luaState) {
+        ownAllocator = false;
+        // 64 bit luajit without GC64 has to allocate in the low 2GB itself
+        LOG_WARN(logger, "LuaJIT can't use the plugin allocator, memory_limit "
+                         "is not enforced for {}", name);
+        luaState.reset(luaL_newstate());
+    }
+#endif
+    lua_State *L = luaState.get();
+    if (L == nullptr) {
+        throw std::invalid_argument("Could not create lua state");
+    }
+    lua_atpanic(L, atPanic);
+
+    // set the limit after creating the state so it can't fail to start
+    allocator->setLimit(option<size_t>("memory_limit", 0));
+
+    // the scheduler can only see the memory of states using our allocator,
+    // the others keep lua's collector
+    manualGC = ownAllocator && !option<bool>("gc_auto", false);
+    if (manualGC) {
+        lua_gc(L, LUA_GCSTOP, 0);
+        maxDebt = option<size_t>("gc_max_debt", 8 << 20);
+    } else {
+        lua_gc(L, LUA_GCSETPAUSE, option<int>("gc_pause", 200));
+        lua_gc(L, LUA_GCSETSTEPMUL, option<int>("gc_stepmul", 200));
+    }
+
+    luaL_openlibs(L); // load the standard lua libraries
+
+    std::string source = pluginsDir + name + ".lua";
+    std::string bytecode;
+    json info;
+    bool cached = Config::global()->get<bool>("bytecode_cache", true)
+               && readCache(name, source, &bytecode, &info);
+
+    if (cached) {
+        if (luaL_loadbufferx(L, bytecode.data(), bytecode.size(),
+                             ("@" + source).c_str(), "b")) {
+            LOG_WARN(logger, "Bad bytecode cache for {}: {}", name, lua_tostring(L, -1));
+            lua_pop(L, 1);
+            cached = false;
+        }
+    }
+
+    if (!cached) {
+        if (luaL_loadfile(L, source.c_str())) { //load file
+            throw std::invalid_argument(lua_tostring(L, -1));
+        }
+        bytecode.clear();
+        lua_dump(L, writeBytecode, &bytecode);
+    }
+
+    if (lua_pcall(L, 0, 0, 0)) { // evaluate the globals in the file
+        throw std::invalid_argument(lua_tostring(L, -1));
+    }
+
+    if (!cached) {
+        info = readInfo(L);
+        if (Config::global()->get<bool>("bytecode_cache", true)) {
+            writeCache(name, source, bytecode, info);
+        }
+    }
+
+    loadInfo(info);
+
     injectAPIFunctions(L);
 
+    // the api functions find the plugin through the registry
+    lua_pushlightuserdata(L, this);
+    lua_setfield(L, LUA_REGISTRYINDEX, "PB_PLUGIN");
+
     lua_getglobal(L, "run"); // find the run function
     if (!lua_isfunction(L, -1)) {
         throw std::invalid_argument("Run function not defined");
     }
+    lua_pop(L, 1);
 
-    logger.info("Loaded plugin " + name);
+    // plugins that see every update may take them in batches instead
+    lua_getglobal(L, "runBatch");
+    batched = alwaysTrigger && lua_isfunction(L, -1);
+    lua_pop(L, 1);
+    if (batched) {
+        batchMax = std::max(1, option<int>("batch_max", 100));
+        batchLatency = std::chrono::milliseconds(option<int>("batch_latency_ms", 0));
+        batch.reserve(batchMax);
+    }
 }
 
-static void callRun(lua_State *L, const std::string &message, const std::string &match, PluginRunState *state) {
-    lua_pushlightuserdata(L, state);
-    lua_setglobal(L, "TG_RUN_STATE");
+void Plugin::loadInfo(const json &info) {
+    description = info["description"].get<std::string>();
+    commandOnly = info["commandOnly"].get<bool>();
+    alwaysTrigger = info["alwaysTrigger"].get<bool>();
+    async = info["async"].get<bool>();
 
-    lua_pushstring(L, message.c_str());
-    lua_pushstring(L, match.c_str());
-    if(lua_pcall(L, 2, 0, 0)) {
-        logger.error("Error in run function of plugin " + state->plugin->getName());
-        logger.error(lua_tostring(L, -1));
-        lua_pop(L, 1);
+    const json &commandInfo = info["commands"];
+    for (auto command = commandInfo.begin(); command != commandInfo.end(); ++command) {
+        commands[command.key()] = command.value().get<std::string>();
     }
-    lua_getglobal(L, "run");
+
+    for (auto match : info["matches"].get<std::vector<std::string>>()) { // compile the regexes
+        try {
+            auto reg = std::regex(match);
+            matches[match] = reg;
+        } catch (std::regex_error &e) {
+            LOG_ERROR(logger, "{}", e.what());
+            throw std::invalid_argument("Failed to load regex " + match + " for plugin " + name);
+        }
+    }
+
+    // without an updates list alwaysTrigger means every update
+    alwaysTypes = 0;
+    auto updateTypes = info.find("updates");
+    if (updateTypes != info.end()) {
+        for (const auto &typeName : *updateTypes) {
+            UpdateType type;
+            if (!parseUpdateType(typeName.get<std::string>(), &type)) {
+                throw std::invalid_argument("Unknown update type "
+                    + typeName.get<std::string>() + " for plugin " + name);
+            }
+            alwaysTypes |= 1u << type;
+        }
+    }
+    if (!alwaysTrigger) {
+        alwaysTypes = 0;
+    } else if (alwaysTypes == 0) {
+        alwaysTypes = (1u << UPDATE_TYPE_COUNT) - 1;
+    }
+
+    subscriptions = alwaysTypes;
+    if (commands.size() != 0 || matches.size() != 0) {
+        subscriptions |= 1u << UPDATE_TEXT;
+    }
+
+    auto cacheable = info.find("cacheable");
+    if (cacheable != info.end()) {
+        for (auto rule = cacheable->begin(); rule != cacheable->end(); ++rule) {
+            if (commands.find(rule.key()) == commands.end()) {
+                LOG_WARN(logger, "Cacheable command {} of plugin {} is not one of its commands",
+                         rule.key(), name);
+                continue;
+            }
+
+            CacheRule cacheRule;
+            cacheRule.ttl = std::chrono::seconds(rule.value()["ttl"].get<int>());
+            std::string scope = rule.value()["scope"].get<std::string>();
+            if (scope == "global") {
+                cacheRule.scope = CacheRule::GLOBAL;
+            } else if (scope == "chat") {
+                cacheRule.scope = CacheRule::CHAT;
+            } else if (scope == "user") {
+                cacheRule.scope = CacheRule::USER;
+            } else {
+                throw std::invalid_argument("Unknown cache scope " + scope
+                    + " for command " + rule.key());
+            }
+            cacheRules[rule.key()] = cacheRule;
+        }
+    }
+    replyCacheMax = option<int>("reply_cache_entries", 256);
+
+    // the help text never changes, so build it once
+    helpText = description + "\n";
+    for (const auto &command : commands) {
+        helpText += "/" + command.first + " - " + command.second + "\n";
+    }
+
+    // check if plugin has a way to be triggered
+    if ((commandOnly && commands.size() == 0) || subscriptions == 0) {
+        throw std::invalid_argument("Plugin will never be run");
+    }
+}
+
+lua_State *Plugin::newRun(const json &update, const std::string &match,
+                          const std::regex *regex,
+                          const std::shared_ptr<void> &hold) {
+    lua_State *L = luaState.get();
+
+    // every run gets its own coroutine so it can yield on io, the registry
+    // reference keeps it from being collected until the run finishes
+    lua_State *thread = lua_newthread(L);
+    if (!thread) {
+        LOG_ERROR(logger, "Could not create coroutine for plugin {}", name);
+        return nullptr;
+    }
+
+    std::unique_ptr<PluginRunState> state(new PluginRunState);
+    state->plugin = this;
+    state->update = update;
+    state->regex = regex != nullptr;
+    if (regex) {
+        state->match = std::make_pair(match, *regex);
+    }
+    state->hold = hold;
+    state->started = std::chrono::steady_clock::now();
+    state->thread = thread;
+    state->threadRef = luaL_ref(L, LUA_REGISTRYINDEX); // pops the thread
+    runs[thread] = std::move(state);
+
+    return thread;
+}
+
+void Plugin::startRun(const json &update, const std::string &message,
+                      const std::string &match, const std::regex *regex,
+                      const std::shared_ptr<void> &hold) {
+    std::string cacheKey;
+    auto rule = cacheRules.find(match);
+    if (!regex && rule != cacheRules.end()) {
+        cacheKey = replyCacheKey(rule->second, update, match, message);
+        if (serveCached(cacheKey, update, hold)) {
+            return;
+        }
+    }
+
+    if (native) {
+        NativeContext context(this, update, hold);
+        bool ok = true;
+        {
+            ScopedTimer timer(runTime);
+            Tracer::Span span("native", name);
+            try {
+                native->plugin->run(context, message, match);
+            } catch (std::exception &e) {
+                ok = false;
+                runErrors.add();
+                LOG_ERROR(logger, "Error in run function of plugin {}", name);
+                LOG_ERROR(logger, "{}", e.what());
+            }
+        }
+        context.flush();
+        if (ok && !cacheKey.empty() && !context.sent().empty()) {
+            storeReplies(cacheKey, rule->second.ttl, context.sent());
+        }
+        return;
+    }
+
+    lua_State *thread = newRun(update, match, regex, hold);
+    if (!thread) {
+        return;
+    }
+    if (!cacheKey.empty()) {
+        PluginRunState *state = runs[thread].get();
+        state->cacheKey = cacheKey;
+        state->cacheTTL = rule->second.ttl;
+    }
+
+    lua_getglobal(thread, "run");
+    lua_pushstring(thread, message.c_str());
+    lua_pushstring(thread, match.c_str());
+    resume(thread, 2);
+}
+
+void Plugin::flushBatch(LaneScheduler &lanes, bool force) {
+    if (batch.empty()) {
+        return;
+    }
+    if (!force && batch.size() < batchMax &&
+        std::chrono::steady_clock::now() < batchDeadline()) {
+        return;
+    }
+
+    std::shared_ptr<std::vector<json>> updates(new std::vector<json>());
+    updates->swap(batch);
+    batch.reserve(batchMax);
+
+    std::shared_ptr<Plugin> self = shared_from_this();
+    lanes.push(LANE_BACKGROUND, [self, updates]() {
+        self->runBatch(*updates);
+    });
+}
+
+void Plugin::runBatch(std::vector<json> &updates) {
+    // checked when the run comes up, it may have waited in the lane
+    updates.erase(std::remove_if(updates.begin(), updates.end(),
+        [this](const json &update) {
+            if (isStale(update, "ANY")) {
+                shedRun(update, nullptr);
+                return true;
+            }
+            return false;
+        }), updates.end());
+    if (updates.empty()) {
+        return;
+    }
+
+    // the api functions act on the newest update of the batch
+    lua_State *thread = newRun(updates.back(), "ANY", nullptr);
+    if (!thread) {
+        return;
+    }
+
+    lua_getglobal(thread, "runBatch");
+    lua_createtable(thread, updates.size(), 0);
+    for (size_t i = 0; i < updates.size(); ++i) {
+        pushJsonTable(thread, updates[i]);
+        lua_rawseti(thread, -2, i + 1);
+    }
+    resume(thread, 1);
+}
+
+std::chrono::steady_clock::time_point Plugin::batchDeadline() const {
+    if (batch.empty()) {
+        return std::chrono::steady_clock::time_point::max();
+    }
+    return batchStart + batchLatency;
+}
+
+// the run whose coroutine is currently executing on this thread
+static thread_local PluginRunState *runningState = nullptr;
+
+PluginRunState *Plugin::currentRun() {
+    return runningState;
+}
+
+void Plugin::resume(lua_State *thread, int nargs) {
+    PluginRunState *previous = runningState;
+    runningState = getRunState(thread);
+    int status;
+    {
+        const json &update = runningState->update;
+        auto updateIt = update.find("update_id");
+        int64_t updateId = updateIt != update.end() && updateIt->is_number()
+                         ? updateIt->get<int64_t>() : 0;
+        int64_t chat = 0;
+        getUpdateChat(update, &chat);
+        Logger::Context logContext(updateId, chat);
+        // only the runs holding the update's connection may answer in it
+        WebhookReplyScope replyScope(runningState->hold ? updateId : 0);
+        // one span per slice, the gaps between them are io waits
+        Tracer::Context traceContext(updateId);
+        Tracer::Span span("lua", name);
+        collectNearLimit();
+        status = lua_resume(thread, luaState.get(), nargs);
+    }
+    runningState = previous;
+    if (status == LUA_YIELD) {
+        return; // an api function is waiting on io and will resume us
+    }
+
+    if (status == LUA_ERRMEM) {
+        LOG_ERROR(logger, "Plugin {} ran out of memory, limit: {}",
+                  name, allocator->getLimit());
+    } else if (status != LUA_OK) {
+        LOG_ERROR(logger, "Error in run function of plugin {}", name);
+        LOG_ERROR(logger, "{}", lua_tostring(thread, -1));
+    }
+    finishRun(thread, status == LUA_OK);
+}
+
+std::string Plugin::replyCacheKey(const CacheRule &rule, const json &update,
+        const std::string &match, const std::string &message) const {
+    std::string key = match + "\n" + message;
+    if (rule.scope == CacheRule::CHAT) {
+        int64_t chat = 0;
+        getUpdateChat(update, &chat);
+        key = std::to_string(chat) + "\n" + key;
+    } else if (rule.scope == CacheRule::USER) {
+        const json *sender = getUpdateSender(update);
+        auto id = sender ? sender->find("id") : update.end();
+        key = (sender && id != sender->end() ? id->dump() : "0") + "\n" + key;
+    }
+    return key;
+}
+
+bool Plugin::serveCached(const std::string &key, const json &update,
+                         const std::shared_ptr<void> &hold) {
+    auto cached = replyCache.find(key);
+    if (cached == replyCache.end()) {
+        return false;
+    }
+    if (std::chrono::steady_clock::now() >= cached->second.expires) {
+        replyCache.erase(cached);
+        return false;
+    }
+
+    int64_t chat_id;
+    int message_id = -1;
+    if (!getUpdateChat(update, &chat_id)) {
+        return false;
+    }
+    getUpdateMessageId(update, &message_id);
+
+    ++cacheHits;
+    sendInOrder(cached->second.messages, chat_id, message_id, hold);
+    return true;
+}
+
+void Plugin::storeReplies(const std::string &key, std::chrono::seconds ttl,
+                          const std::vector<CachedMessage> &messages) {
+    auto now = std::chrono::steady_clock::now();
+    if (replyCache.size() >= replyCacheMax) {
+        for (auto entry = replyCache.begin(); entry != replyCache.end();) {
+            if (now >= entry->second.expires) {
+                entry = replyCache.erase(entry);
+            } else {
+                ++entry;
+            }
+        }
+        if (replyCache.size() >= replyCacheMax) {
+            return; // everything is still fresh, keep what we have
+        }
+    }
+
+    CachedReply &cached = replyCache[key];
+    cached.messages = messages;
+    cached.expires = now + ttl;
+}
+
+void Plugin::finishRun(lua_State *thread, bool ok) {
+    auto run = runs.find(thread);
+    if (run == runs.end()) {
+        return;
+    }
+
+    runTime.observe(std::chrono::steady_clock::now() - run->second->started);
+    if (!ok) {
+        runErrors.add();
+    }
+
+    // only a run that finished and said something is worth replaying
+    if (ok && !run->second->cacheKey.empty() && !run->second->replies.empty()) {
+        storeReplies(run->second->cacheKey, run->second->cacheTTL, run->second->replies);
+    }
+
+    luaL_unref(luaState.get(), LUA_REGISTRYINDEX, run->second->threadRef);
+    runs.erase(run);
+}
+
+PluginRunState *Plugin::getRunState(lua_State *thread) {
+    auto run = runs.find(thread);
+    if (run == runs.end()) {
+        return nullptr;
+    }
+    return run->second.get();
+}
+
+void Plugin::run(const json &update, UpdateType type) {
+    forEachTrigger(update, type, [&](const std::string &message,
+            const std::string &match, const std::regex *regex, bool) {
+        startRun(update, message, match, regex);
+    });
+
+    if (batched && batch.size() >= batchMax) {
+        std::vector<json> updates;
+        updates.swap(batch);
+        runBatch(updates);
+    }
+}
+
+void Plugin::schedule(const std::shared_ptr<const json> &update,
+                      UpdateType type, LaneScheduler &lanes,
+                      const std::shared_ptr<void> &hold) {
+    std::shared_ptr<Plugin> self = shared_from_this();
+    ScopedTimer timer(matchTime);
+    Tracer::Span span("match", name);
+    int64_t traced = Tracer::current();
+    forEachTrigger(*update, type, [&](const std::string &message,
+            const std::string &match, const std::regex *regex, bool always) {
+        Lane runLane = fixedLane ? lane
+                     : always ? LANE_BACKGROUND : LANE_INTERACTIVE;
+        auto queued = std::chrono::steady_clock::now();
+        lanes.push(runLane, [self, update, message, match, regex, hold, traced, queued]() {
+            auto updateId = update->find("update_id");
+            WebhookReplyScope replyScope(hold && updateId != update->end()
+                                         ? updateId->get<int64_t>() : 0);
+            Tracer::Context traceContext(traced);
+            if (traced) {
+                Tracer::global().record(traced, "lane", "lane " + self->name, queued,
+                                        std::chrono::steady_clock::now());
+            }
+            // checked when the run comes up, it may have waited in the lane
+            if (self->isStale(*update, match)) {
+                self->shedRun(*update, hold);
+                return;
+            }
+            self->startRun(*update, message, match, regex, hold);
+        });
+    });
+
+    // a full batch is queued now rather than on the next loop
+    if (batched && batch.size() >= batchMax) {
+        flushBatch(lanes, true);
+    }
+}
+
+void Plugin::loadDeadlines() {
+    deadline = std::chrono::seconds(option<int>("deadline", 0));
+    staleReply = option<std::string>("stale_reply", "");
+
+    json perCommand;
+    if (findOption("command_deadlines", &perCommand) && perCommand.is_object()) {
+        for (auto command = perCommand.begin(); command != perCommand.end(); ++command) {
+            if (command.value().is_number()) {
+                commandDeadlines[command.key()] =
+                    std::chrono::seconds(command.value().get<int>());
+            }
+        }
+    }
+}
+
+bool Plugin::isStale(const json &update, const std::string &match) const {
+    std::chrono::seconds limit = deadline;
+    auto command = commandDeadlines.find(match);
+    if (command != commandDeadlines.end()) {
+        limit = command->second;
+    }
+    if (limit.count() <= 0) {
+        return false;
+    }
+
+    int64_t date;
+    if (!getUpdateDate(update, &date)) {
+        return false;
+    }
+    auto sent = std::chrono::system_clock::from_time_t(static_cast<time_t>(date));
+    return std::chrono::system_clock::now() - sent > limit;
+}
+
+void Plugin::shedRun(const json &update, const std::shared_ptr<void> &hold) {
+    ++shed;
+    LOG_DEBUG(logger, "Skipped a stale run of plugin {}", name);
+
+    int64_t chat_id;
+    int message_id;
+    if (staleReply.empty() || !getUpdateChat(update, &chat_id) ||
+        !getUpdateMessageId(update, &message_id)) {
+        return;
+    }
+
+    ++shedReplies;
+    std::string text = staleReply;
+    submitIO([text, chat_id, message_id, hold]() {
+        tg_sendMessage(text, chat_id, message_id);
+    }, []() {});
 }
 
-void Plugin::run(const json &update) {
-    PluginRunState currentRun;
-    std::string message = getMessageText(update);
+void Plugin::forEachTrigger(const json &update, UpdateType type,
+                            const TriggerCallback &callback) {
+    std::string message = type == UPDATE_TEXT ? getMessageText(update) : "";
+    bool always = (alwaysTypes & (1u << type)) != 0;
 
-    if (alwaysTrigger) {
-        currentRun.plugin = this;
-        currentRun.update = update;
-        currentRun.regex = false;
-        callRun(luaState.get(), message, "ANY", &currentRun);
+    if (batched && always) {
+        if (batch.empty()) {
+            batchStart = std::chrono::steady_clock::now();
+        }
+        batch.push_back(update); // delivered by flushBatch
+    } else if (always) {
+        callback(message, "ANY", nullptr, true);
     }
 
 
@@ -282,51 +1305,361 @@ void Plugin::run(const json &update) {
     }
 
     // check if we called a command this plugin uses
-    for (auto command : commands) {
+    for (const auto &command : commands) {
         if (message.find("/" + command.first) == 0 &&
                 (message.length() == command.first.length() + 1 ||
                  message[command.first.length() + 1] == ' ')) {
 
-            currentRun.plugin = this;
-            currentRun.update = update;
-            currentRun.regex = false;
-            callRun(luaState.get(), message, command.first, &currentRun);
+            callback(message, command.first, nullptr, false);
         }
     }
 
     // check if we called a regex match this plugin uses
     if (!commandOnly) {
-        for (auto match : matches) {
+        for (const auto &match : matches) {
             if (std::regex_search(message, match.second)) {
-                currentRun.plugin = this;
-                currentRun.update = update;
-                currentRun.regex = true;
-                currentRun.match = match;
-                callRun(luaState.get(), message, match.first, &currentRun);
+                callback(message, match.first, &match.second, false);
             }
         }
     }
 }
 
+bool Plugin::collectGarbage(std::chrono::microseconds budget) {
+    if (!luaState) {
+        return true;
+    }
+
+    using namespace std::chrono;
+    auto start = steady_clock::now();
+    auto end = start + budget;
+
+    bool finished = false;
+    uint64_t steps = 0;
+    auto now = start;
+    while (!finished && now < end) {
+        finished = lua_gc(luaState.get(), LUA_GCSTEP, 0) == 1;
+        ++steps;
+        now = steady_clock::now();
+    }
+
+    if (manualGC) {
+        // luajit restarts its collector after a step
+        lua_gc(luaState.get(), LUA_GCSTOP, 0);
+    }
+
+    gcStats->steps += steps;
+    gcStats->nanoseconds += duration_cast<nanoseconds>(now - start).count();
+    if (finished) {
+        gcStats->lastCycleUsed = allocator->getUsed();
+    }
+    return finished;
+}
+
+void Plugin::fullCollect() {
+    if (!luaState) {
+        return;
+    }
+
+    using namespace std::chrono;
+    auto start = steady_clock::now();
+    lua_gc(luaState.get(), LUA_GCCOLLECT, 0);
+    if (manualGC) {
+        lua_gc(luaState.get(), LUA_GCSTOP, 0);
+    }
+
+    gcStats->fullCollections++;
+    gcStats->nanoseconds += duration_cast<nanoseconds>(steady_clock::now() - start).count();
+    gcStats->lastCycleUsed = allocator->getUsed();
+}
+
+void Plugin::collectNearLimit() {
+    if (!manualGC) {
+        return;
+    }
+
+    size_t used = allocator->getUsed();
+    size_t live = gcStats->lastCycleUsed;
+    if (used <= live) {
+        return; // nothing to gain since the last cycle
+    }
+    if (maxDebt != 0 && used - live > maxDebt) {
+        LOG_DEBUG(logger, "Plugin {} allocated {} bytes since its last collection, collecting",
+                  name, used - live);
+        fullCollect();
+        return;
+    }
+
+    size_t limit = allocator->getLimit();
+    if (limit == 0) {
+        return;
+    }
+    size_t room = live < limit ? limit - live : 0;
+    if (used >= limit || limit - used < room / 2) {
+        LOG_DEBUG(logger, "Plugin {} is near its memory limit, collecting", name);
+        fullCollect();
+    }
+}
+
+bool Plugin::findOption(const std::string &option, json *value) const {
+    std::shared_ptr<const Config> config = Config::global();
+    auto options = config->find("plugin_options");
+    if (options == config->end()) {
+        return false;
+    }
+
+    for (const std::string &section : { name, std::string("default") }) {
+        auto opts = options->find(section);
+        if (opts != options->end()) {
+            auto found = opts->find(option);
+            if (found != opts->end()) {
+                *value = *found;
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
 std::string Plugin::getPath() const {
     return pluginsDir + name + "/";
 }
 
-bool loadPlugins(std::vector<Plugin> *plugins) {
+static std::shared_ptr<const PluginSet> publishedPlugins;
+static std::mutex readyMutex;
+static std::condition_variable readyCV;
+
+std::shared_ptr<const PluginSet> loadPlugins() {
+    std::shared_ptr<PluginSet> plugins(new PluginSet());
     if (!Config::global()->contains("plugins")) {
-        logger.info("No plugins specified in config");
-        return false;
+        LOG_INFO(logger, "No plugins specified in config");
+        return plugins;
     }
 
     std::vector<std::string> pluginsToLoad = Config::global()->get<std::vector<std::string>>("plugins");
-    for (auto plugin : pluginsToLoad) {
+    std::vector<std::shared_ptr<Plugin>> loaded(pluginsToLoad.size());
+
+    // every plugin has its own lua state so they can be loaded in parallel
+    std::atomic<size_t> next(0);
+    auto loadWorker = [&]() {
+        size_t i;
+        while ((i = next++) < pluginsToLoad.size()) {
+            const std::string &plugin = pluginsToLoad[i];
+            try {
+                loaded[i] = std::make_shared<Plugin>(plugin);
+            } catch (std::invalid_argument &e) {
+                LOG_ERROR(logger, "Failed to load plugin {}", plugin);
+                LOG_ERROR(logger, "{}", e.what());
+            }
+        }
+    };
+
+    unsigned int threads = Config::global()->get<int>("load_threads",
+        std::max(1u, std::thread::hardware_concurrency()));
+    threads = std::min<size_t>(threads, pluginsToLoad.size());
+
+    std::vector<std::thread> workers;
+    for (unsigned int i = 1; i < threads; ++i) {
+        workers.emplace_back(loadWorker);
+    }
+    loadWorker(); // this thread helps too
+    for (auto &worker : workers) {
+        worker.join();
+    }
+
+    // keep the order from the config file
+    for (auto &plugin : loaded) {
+        if (plugin) {
+            plugins->push_back(plugin);
+        }
+    }
+
+    return plugins;
+}
+
+void publishPlugins(std::shared_ptr<const PluginSet> plugins) {
+    std::atomic_store(&publishedPlugins, plugins);
+    {
+        std::lock_guard<std::mutex> l(readyMutex);
+    }
+    readyCV.notify_all();
+}
+
+std::shared_ptr<const PluginSet> getPlugins() {
+    return std::atomic_load(&publishedPlugins);
+}
+
+void waitForPlugins() {
+    std::unique_lock<std::mutex> l(readyMutex);
+    readyCV.wait(l, []() { return getPlugins() != nullptr; });
+}
+
+/**
+ * The names in the plugins option of the global config
+ */
+static std::vector<std::string> listedPlugins() {
+    return Config::global()->get<std::vector<std::string>>("plugins",
+                                                            std::vector<std::string>());
+}
+
+static bool isListed(const std::string &name) {
+    std::vector<std::string> listed = listedPlugins();
+    return std::find(listed.begin(), listed.end(), name) != listed.end();
+}
+
+// replaced plugins whose batch still has to be delivered, dispatcher only
+static std::vector<std::shared_ptr<Plugin>> retiredBatches;
+
+std::chrono::milliseconds flushBatches(const PluginSet &plugins, LaneScheduler &lanes,
+                                       bool force) {
+    for (auto &plugin : retiredBatches) {
+        plugin->flushBatch(lanes, true);
+    }
+    retiredBatches.clear();
+
+    auto next = std::chrono::steady_clock::time_point::max();
+    for (auto &plugin : plugins) {
+        if (!plugin->isBatched()) {
+            continue;
+        }
+        plugin->flushBatch(lanes, force);
+        next = std::min(next, plugin->batchDeadline());
+    }
+
+    if (next == std::chrono::steady_clock::time_point::max()) {
+        return std::chrono::milliseconds::max();
+    }
+    auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+        next - std::chrono::steady_clock::now());
+    return std::max(wait, std::chrono::milliseconds(0));
+}
+
+void reloadPlugin(const std::string &name) {
+    // the plugins directory also has disabled plugins and required modules
+    if (!isListed(name)) {
+        LOG_DEBUG(logger, "Not loading {}, it isn't in the plugins option", name);
+        return;
+    }
+    std::shared_ptr<std::shared_ptr<Plugin>> loaded(new std::shared_ptr<Plugin>());
+
+    submitIO([name, loaded]() {
+        LOG_INFO(logger, "Reloading plugin {}", name);
         try {
-            plugins->emplace_back(plugin);
+            *loaded = std::make_shared<Plugin>(name);
         } catch (std::invalid_argument &e) {
-            logger.error("Failed to load plugin " + plugin);
-            logger.error(e.what());
+            LOG_ERROR(logger, "Failed to reload plugin {}, keeping the old one", name);
+            LOG_ERROR(logger, "{}", e.what());
+        }
+    }, [name, loaded]() { // on the dispatcher thread, between updates
+        std::shared_ptr<Plugin> plugin = *loaded;
+        if (!plugin || !isListed(name)) {
+            return; // failed, or removed from the config while loading
+        }
+
+        std::shared_ptr<PluginSet> plugins(new PluginSet(*getPlugins()));
+        auto old = std::find_if(plugins->begin(), plugins->end(),
+            [&name](const std::shared_ptr<Plugin> &p) {
+                return p->getName() == name;
+            });
+
+        if (old != plugins->end()) {
+            if ((*old)->isBatched()) {
+                retiredBatches.push_back(*old);
+            }
+            plugin->config = (*old)->config;
+            *old = plugin;
+        } else {
+            plugins->push_back(plugin);
+        }
+
+        publishPlugins(plugins);
+        LOG_INFO(logger, "Swapped in new instance of plugin {}", name);
+    });
+}
+
+void syncPlugins() {
+    std::shared_ptr<const PluginSet> current = getPlugins();
+    if (!current) {
+        return;
+    }
+
+    std::vector<std::string> listed = listedPlugins();
+    std::shared_ptr<PluginSet> plugins(new PluginSet());
+    for (auto &plugin : *current) {
+        if (std::find(listed.begin(), listed.end(), plugin->getName()) != listed.end()) {
+            plugins->push_back(plugin);
+            continue;
+        }
+        LOG_INFO(logger, "Plugin {} was removed from the config, unloading it",
+                 plugin->getName());
+        if (plugin->isBatched()) {
+            retiredBatches.push_back(plugin);
+        }
+    }
+    if (plugins->size() != current->size()) {
+        publishPlugins(plugins);
+    }
+
+    for (const std::string &name : listed) {
+        auto loaded = std::find_if(current->begin(), current->end(),
+            [&name](const std::shared_ptr<Plugin> &p) {
+                return p->getName() == name;
+            });
+        if (loaded == current->end()) {
+            reloadPlugin(name); // adds it once it's loaded
         }
     }
+}
+
+/**
+ * Reads a plugin's config file again and swaps the contents in between updates
+ *
+ * Our own saves come through here too, they match the config and are ignored.
+ */
+static void reloadPluginConfig(const std::string &name) {
+    std::shared_ptr<std::unique_ptr<Config>> loaded(new std::unique_ptr<Config>());
 
+    submitIO([name, loaded]() {
+        loaded->reset(Config::loadConfig(pluginsDir + name + ".json"));
+    }, [name, loaded]() { // on the dispatcher thread, the only one reading it
+        if (!*loaded) {
+            LOG_ERROR(logger, "Keeping the old config of plugin {}", name);
+            return;
+        }
+
+        for (auto &plugin : *getPlugins()) {
+            if (plugin->getName() == name && plugin->config->reload(**loaded)) {
+                LOG_INFO(logger, "Reloaded config of plugin {}", name);
+            }
+        }
+    });
+}
+
+static std::unique_ptr<FileWatcher> pluginWatcher;
+
+bool watchPlugins() {
+    pluginWatcher.reset(new FileWatcher(pluginsDir, [](const std::string &file) {
+        for (const std::string ext : { ".lua", ".so", ".json" }) {
+            if (file.size() > ext.size() &&
+                file.compare(file.size() - ext.size(), ext.size(), ext) == 0) {
+
+                std::string name = file.substr(0, file.size() - ext.size());
+                if (ext == ".json") {
+                    reloadPluginConfig(name);
+                } else {
+                    reloadPlugin(name);
+                }
+            }
+        }
+    }));
+
+    if (!pluginWatcher->start()) {
+        pluginWatcher.reset(nullptr);
+        return false;
+    }
     return true;
 }
+
+void stopWatchingPlugins() {
+    pluginWatcher.reset(nullptr);
+}
@@ -0,0 +1,45 @@
+/**
+ *  Copyright (C) 2015  Andrew Kallmeyer <fsmv@sapium.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the Lesser GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  Lesser GNU General Public License for more details.
+ *
+ *  You should have received a copy of the Lesser GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "router.h"
+#include "logger.h"
+
+static Logger logger("Router");
+
+void UpdateRouter::update(const std::shared_ptr<const PluginSet> &plugins) {
+    if (plugins == this->plugins) {
+        return;
+    }
+    this->plugins = plugins;
+
+    for (auto &list : index) {
+        list.clear();
+    }
+    if (!plugins) {
+        return;
+    }
+
+    for (int type = 0; type < UPDATE_TYPE_COUNT; ++type) {
+        for (auto &plugin : *plugins) {
+            if (plugin->wantsUpdate(static_cast<UpdateType>(type))) {
+                index[type].push_back(plugin.get());
+            }
+        }
+        LOG_DEBUG(logger, "{} plugins want {}", index[type].size(),
+                  getUpdateTypeName(static_cast<UpdateType>(type)));
+    }
+}
@@ -0,0 +1,357 @@
+/**
+ *  Copyright (C) 2015  Andrew Kallmeyer <fsmv@sapium.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the Lesser GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  Lesser GNU General Public License for more details.
+ *
+ *  You should have received a copy of the Lesser GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "store.h"
+#include "config.h"
+#include "logger.h"
+
+#include <sqlite3.h>
+
+static Logger logger("Store");
+
+sqlite3_stmt *StatementCache::get(const char *sql) {
+    auto statement = statements.find(sql);
+    if (statement != statements.end()) {
+        sqlite3_reset(statement->second);
+        sqlite3_clear_bindings(statement->second);
+        return statement->second;
+    }
+
+    sqlite3_stmt *compiled;
+    if (sqlite3_prepare_v2(db, sql, -1, &compiled, nullptr) != SQLITE_OK) {
+        LOG_ERROR(logger, "Could not prepare {}: {}", sql, sqlite3_errmsg(db));
+        return nullptr;
+    }
+    statements[sql] = compiled;
+    return compiled;
+}
+
+void StatementCache::clear() {
+    for (auto &statement : statements) {
+        sqlite3_finalize(statement.second);
+    }
+    statements.clear();
+}
+
+static const char *CREATE_SQL =
+    "CREATE TABLE IF NOT EXISTS store ("
+    "  ns TEXT NOT NULL,"
+    "  key TEXT NOT NULL,"
+    "  value TEXT NOT NULL,"
+    "  PRIMARY KEY (ns, key)"
+    ") WITHOUT ROWID";
+static const char *SELECT_SQL = "SELECT value FROM store WHERE ns = ? AND key = ?";
+static const char *UPSERT_SQL = "INSERT OR REPLACE INTO store (ns, key, value) VALUES (?, ?, ?)";
+static const char *DELETE_SQL = "DELETE FROM store WHERE ns = ? AND key = ?";
+
+static sqlite3 *openDatabase(const std::string &filename, int flags) {
+    sqlite3 *db = nullptr;
+    if (sqlite3_open_v2(filename.c_str(), &db, flags | SQLITE_OPEN_NOMUTEX,
+                        nullptr) != SQLITE_OK) {
+        LOG_ERROR(logger, "Could not open {}: {}", filename,
+                  db ? sqlite3_errmsg(db) : "out of memory");
+        sqlite3_close(db);
+        return nullptr;
+    }
+    sqlite3_busy_timeout(db, 5000);
+    return db;
+}
+
+static bool exec(sqlite3 *db, const char *sql) {
+    char *error = nullptr;
+    if (sqlite3_exec(db, sql, nullptr, nullptr, &error) != SQLITE_OK) {
+        LOG_ERROR(logger, "{}: {}", sql, error ? error : "unknown error");
+        sqlite3_free(error);
+        return false;
+    }
+    return true;
+}
+
+Store::Store()
+    : reader(nullptr), writerDb(nullptr), maxEntries(0), queued(0),
+      committed(0), flushInterval(0), batchSize(0), flushRequested(false),
+      stopping(false) {}
+
+Store::~Store() {
+    close();
+}
+
+Store &Store::global() {
+    static Store store;
+    return store;
+}
+
+bool Store::open(const std::string &filename) {
+    maxEntries = Config::global()->get<int>("store_cache_entries", 4096);
+    flushInterval = std::chrono::milliseconds(
+        Config::global()->get<int>("store_flush_ms", 100));
+    batchSize = Config::global()->get<int>("store_batch_size", 256);
+
+    writerDb = openDatabase(filename, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+    if (!writerDb) {
+        return false;
+    }
+    // WAL lets the reader work while a batch is committed, and NORMAL only
+    // syncs at checkpoints which is safe in WAL mode
+    if (!exec(writerDb, "PRAGMA journal_mode=WAL") ||
+        !exec(writerDb, "PRAGMA synchronous=NORMAL") ||
+        !exec(writerDb, CREATE_SQL)) {
+        sqlite3_close(writerDb);
+        writerDb = nullptr;
+        return false;
+    }
+
+    reader = openDatabase(filename, SQLITE_OPEN_READONLY);
+    if (!reader) {
+        sqlite3_close(writerDb);
+        writerDb = nullptr;
+        return false;
+    }
+
+    readStatements.setDatabase(reader);
+    writeStatements.setDatabase(writerDb);
+    stopping = false;
+    writerThread = std::thread(&Store::writer, this);
+
+    LOG_INFO(logger, "Opened store {}", filename);
+    return true;
+}
+
+void Store::close() {
+    if (!isOpen()) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> l(mutex);
+        stopping = true;
+    }
+    writeCV.notify_one();
+    writerThread.join(); // commits what is left first
+
+    std::lock_guard<std::mutex> l(mutex);
+    readStatements.clear();
+    writeStatements.clear();
+    sqlite3_close(reader);
+    sqlite3_close(writerDb);
+    reader = writerDb = nullptr;
+    entries.clear();
+    lru.clear();
+}
+
+std::string Store::makeKey(const std::string &ns, const std::string &key) {
+    return std::to_string(ns.size()) + ":" + ns + key;
+}
+
+void Store::cache(const std::string &fullKey, bool exists, const std::string &value) {
+    auto entry = entries.find(fullKey);
+    if (entry != entries.end()) {
+        entry->second.exists = exists;
+        entry->second.value = value;
+        lru.splice(lru.begin(), lru, entry->second.lru);
+        return;
+    }
+
+    if (maxEntries == 0) {
+        return;
+    }
+    if (entries.size() >= maxEntries) {
+        entries.erase(lru.back());
+        lru.pop_back();
+    }
+    lru.push_front(fullKey);
+    entries[fullKey] = CacheEntry{exists, value, lru.begin()};
+}
+
+void Store::uncache(const std::string &fullKey) {
+    auto entry = entries.find(fullKey);
+    if (entry != entries.end()) {
+        lru.erase(entry->second.lru);
+        entries.erase(entry);
+    }
+}
+
+bool Store::get(const std::string &ns, const std::string &key, std::string *value,
+                bool cached) {
+    std::string fullKey = makeKey(ns, key);
+    std::lock_guard<std::mutex> l(mutex);
+    if (!isOpen()) {
+        return false;
+    }
+
+    auto entry = entries.find(fullKey);
+    if (entry != entries.end()) {
+        lru.splice(lru.begin(), lru, entry->second.lru);
+        if (entry->second.exists) {
+            *value = entry->second.value;
+        }
+        return entry->second.exists;
+    }
+
+    // an evicted write may not have reached the database yet
+    for (auto *writes : { &pending, &committing }) {
+        auto w = writes->find(fullKey);
+        if (w != writes->end()) {
+            if (cached) {
+                cache(fullKey, !w->second.remove, w->second.value);
+            }
+            if (!w->second.remove) {
+                *value = w->second.value;
+            }
+            return !w->second.remove;
+        }
+    }
+
+    sqlite3_stmt *select = readStatements.get(SELECT_SQL);
+    if (!select) {
+        return false;
+    }
+    sqlite3_bind_text(select, 1, ns.data(), ns.size(), SQLITE_STATIC);
+    sqlite3_bind_text(select, 2, key.data(), key.size(), SQLITE_STATIC);
+
+    int status = sqlite3_step(select);
+    bool exists = status == SQLITE_ROW;
+    std::string result;
+    if (exists) {
+        result.assign(reinterpret_cast<const char *>(sqlite3_column_text(select, 0)),
+                      sqlite3_column_bytes(select, 0));
+    } else if (status != SQLITE_DONE) {
+        LOG_ERROR(logger, "Could not read {}: {}", key, sqlite3_errmsg(reader));
+        sqlite3_reset(select);
+        return false;
+    }
+    sqlite3_reset(select);
+
+    if (cached) {
+        cache(fullKey, exists, result);
+    }
+    if (exists) {
+        *value = result;
+    }
+    return exists;
+}
+
+void Store::set(const std::string &ns, const std::string &key, const std::string &value,
+                bool cached) {
+    write(Write{ns, key, false, value}, cached);
+}
+
+void Store::remove(const std::string &ns, const std::string &key, bool cached) {
+    write(Write{ns, key, true, ""}, cached);
+}
+
+void Store::write(Write w, bool cached) {
+    std::string fullKey = makeKey(w.ns, w.key);
+    size_t waiting;
+    {
+        std::lock_guard<std::mutex> l(mutex);
+        if (!isOpen()) {
+            LOG_WARN(logger, "Store is not open, dropped write to {}", w.key);
+            return;
+        }
+        if (cached) {
+            cache(fullKey, !w.remove, w.value);
+        } else {
+            uncache(fullKey);
+        }
+        pending[fullKey] = std::move(w); // only the last write to a key matters
+        ++queued;
+        waiting = pending.size();
+    }
+    if (waiting >= batchSize) {
+        writeCV.notify_one();
+    }
+}
+
+void Store::flush() {
+    std::unique_lock<std::mutex> l(mutex);
+    uint64_t target = queued;
+    flushRequested = true;
+    writeCV.notify_one();
+    committedCV.wait(l, [this, target]() { return committed >= target || !isOpen(); });
+}
+
+bool Store::commit(std::map<std::string, Write> &batch) {
+    if (!exec(writerDb, "BEGIN")) {
+        return false;
+    }
+
+    for (auto &w : batch) {
+        const Write &write = w.second;
+        sqlite3_stmt *statement = writeStatements.get(write.remove ? DELETE_SQL : UPSERT_SQL);
+        if (!statement) {
+            exec(writerDb, "ROLLBACK");
+            return false;
+        }
+        sqlite3_bind_text(statement, 1, write.ns.data(), write.ns.size(), SQLITE_STATIC);
+        sqlite3_bind_text(statement, 2, write.key.data(), write.key.size(), SQLITE_STATIC);
+        if (!write.remove) {
+            sqlite3_bind_text(statement, 3, write.value.data(), write.value.size(), SQLITE_STATIC);
+        }
+        if (sqlite3_step(statement) != SQLITE_DONE) {
+            LOG_ERROR(logger, "Could not write {}: {}", write.key, sqlite3_errmsg(writerDb));
+            sqlite3_reset(statement);
+            exec(writerDb, "ROLLBACK");
+            return false;
+        }
+        sqlite3_reset(statement);
+    }
+
+    return exec(writerDb, "COMMIT");
+}
+
+void Store::writer() {
+    std::unique_lock<std::mutex> l(mutex);
+    while (true) {
+        writeCV.wait_for(l, flushInterval, [this]() {
+            return stopping || flushRequested || pending.size() >= batchSize;
+        });
+        flushRequested = false;
+
+        if (pending.empty()) {
+            committed = queued;
+            committedCV.notify_all();
+            if (stopping) {
+                return;
+            }
+            continue;
+        }
+
+        uint64_t target = queued;
+        committing.swap(pending);
+        l.unlock();
+
+        bool ok = commit(committing);
+
+        l.lock();
+        if (!ok) {
+            // keep the newer writes, retry the rest with the next batch
+            for (auto &w : committing) {
+                pending.insert(std::move(w));
+            }
+            if (stopping) {
+                LOG_ERROR(logger, "Lost {} writes that couldn't be committed", pending.size());
+                pending.clear();
+            }
+        }
+        committing.clear();
+        if (ok) {
+            committed = target;
+        }
+        committedCV.notify_all();
+    }
+}
@@ -16,19 +16,49 @@
  */
  
 #include <map>
+#include <algorithm>
 
 #include <curlpp/cURLpp.hpp>
 #include <curlpp/Easy.hpp>
 #include <curlpp/Options.hpp>
+#include <curlpp/Infos.hpp>
 
+#include "telegram.h"
 #include "logger.h"
 static Logger logger("tg api");
 
 #include "config.h"
+#include "http.h"
+#include "tracing.h"
+#include "webhooks.h"
+#include "metrics.h"
 #include "json.hpp"
 using json = nlohmann::json;
 
 #include <fstream>
+#include <atomic>
+
+static std::atomic<bool> dryRun(false);
+
+void tg_setDryRun(bool dryRun) {
+    ::dryRun = dryRun;
+}
+
+/**
+ * The latency histogram of a method and response status
+ *
+ * Each thread keeps the ones it used so the registry is only locked once.
+ */
+static Histogram &requestTime(const std::string &method, const std::string &status) {
+    static thread_local std::map<std::string, Histogram *> cache;
+    Histogram *&histogram = cache[method + " " + status];
+    if (!histogram) {
+        histogram = &Metrics::global().histogram("pb_telegram_request_seconds",
+            "Bot API call latency by method and http status",
+            Metrics::label("method", method) + "," + Metrics::label("status", status));
+    }
+    return *histogram;
+}
 
 static std::string callMethod(const std::string &method,
         const std::map<std::string, std::string> &arguments,
@@ -37,11 +67,17 @@ static std::string callMethod(const std::string &method,
     using namespace curlpp::options;
     std::stringstream result;
 
+    if (dryRun) {
+        LOG_DEBUG(logger, "Dry run: {}", method);
+        return "";
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::string status = "error";
     try {
-        curlpp::Cleanup cleanup;
-        curlpp::Easy request;
+        PooledHandle request;
 
-        request.setOpt<Url>(Config::global()->get<std::string>("api_url")
+        request->setOpt<Url>(Config::global()->get<std::string>("api_url")
                             + "bot" + Config::global()->get<std::string>("token")
                             + "/" + method);
 
@@ -58,20 +94,24 @@ static std::string callMethod(const std::string &method,
                     new curlpp::FormParts::File(pair.first, pair.second));
             }
 
-            request.setOpt<HttpPost>(formParts);
+            request->setOpt<HttpPost>(formParts);
         }
 
-        request.setOpt<WriteStream>(&result);
-        request.perform();
+        request->setOpt<WriteStream>(&result);
+        request->perform();
+        status = std::to_string(curlpp::infos::ResponseCode::get(*request));
     }
 
     catch(curlpp::RuntimeError &e) {
-        logger.error("Failed to call method: " + std::string(e.what()));
+        LOG_ERROR(logger, "Failed to call method: {}", e.what());
     }
     catch(curlpp::LogicError &e) {
-        logger.error("Failed to call method: " + std::string(e.what()));
+        LOG_ERROR(logger, "Failed to call method: {}", e.what());
     }
 
+    auto end = std::chrono::steady_clock::now();
+    requestTime(method, status).observe(end - start);
+    Tracer::global().record(Tracer::current(), "telegram", method, start, end);
     return result.str();
 }
 
@@ -82,7 +122,7 @@ bool tg_downloadFile(const std::string &file_id, const std::string &filename) {
     auto path_it = response.find("file_path");
     if (path_it == response.end()) {
         std::cout << response << std::endl;
-        logger.error("Telegram did not provide a download url");
+        LOG_ERROR(logger, "Telegram did not provide a download url");
         return false;
     }
     std::string path = *path_it;
@@ -90,31 +130,30 @@ bool tg_downloadFile(const std::string &file_id, const std::string &filename) {
     // get the file stream to write to
     std::ofstream file(filename);
     if (!file.good()) {
-        logger.error("Could not write downloaded file. ID: " + file_id);
+        LOG_ERROR(logger, "Could not write downloaded file. ID: {}", file_id);
         return false;
     }
 
     // download the file
     using namespace curlpp::options;
     try {
-        curlpp::Cleanup cleanup;
-        curlpp::Easy request;
+        PooledHandle request;
 
-        request.setOpt<Url>(Config::global()->get<std::string>("api_url")
+        request->setOpt<Url>(Config::global()->get<std::string>("api_url")
                             + "file/bot"
                             + Config::global()->get<std::string>("token")
                             + "/" + path);
 
-        request.setOpt<WriteStream>(&file);
-        request.perform();
+        request->setOpt<WriteStream>(&file);
+        request->perform();
     }
 
     catch(curlpp::RuntimeError &e) {
-        logger.error("Failed to download file: " + std::string(e.what()));
+        LOG_ERROR(logger, "Failed to download file: {}", e.what());
         return false;
     }
     catch(curlpp::LogicError &e) {
-        logger.error("Failed to download file: " + std::string(e.what()));
+        LOG_ERROR(logger, "Failed to download file: {}", e.what());
         return false;
     }
 
@@ -134,15 +173,15 @@ bool setWebhook(const std::string &url, std::string certFile) {
 
     bool result = data["ok"].get<bool>();
     if (result) {
-        logger.debug(data["description"].get<std::string>());
+        LOG_DEBUG(logger, "{}", data["description"].get<std::string>());
     } else {
-        logger.error(data["description"].get<std::string>());
+        LOG_ERROR(logger, "{}", data["description"].get<std::string>());
     }
 
     return result;
 }
 
-void tg_sendMessage(const std::string &message, int chat_id,
+void tg_sendMessage(const std::string &message, int64_t chat_id,
                     int message_id, bool markdown,
                     bool disable_link_preview) {
     std::map<std::string, std::string> arguments = 
@@ -161,9 +200,26 @@ void tg_sendMessage(const std::string &message, int chat_id,
         arguments["disable_web_page_preview"] = "true";
     }
 
+    // the connection that delivered the message may carry the reply
+    json call = arguments;
+    call["method"] = "sendMessage";
+    if (offerWebhookReply(chat_id, call)) {
+        return;
+    }
+
     callMethod("sendMessage", arguments);
 }
 
+void tg_sendCall(const json &call) {
+    std::map<std::string, std::string> arguments;
+    for (auto arg = call.begin(); arg != call.end(); ++arg) {
+        if (arg.key() != "method") {
+            arguments[arg.key()] = arg.value().get<std::string>();
+        }
+    }
+    callMethod(call["method"].get<std::string>(), arguments);
+}
+
 std::string getMessageText(const json &update) {
     if (update.find("message") != update.end() &&
         update["message"].find("text") != update["message"].end()) {
@@ -173,3 +229,226 @@ std::string getMessageText(const json &update) {
 
     return "";
 }
+
+std::string getMessageFile(const json &message, std::string *file_id) {
+    auto contains = [&message](const std::string &s) {
+        return message.find(s) != message.end();
+    };
+
+    if (contains("audio")) {
+        if (file_id) {
+            *file_id = message["audio"]["file_id"].get<std::string>();
+        }
+        return "AUDIO";
+    } else if (contains("document")) {
+        if (file_id) {
+            *file_id = message["document"]["file_id"].get<std::string>();
+        }
+        return "FILE";
+    } else if (contains("photo")) {
+        if (file_id) {
+            auto photo = std::max_element(message["photo"].begin(),
+                                          message["photo"].end(),
+                [](const json &lhs, const json &rhs) {
+                    return lhs["width"].get<int>() * lhs["height"].get<int>() <
+                           rhs["width"].get<int>() * rhs["height"].get<int>();
+                });
+
+            *file_id = (*photo)["file_id"].get<std::string>();
+        }
+        return "PHOTO";
+    } else if (contains("sticker")) {
+        if (file_id) {
+            *file_id = message["sticker"]["file_id"].get<std::string>();
+        }
+        return "STICKER";
+    } else if (contains("video")) {
+        if (file_id) {
+            *file_id = message["video"]["file_id"].get<std::string>();
+        }
+        return "VIDEO";
+    } else if (contains("contact")) {
+        return "CONTACT";
+    } else if (contains("location")) {
+        return "LOCATION";
+    } else if (contains("text")) {
+        return "TEXT";
+    } else {
+        return "UNKNOWN";
+    }
+}
+
+// the updates that are a Message object themselves
+static const char *messageUpdates[] = {
+    "message", "edited_message", "channel_post", "edited_channel_post"
+};
+
+bool getUpdateDate(const json &update, int64_t *date) {
+    for (const char *type : messageUpdates) {
+        auto message = update.find(type);
+        if (message == update.end()) {
+            continue;
+        }
+
+        // an edit is as old as the edit, not the original message
+        for (const char *field : { "edit_date", "date" }) {
+            auto value = message->find(field);
+            if (value != message->end() && value->is_number()) {
+                *date = value->get<int64_t>();
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+const json *getUpdateMessage(const json &update) {
+    for (const char *type : messageUpdates) {
+        auto message = update.find(type);
+        if (message != update.end() && message->is_object()) {
+            return &*message;
+        }
+    }
+
+    // callback queries carry the message their button was on
+    auto query = update.find("callback_query");
+    if (query != update.end()) {
+        auto message = query->find("message");
+        if (message != query->end() && message->is_object()) {
+            return &*message;
+        }
+    }
+    return nullptr;
+}
+
+bool getUpdateChat(const json &update, int64_t *chat) {
+    const json *object = getUpdateMessage(update);
+    if (!object) {
+        // chat member updates have the chat at the top
+        for (const char *type : { "chat_member", "my_chat_member" }) {
+            auto member = update.find(type);
+            if (member != update.end()) {
+                object = &*member;
+                break;
+            }
+        }
+    }
+    if (!object) {
+        return false;
+    }
+
+    auto chatObject = object->find("chat");
+    if (chatObject == object->end()) {
+        return false;
+    }
+    auto id = chatObject->find("id");
+    if (id == chatObject->end() || !id->is_number()) {
+        return false;
+    }
+    *chat = id->get<int64_t>();
+    return true;
+}
+
+bool getUpdateMessageId(const json &update, int *message_id) {
+    const json *message = getUpdateMessage(update);
+    if (!message) {
+        return false;
+    }
+    auto id = message->find("message_id");
+    if (id == message->end() || !id->is_number()) {
+        return false;
+    }
+    *message_id = id->get<int>();
+    return true;
+}
+
+const json *getUpdateSender(const json &update) {
+    for (const char *type : { "message", "edited_message", "callback_query",
+                              "inline_query", "chosen_inline_result",
+                              "chat_member", "my_chat_member" }) {
+        auto object = update.find(type);
+        if (object == update.end()) {
+            continue;
+        }
+        auto from = object->find("from");
+        return from != object->end() ? &*from : nullptr;
+    }
+    return nullptr;
+}
+
+//must be in the same order as the enum
+static const char *updateTypeNames[] = {
+    "text", "photo", "sticker", "audio", "voice", "video", "document",
+    "contact", "location", "chat_member", "edited_message", "channel_post",
+    "callback_query", "inline_query", "other"
+};
+
+UpdateType getUpdateType(const json &update) {
+    auto contains = [](const json &object, const char *key) {
+        return object.find(key) != object.end();
+    };
+
+    if (contains(update, "message")) {
+        const json &message = update["message"];
+        // the same order as getMessageFile, a photo with a caption is a photo
+        if (contains(message, "audio")) {
+            return UPDATE_AUDIO;
+        } else if (contains(message, "document")) {
+            return UPDATE_DOCUMENT;
+        } else if (contains(message, "photo")) {
+            return UPDATE_PHOTO;
+        } else if (contains(message, "sticker")) {
+            return UPDATE_STICKER;
+        } else if (contains(message, "video")) {
+            return UPDATE_VIDEO;
+        } else if (contains(message, "voice")) {
+            return UPDATE_VOICE;
+        } else if (contains(message, "contact")) {
+            return UPDATE_CONTACT;
+        } else if (contains(message, "location")) {
+            return UPDATE_LOCATION;
+        } else if (contains(message, "text")) {
+            return UPDATE_TEXT;
+        }
+
+        for (const char *key : { "new_chat_member", "new_chat_members",
+                                 "new_chat_participant", "left_chat_member",
+                                 "left_chat_participant" }) {
+            if (contains(message, key)) {
+                return UPDATE_CHAT_MEMBER;
+            }
+        }
+        return UPDATE_OTHER;
+    }
+
+    if (contains(update, "edited_message")) {
+        return UPDATE_EDITED_MESSAGE;
+    } else if (contains(update, "channel_post")) {
+        return UPDATE_CHANNEL_POST;
+    } else if (contains(update, "callback_query")) {
+        return UPDATE_CALLBACK_QUERY;
+    } else if (contains(update, "inline_query")) {
+        return UPDATE_INLINE_QUERY;
+    } else if (contains(update, "chat_member") ||
+               contains(update, "my_chat_member")) {
+        return UPDATE_CHAT_MEMBER;
+    }
+    return UPDATE_OTHER;
+}
+
+const char *getUpdateTypeName(UpdateType type) {
+    if (type >= 0 && type < UPDATE_TYPE_COUNT) {
+        return updateTypeNames[type];
+    }
+    return "other";
+}
+
+bool parseUpdateType(const std::string &name, UpdateType *type) {
+    for (int i = 0; i < UPDATE_TYPE_COUNT; ++i) {
+        if (name == updateTypeNames[i]) {
+            *type = static_cast<UpdateType>(i);
+            return true;
+        }
+    }
+    return false;
+}
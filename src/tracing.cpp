@@ -0,0 +1,232 @@
+/**
+ *  Copyright (C) 2015  Andrew Kallmeyer <fsmv@sapium.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the Lesser GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  Lesser GNU General Public License for more details.
+ *
+ *  You should have received a copy of the Lesser GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "tracing.h"
+#include "config.h"
+#include "logger.h"
+#include "json.hpp"
+
+#include <cmath>
+
+using json = nlohmann::json;
+
+static Logger logger("Tracing");
+
+// the update whose spans the current thread records, 0 if none
+static thread_local int64_t currentUpdate = 0;
+
+Tracer::Context::Context(int64_t updateId) : previous(currentUpdate) {
+    currentUpdate = Tracer::global().sampled(updateId) ? updateId : 0;
+}
+
+Tracer::Context::~Context() {
+    currentUpdate = previous;
+}
+
+Tracer::Span::Span(const char *category, const std::string &name)
+    : updateId(currentUpdate), category(category) {
+    if (updateId) {
+        this->name = name;
+        start = std::chrono::steady_clock::now();
+    }
+}
+
+Tracer::Span::~Span() {
+    if (updateId) {
+        Tracer::global().record(updateId, category, name, start,
+                                std::chrono::steady_clock::now());
+    }
+}
+
+Tracer::Tracer()
+    : threshold(0), epoch(std::chrono::steady_clock::now()), file(nullptr),
+      first(true), maxEvents(0), flushInterval(0), dropped(0), stopping(false) {}
+
+Tracer::~Tracer() {
+    stop();
+}
+
+Tracer &Tracer::global() {
+    // never freed, spans may still end while static objects are destroyed
+    static Tracer *tracer = new Tracer();
+    return *tracer;
+}
+
+int64_t Tracer::current() {
+    return currentUpdate;
+}
+
+unsigned Tracer::threadNumber() {
+    static std::atomic<unsigned> next(1);
+    static thread_local unsigned number = next++;
+    return number;
+}
+
+int64_t Tracer::micros(TimePoint time) const {
+    return std::chrono::duration_cast<std::chrono::microseconds>(time - epoch).count();
+}
+
+bool Tracer::start() {
+    double rate = Config::global()->get<double>("trace_sample_rate", 0);
+    if (rate <= 0) {
+        return true;
+    }
+
+    std::string filename = Config::global()->get<std::string>("trace_file", "trace.json");
+    file = fopen(filename.c_str(), "w");
+    if (!file) {
+        LOG_ERROR(logger, "Could not open trace file {}", filename);
+        return false;
+    }
+    // the array format, chrome reads it even if the bot dies before the ]
+    fputs("[\n", file);
+
+    maxEvents = Config::global()->get<int>("trace_buffer_events", 100000);
+    flushInterval = std::chrono::milliseconds(
+        Config::global()->get<int>("trace_flush_ms", 1000));
+    epoch = std::chrono::steady_clock::now();
+    stopping = false;
+    thread = std::thread(&Tracer::writer, this);
+
+    threshold = rate >= 1 ? UINT64_MAX
+              : static_cast<uint64_t>(std::ldexp(rate, 64));
+    LOG_INFO(logger, "Tracing {} of the updates to {}", rate, filename);
+    return true;
+}
+
+void Tracer::stop() {
+    if (!file) {
+        return;
+    }
+    threshold = 0;
+
+    {
+        std::lock_guard<std::mutex> l(mutex);
+        stopping = true;
+    }
+    cv.notify_one();
+    thread.join(); // writes what is left first
+
+    fputs("\n]\n", file);
+    fclose(file);
+    file = nullptr;
+}
+
+void Tracer::record(int64_t updateId, const char *category, const std::string &name,
+                    TimePoint start, TimePoint end) {
+    if (!sampled(updateId)) {
+        return;
+    }
+
+    Event event{updateId, category, name, micros(start), micros(end) - micros(start),
+                threadNumber()};
+    std::lock_guard<std::mutex> l(mutex);
+    if (events.size() >= maxEvents) {
+        ++dropped;
+        return;
+    }
+    events.push_back(std::move(event));
+}
+
+void Tracer::queued(int64_t updateId, TimePoint when) {
+    if (!sampled(updateId)) {
+        return;
+    }
+    std::lock_guard<std::mutex> l(mutex);
+    waiting[updateId] = when;
+}
+
+void Tracer::dequeued(int64_t updateId) {
+    if (!sampled(updateId)) {
+        return;
+    }
+
+    TimePoint when;
+    {
+        std::lock_guard<std::mutex> l(mutex);
+        auto queued = waiting.find(updateId);
+        if (queued == waiting.end()) {
+            return;
+        }
+        when = queued->second;
+        waiting.erase(queued);
+    }
+    record(updateId, "queue", "queue", when, std::chrono::steady_clock::now());
+}
+
+void Tracer::nameThread(const std::string &name) {
+    if (!file) {
+        return;
+    }
+    std::lock_guard<std::mutex> l(mutex);
+    threadNames.emplace_back(threadNumber(), name);
+}
+
+void Tracer::writer() {
+    std::unique_lock<std::mutex> l(mutex);
+    while (true) {
+        cv.wait_for(l, flushInterval, [this]{ return stopping; });
+
+        std::vector<Event> batch;
+        batch.swap(events);
+        std::vector<std::pair<unsigned, std::string>> names;
+        names.swap(threadNames);
+        uint64_t lost = dropped;
+        dropped = 0;
+        bool stop = stopping;
+        l.unlock();
+
+        for (auto &name : names) {
+            json meta;
+            meta["name"] = "thread_name";
+            meta["ph"] = "M";
+            meta["pid"] = 1;
+            meta["tid"] = name.first;
+            meta["args"]["name"] = name.second;
+            fputs(first ? "" : ",\n", file);
+            fputs(meta.dump().c_str(), file);
+            first = false;
+        }
+        writeEvents(batch);
+        fflush(file);
+        if (lost) {
+            LOG_WARN(logger, "Dropped {} trace spans, the buffer was full", lost);
+        }
+
+        l.lock();
+        if (stop) {
+            return;
+        }
+    }
+}
+
+void Tracer::writeEvents(std::vector<Event> &batch) {
+    for (const Event &event : batch) {
+        json span;
+        span["name"] = event.name;
+        span["cat"] = event.category;
+        span["ph"] = "X";
+        span["ts"] = event.start;
+        span["dur"] = event.duration;
+        span["pid"] = 1;
+        span["tid"] = event.thread;
+        span["args"]["update"] = event.updateId;
+        fputs(first ? "" : ",\n", file);
+        fputs(span.dump().c_str(), file);
+        first = false;
+    }
+}
@@ -28,17 +28,188 @@
 #include <iostream>
 #include <queue>
 #include <mutex>
+#include <atomic>
 #include <condition_variable>
 
+#include <map>
+#include <vector>
+
 #include <microhttpd.h>
 #include "logger.h"
+#include "config.h"
+#include "telegram.h"
+#include "metrics.h"
+#include "tracing.h"
+#include "asyncio.h"
 
 static Logger logger("Webhooks");
-static std::mutex updatesMutex, conditionMutex;
+static std::mutex updatesMutex;
 static std::condition_variable updateCV;
 static std::queue<json> updates;
+static bool woken = false;
+static std::atomic<bool> accepting(false);
 static struct MHD_Daemon *server;
 
+// connections held so that a reply can go in the webhook response
+struct HeldReply {
+    int64_t update_id;
+    // every run of the update let go of its hold
+    bool done;
+    std::vector<json> calls;
+};
+
+static bool serveMetrics = false;
+static Counter &updatesReceived = Metrics::global().counter(
+    "pb_updates_received_total", "Updates received from telegram");
+static Counter &updatesInvalid = Metrics::global().counter(
+    "pb_updates_invalid_total", "Webhook requests that weren't valid json");
+static Histogram &parseTime = Metrics::global().histogram(
+    "pb_update_parse_seconds", "Time to parse the json of an update");
+
+/**
+ * Parses an update, counting it in the metrics
+ */
+static bool parseUpdate(const char *message, json *update) {
+    ScopedTimer timer(parseTime);
+    try {
+        *update = json::parse(message);
+    } catch (std::invalid_argument &e) {
+        updatesInvalid.add();
+        return false;
+    }
+    updatesReceived.add();
+    return true;
+}
+
+static bool replyInResponse = false;
+static std::chrono::milliseconds replyDeadline(100);
+static std::mutex heldMutex;
+static std::condition_variable heldCV;
+static std::map<int64_t, std::shared_ptr<HeldReply>> held; // by chat id
+
+std::shared_ptr<void> holdWebhookReply(const json &update) {
+    int64_t chat_id;
+    if (!replyInResponse || !getUpdateChat(update, &chat_id) ||
+        update.find("update_id") == update.end()) {
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> l(heldMutex);
+    auto reply = held.find(chat_id);
+    if (reply == held.end() ||
+        reply->second->update_id != update["update_id"].get<int64_t>()) {
+        return nullptr;
+    }
+
+    // released when the dispatcher and every run are done with it
+    std::shared_ptr<HeldReply> heldReply = reply->second;
+    return std::shared_ptr<void>(nullptr, [heldReply](void *) {
+        {
+            std::lock_guard<std::mutex> l(heldMutex);
+            heldReply->done = true;
+        }
+        heldCV.notify_all();
+    });
+}
+
+// the update whose run makes the calls on this thread
+static thread_local int64_t replyUpdate = 0;
+
+WebhookReplyScope::WebhookReplyScope(int64_t update_id) : previous(replyUpdate) {
+    replyUpdate = update_id;
+}
+
+WebhookReplyScope::~WebhookReplyScope() {
+    replyUpdate = previous;
+}
+
+int64_t WebhookReplyScope::current() {
+    return replyUpdate;
+}
+
+bool offerWebhookReply(int64_t chat_id, const json &call) {
+    if (replyUpdate == 0) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> l(heldMutex);
+    auto reply = held.find(chat_id);
+    if (reply == held.end() || reply->second->update_id != replyUpdate) {
+        LOG_DEBUG(logger, "No held connection of update {} for chat {}, calling the api",
+                  replyUpdate, chat_id);
+        return false;
+    }
+    reply->second->calls.push_back(call);
+    return true;
+}
+
+/**
+ * Opens a held reply for an update unless its chat already has one
+ */
+static std::shared_ptr<HeldReply> openHeldReply(const json &update) {
+    int64_t chat_id;
+    if (!getUpdateChat(update, &chat_id) || update.find("update_id") == update.end()) {
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> l(heldMutex);
+    if (held.find(chat_id) != held.end()) {
+        return nullptr; // the replies couldn't be told apart
+    }
+
+    std::shared_ptr<HeldReply> reply(new HeldReply);
+    reply->update_id = update["update_id"].get<int64_t>();
+    reply->done = false;
+    held[chat_id] = reply;
+    return reply;
+}
+
+/**
+ * Waits for the runs of a held update and closes it if they finished
+ *
+ * @param calls set to the calls offered so far
+ * @return true if the runs finished and it was closed, false if it is still
+ *         open and must be drained with drainHeldReply()
+ */
+static bool closeHeldReply(int64_t chat_id, const std::shared_ptr<HeldReply> &reply,
+                           std::vector<json> *calls) {
+    std::unique_lock<std::mutex> l(heldMutex);
+    heldCV.wait_for(l, replyDeadline, [&reply]() { return reply->done; });
+    *calls = std::move(reply->calls);
+    reply->calls.clear();
+    if (!reply->done) {
+        return false;
+    }
+    held.erase(chat_id);
+    return true;
+}
+
+/**
+ * Sends the calls of a held update whose runs are still going on an io
+ * worker, until none are waiting, then closes it
+ *
+ * The runs keep offering their calls while this sends, so they go out in
+ * the order they were made.
+ */
+static void drainHeldReply(int64_t chat_id, const std::shared_ptr<HeldReply> &reply,
+                           std::vector<json> calls) {
+    submitIO([chat_id, reply, calls]() mutable {
+        while (true) {
+            for (const auto &call : calls) {
+                tg_sendCall(call);
+            }
+
+            std::lock_guard<std::mutex> l(heldMutex);
+            calls = std::move(reply->calls);
+            reply->calls.clear();
+            if (calls.empty()) {
+                held.erase(chat_id);
+                return;
+            }
+        }
+    }, []() {});
+}
+
 std::queue<json> popAllUpdates() {
     std::queue<json> result;
     
@@ -49,9 +220,25 @@ std::queue<json> popAllUpdates() {
     return result;
 }
 
-void waitForUpdate() {
-    std::unique_lock<std::mutex> l(conditionMutex);
-    updateCV.wait(l);
+bool waitForUpdate(std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> l(updatesMutex);
+    bool result = updateCV.wait_for(l, timeout, []() {
+        return woken || !updates.empty();
+    });
+    woken = false;
+    return result;
+}
+
+bool hasPendingUpdates() {
+    std::lock_guard<std::mutex> l(updatesMutex);
+    return !updates.empty();
+}
+
+void wakeDispatcher() {
+    updatesMutex.lock();
+    woken = true;
+    updatesMutex.unlock();
+    updateCV.notify_one();
 }
 
 //#define VERIFY_IP
@@ -66,9 +253,31 @@ struct connection_info {
     char *message;
     size_t message_len;
     bool valid;
+    //!set once message went through parseUpdate, valid then tells if it was json
+    bool parsed;
+    json update;
+    std::chrono::steady_clock::time_point started;
 };
 
-static int send_page (struct MHD_Connection *connection, const char *page) {
+/**
+ * Records the ingest span of a sampled update and starts its queue span
+ *
+ * @param update the update that was just queued
+ * @param started when its request came in
+ */
+static void traceQueued(const json &update,
+                        std::chrono::steady_clock::time_point started) {
+    auto updateId = update.find("update_id");
+    if (updateId == update.end() || !updateId->is_number()) {
+        return;
+    }
+    auto now = std::chrono::steady_clock::now();
+    Tracer::global().record(updateId->get<int64_t>(), "webhook", "ingest", started, now);
+    Tracer::global().queued(updateId->get<int64_t>(), now);
+}
+
+static int send_page (struct MHD_Connection *connection, const char *page,
+                      unsigned int status = MHD_HTTP_OK) {
     int ret;
     struct MHD_Response *response;
 
@@ -78,12 +287,97 @@ static int send_page (struct MHD_Connection *connection, const char *page) {
         return MHD_NO;
     }
 
-    ret = MHD_queue_response (connection, MHD_HTTP_OK, response);
+    ret = MHD_queue_response (connection, status, response);
     MHD_destroy_response (response);
 
     return ret;
 }
 
+/**
+ * Answers a webhook with a Bot API call for telegram to make
+ */
+static int send_call(struct MHD_Connection *connection, const json &call) {
+    std::string body = call.dump();
+    struct MHD_Response *response = MHD_create_response_from_buffer(
+        body.size(), (void *) body.data(), MHD_RESPMEM_MUST_COPY);
+    if (!response) {
+        return MHD_NO;
+    }
+
+    MHD_add_response_header(response, "Content-Type", "application/json");
+    int ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+    MHD_destroy_response(response);
+
+    return ret;
+}
+
+/**
+ * Queues an update, holds the connection until its runs are done and answers
+ * with their reply if there was exactly one
+ */
+static int answer_held(struct MHD_Connection *connection,
+                       struct connection_info *con_info) {
+    // request_completed reuses the result so the update is counted once
+    con_info->parsed = true;
+    con_info->valid = parseUpdate(con_info->message, &con_info->update);
+    if (!con_info->valid) {
+        return send_page(connection, " "); // logged by request_completed
+    }
+    const json &update = con_info->update;
+
+    std::shared_ptr<HeldReply> reply = openHeldReply(update);
+    if (!reply) {
+        return send_page(connection, " ");
+    }
+    int64_t chat_id;
+    getUpdateChat(update, &chat_id);
+
+    updatesMutex.lock();
+    updates.push(update);
+    LOG_DEBUG(logger, "Update: {}", update);
+    traceQueued(update, con_info->started);
+    updatesMutex.unlock();
+    updateCV.notify_one();
+
+    // request_completed must not queue it again
+    delete[] con_info->message;
+    con_info->message = nullptr;
+
+    std::vector<json> calls;
+    if (!closeHeldReply(chat_id, reply, &calls)) {
+        // a run is still going, its later calls can't come after a response
+        drainHeldReply(chat_id, reply, std::move(calls));
+        return send_page(connection, " ");
+    }
+    if (calls.size() == 1) {
+        return send_call(connection, calls[0]);
+    }
+    if (!calls.empty()) {
+        // answer telegram first, the calls don't need its connection
+        submitIO([calls]() {
+            for (const auto &call : calls) {
+                tg_sendCall(call);
+            }
+        }, []() {});
+    }
+    return send_page(connection, " ");
+}
+
+static int send_metrics(struct MHD_Connection *connection) {
+    std::string body = Metrics::global().render();
+    struct MHD_Response *response = MHD_create_response_from_buffer(
+        body.size(), (void *) body.data(), MHD_RESPMEM_MUST_COPY);
+    if (!response) {
+        return MHD_NO;
+    }
+
+    MHD_add_response_header(response, "Content-Type", "text/plain; version=0.0.4");
+    int ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+    MHD_destroy_response(response);
+
+    return ret;
+}
+
 std::string getIP(struct MHD_Connection *connection) {
     char address[INET_ADDRSTRLEN];
     inet_ntop(AF_INET, (void *)
@@ -101,17 +395,20 @@ request_completed (void *cls, struct MHD_Connection *connection,
 
     if (!con_info) return;
     if (con_info->message) {
-        updatesMutex.lock();
-        try {
-            auto update = json::parse(con_info->message);
-            updates.push(update);
-            logger.debug("Update: " + update.dump());
-        } catch (std::invalid_argument &e) {
-            logger.error("Invalid data received from " + getIP(connection)
-                       + "\nMessage:\n" + std::string(con_info->message));
+        if (!con_info->parsed) {
+            con_info->valid = parseUpdate(con_info->message, &con_info->update);
+        }
+        if (con_info->valid) {
+            updatesMutex.lock();
+            updates.push(std::move(con_info->update));
+            LOG_DEBUG(logger, "Update: {}", updates.back());
+            traceQueued(updates.back(), con_info->started);
+            updatesMutex.unlock();
+            updateCV.notify_one();
+        } else {
+            LOG_ERROR(logger, "Invalid data received from {}\nMessage:\n{}",
+                      getIP(connection), con_info->message);
         }
-        updatesMutex.unlock();
-        updateCV.notify_one();
 
         delete[] con_info->message;
     }
@@ -139,21 +436,33 @@ answer_to_connection (void *cls, struct MHD_Connection *connection,
     if (!*con_cls) { // new request
         if (strcmp(method, "POST") == 0) {
             if(!checkIP(connection)) {
-                logger.debug("Rejected packet from " + getIP(connection));
+                LOG_DEBUG(logger, "Rejected packet from {}", getIP(connection));
                 return MHD_NO;
             }
 
+            if (!accepting) {
+                LOG_DEBUG(logger, "Not ready, rejected update from {}", getIP(connection));
+                return send_page(connection, "Not ready",
+                                 MHD_HTTP_SERVICE_UNAVAILABLE);
+            }
+
             // create the persistent connection info object
             struct connection_info *con_info = new struct connection_info;
             con_info->message = nullptr;
             con_info->message_len = 0;
             con_info->valid = true;
+            con_info->parsed = false;
+            con_info->started = std::chrono::steady_clock::now();
 
             *con_cls = (void*)con_info;
             return MHD_YES;
         }
 
-        logger.debug("Rejected non-POST message");
+        if (serveMetrics && strcmp(method, "GET") == 0 && strcmp(url, "/metrics") == 0) {
+            return send_metrics(connection);
+        }
+
+        LOG_DEBUG(logger, "Rejected non-POST message");
         return MHD_NO;
     }
 
@@ -177,6 +486,8 @@ answer_to_connection (void *cls, struct MHD_Connection *connection,
 
             *upload_data_size = 0;
             return MHD_YES;
+        } else if (replyInResponse && con_info->message) {
+            return answer_held(connection, con_info);
         } else {
             return send_page(connection, " ");
         }
@@ -186,8 +497,23 @@ answer_to_connection (void *cls, struct MHD_Connection *connection,
 }
 
 int startServer(uint16_t port, const char *ip)  {
+    replyInResponse = Config::global()->get<bool>("webhook_reply", false);
+    serveMetrics = Config::global()->get<bool>("metrics", false);
+    Metrics::global().addCollector([]() {
+        static Gauge &depth = Metrics::global().gauge(
+            "pb_update_queue_depth", "Updates waiting for the dispatcher");
+        std::lock_guard<std::mutex> l(updatesMutex);
+        depth.set(updates.size());
+    });
+    replyDeadline = std::chrono::milliseconds(
+        Config::global()->get<int>("webhook_reply_ms", 100));
+
+    // held connections would block every other one in a single thread
+    unsigned int flags = MHD_USE_DEBUG | (replyInResponse
+        ? MHD_USE_THREAD_PER_CONNECTION : MHD_USE_SELECT_INTERNALLY);
+
     if (strcmp(ip, "0.0.0.0") == 0) {
-        server = MHD_start_daemon(MHD_USE_SELECT_INTERNALLY | MHD_USE_DEBUG,
+        server = MHD_start_daemon(flags,
                                   port, NULL, NULL,
                                   &answer_to_connection, NULL,
                                   MHD_OPTION_NOTIFY_COMPLETED, request_completed, NULL,
@@ -198,7 +524,7 @@ int startServer(uint16_t port, const char *ip)  {
         ipaddr.sin_port = htons(port);
         inet_pton(AF_INET, ip, &ipaddr.sin_addr);
 
-        server = MHD_start_daemon(MHD_USE_SELECT_INTERNALLY | MHD_USE_DEBUG,
+        server = MHD_start_daemon(flags,
                                   port, NULL, NULL,
                                   &answer_to_connection, NULL,
                                   MHD_OPTION_SOCK_ADDR, &ipaddr,
@@ -207,18 +533,22 @@ int startServer(uint16_t port, const char *ip)  {
     }
 
     if (!server) {
-        logger.error("Failed to start webhooks server on " + std::string(ip) + ":" + std::to_string(port));
+        LOG_ERROR(logger, "Failed to start webhooks server on {}:{}", ip, port);
         return 1;
     }
 
-    logger.info("Started webhooks server on " + std::string(ip) + ":" + std::to_string(port));
+    LOG_INFO(logger, "Started webhooks server on {}:{}", ip, port);
     return 0;
 }
 
+void setAcceptingUpdates(bool accepting) {
+    ::accepting = accepting;
+}
+
 void stopServer() {
     updateCV.notify_one();
     if(server) {
         MHD_stop_daemon(server);
-        logger.info("Stopped webhooks server");
+        LOG_INFO(logger, "Stopped webhooks server");
     }
 }
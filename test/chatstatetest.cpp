@@ -0,0 +1,95 @@
+/**
+ *  Copyright (C) 2015  Andrew Kallmeyer <fsmv@sapium.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the Lesser GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  Lesser GNU General Public License for more details.
+ *
+ *  You should have received a copy of the Lesser GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks that numbers keep every bit on the way through the chat state: the
+ * value incr returns, the value get returns once it was reloaded from the
+ * store, and the lua number pushJsonTable makes of it, for integers up to
+ * 2^53.
+ *
+ * Run it from an empty directory, it writes its own config.json.
+ */
+
+#include <cstdio>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+
+#include "config.h"
+#include "store.h"
+#include "chatstate.h"
+#include "luaapi.h"
+
+#include "luacompat.h"
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": failed " #cond << std::endl; \
+            ++failures; \
+        } \
+    } while (0)
+
+static const double values[] = {
+    1, 16777217, 2147483649.0, 1700000000, 4503599627370497.0,
+    9007199254740991.0, 9007199254740992.0, -9007199254740992.0
+};
+
+int main() {
+    {
+        // the smallest chat state cache, so every get loads from the store
+        std::ofstream config("config.json");
+        config << "{ \"token\" : \"test\", \"api_url\" : \"http://localhost/\","
+                  " \"webhook_url\" : \"http://localhost/\", \"chat_state_bytes\" : 1,"
+                  " \"log_file\" : \"chatstatetest.log\" }";
+    }
+    std::remove("chatstatetest.db");
+    Config::loadGlobalConfig();
+    if (!Config::global() || !Store::global().open("chatstatetest.db")) {
+        std::cerr << "Could not set up the config and store" << std::endl;
+        return 1;
+    }
+
+    lua_State *L = luaL_newstate();
+    int i = 0;
+    for (double value : values) {
+        std::string key = "n" + std::to_string(i++);
+        CHECK(ChatState::global().incr("test", 1, key, value) == value);
+
+        json other;
+        ChatState::global().get("test", 1, "other", &other); // evicts key
+        json stored;
+        CHECK(ChatState::global().get("test", 1, key, &stored));
+        CHECK(stored.is_number() && stored.get<double>() == value);
+
+        json table;
+        table["v"] = stored;
+        pushJsonTable(L, table);
+        lua_getfield(L, -1, "v");
+        CHECK(lua_tonumber(L, -1) == value);
+        lua_pop(L, 2);
+    }
+    lua_close(L);
+
+    Store::global().close();
+    if (failures) {
+        std::cerr << failures << " checks failed" << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,284 @@
+/**
+ *  Copyright (C) 2015  Andrew Kallmeyer <fsmv@sapium.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the Lesser GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  Lesser GNU General Public License for more details.
+ *
+ *  You should have received a copy of the Lesser GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * pblog - reads the JSON lines log written with log_format "json"
+ *
+ * Prints the records that match every filter given, as text like the console
+ * log or as the original JSON lines. Reads the files given, or stdin.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <fstream>
+#include <unistd.h>
+#include "json.hpp"
+
+using json = nlohmann::json;
+
+//must be in the same order as Logger::LogLevel
+static const char *levelNames[] = { "ERROR", "WARNING", "INFO", "DEBUG" };
+static const int NUM_LEVELS = 4;
+
+struct Filter {
+    int maxLevel = NUM_LEVELS - 1;
+    std::string logger;
+    bool hasUpdate = false;
+    int64_t update = 0;
+    bool hasChat = false;
+    int64_t chat = 0;
+    int64_t since = INT64_MIN;
+    int64_t until = INT64_MAX;
+    std::string text;
+    bool printJson = false;
+};
+
+static void usage(const char *program) {
+    fprintf(stderr,
+        "usage: %s [options] [file...]\n"
+        "  -l LEVEL  only ERROR, WARNING, INFO or DEBUG and more severe\n"
+        "  -n NAME   only messages of the logger NAME\n"
+        "  -u ID     only messages about update ID\n"
+        "  -c ID     only messages from chat ID\n"
+        "  -s TIME   only messages at or after TIME\n"
+        "  -e TIME   only messages before TIME\n"
+        "  -g TEXT   only messages containing TEXT\n"
+        "  -j        print the matching records as JSON lines\n"
+        "TIME is unix seconds or \"YYYY-MM-DD HH:MM:SS\" in local time.\n"
+        "Reads stdin when no file is given.\n", program);
+}
+
+static int parseLevel(const char *name) {
+    if (strcmp(name, "WARN") == 0) {
+        return 1;
+    }
+    for (int i = 0; i < NUM_LEVELS; ++i) {
+        if (strcmp(name, levelNames[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Parses an update or chat id argument
+ */
+static bool parseId(const char *str, int64_t *id) {
+    char *end;
+    *id = strtoll(str, &end, 10);
+    return end != str && *end == '\0';
+}
+
+/**
+ * Parses a time argument into unix milliseconds
+ */
+static bool parseTime(const char *str, int64_t *ms) {
+    char *end;
+    long long seconds = strtoll(str, &end, 10);
+    if (*end == '\0') {
+        *ms = seconds * 1000;
+        return true;
+    }
+
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    end = strptime(str, "%Y-%m-%d %H:%M:%S", &tm);
+    if (!end || *end != '\0') {
+        return false;
+    }
+    tm.tm_isdst = -1;
+    *ms = static_cast<int64_t>(mktime(&tm)) * 1000;
+    return true;
+}
+
+/**
+ * Reads a string field of a record
+ *
+ * @return false if it's missing or not a string
+ */
+static bool stringField(const json &record, const char *name, std::string *value) {
+    auto field = record.find(name);
+    if (field == record.end() || !field->is_string()) {
+        return false;
+    }
+    *value = field->get<std::string>();
+    return true;
+}
+
+/**
+ * Reads a number field of a record
+ *
+ * @return false if it's missing or not a number
+ */
+static bool numberField(const json &record, const char *name, int64_t *value) {
+    auto field = record.find(name);
+    if (field == record.end() || !field->is_number()) {
+        return false;
+    }
+    *value = field->get<int64_t>();
+    return true;
+}
+
+static bool matches(const Filter &filter, const json &record) {
+    std::string str;
+    if (!stringField(record, "level", &str) || parseLevel(str.c_str()) > filter.maxLevel) {
+        return false;
+    }
+
+    int64_t ts = 0;
+    numberField(record, "ts", &ts);
+    if (ts < filter.since || ts >= filter.until) {
+        return false;
+    }
+
+    if (!filter.logger.empty()
+        && (!stringField(record, "logger", &str) || str != filter.logger)) {
+        return false;
+    }
+
+    int64_t id;
+    if (filter.hasUpdate && (!numberField(record, "update", &id) || id != filter.update)) {
+        return false;
+    }
+    if (filter.hasChat && (!numberField(record, "chat", &id) || id != filter.chat)) {
+        return false;
+    }
+
+    if (!filter.text.empty()
+        && (!stringField(record, "msg", &str) || str.find(filter.text) == std::string::npos)) {
+        return false;
+    }
+    return true;
+}
+
+static void print(const json &record) {
+    int64_t ts = 0;
+    numberField(record, "ts", &ts);
+    time_t seconds = ts / 1000;
+    struct tm local;
+    localtime_r(&seconds, &local);
+    char timeStr[32];
+    strftime(timeStr, sizeof(timeStr), "%Y-%m-%d %H:%M:%S", &local);
+
+    std::string context;
+    int64_t id;
+    if (numberField(record, "update", &id)) {
+        context += " update=" + std::to_string(id);
+    }
+    if (numberField(record, "chat", &id)) {
+        context += " chat=" + std::to_string(id);
+    }
+
+    // matches() already made sure the level is there
+    std::string level, name, message;
+    stringField(record, "level", &level);
+    stringField(record, "logger", &name);
+    stringField(record, "msg", &message);
+    printf("%s.%03d %s [%s]%s\t- %s\n", timeStr, static_cast<int>(ts % 1000),
+           level.c_str(), name.c_str(), context.c_str(), message.c_str());
+}
+
+static void readLog(std::istream &in, const Filter &filter) {
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.empty() || line[0] != '{') {
+            continue; // text lines from before the format was switched
+        }
+
+        json record;
+        try {
+            record = json::parse(line);
+        } catch (std::invalid_argument &e) {
+            continue; // a line cut off by a crash
+        }
+
+        if (!matches(filter, record)) {
+            continue;
+        }
+        if (filter.printJson) {
+            printf("%s\n", line.c_str());
+        } else {
+            print(record);
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    Filter filter;
+    int opt;
+    while ((opt = getopt(argc, argv, "l:n:u:c:s:e:g:jh")) != -1) {
+        switch (opt) {
+        case 'l':
+            filter.maxLevel = parseLevel(optarg);
+            if (filter.maxLevel < 0) {
+                fprintf(stderr, "Unknown level %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'n':
+            filter.logger = optarg;
+            break;
+        case 'u':
+        case 'c':
+            if (!parseId(optarg, opt == 'u' ? &filter.update : &filter.chat)) {
+                fprintf(stderr, "Bad id %s\n", optarg);
+                return 1;
+            }
+            (opt == 'u' ? filter.hasUpdate : filter.hasChat) = true;
+            break;
+        case 's':
+        case 'e':
+            if (!parseTime(optarg, opt == 's' ? &filter.since : &filter.until)) {
+                fprintf(stderr, "Bad time %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'g':
+            filter.text = optarg;
+            break;
+        case 'j':
+            filter.printJson = true;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (optind == argc) {
+        readLog(std::cin, filter);
+        return 0;
+    }
+
+    int status = 0;
+    for (int i = optind; i < argc; ++i) {
+        std::ifstream in(argv[i]);
+        if (!in.good()) {
+            fprintf(stderr, "Could not open %s\n", argv[i]);
+            status = 1;
+            continue;
+        }
+        readLog(in, filter);
+    }
+    return status;
+}